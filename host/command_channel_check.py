@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Runs tools/command_client.py against the host build of the command channel (command_host) on a pty.
+
+    python3 host/command_channel_check.py host/build/command_host
+
+Checks ping, a configuration transaction, a frame with a bad CRC and an inject stream. Exits nonzero on a failure.
+"""
+import os
+import struct
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, os.path.join(ROOT, "tools"))
+import command_client  # noqa: E402
+
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        print("FAIL %s" % what)
+        failures += 1
+
+
+def client(pty, *args):
+    result = subprocess.run([sys.executable, os.path.join(ROOT, "tools", "command_client.py"), pty] + list(args),
+                            capture_output=True, text=True, timeout=30)
+    check(result.returncode == 0, "command_client %s: %s" % (" ".join(args), result.stderr.strip()))
+    return result.stdout
+
+
+def status(channel):
+    values = struct.unpack("<6IB2I", command_client.check(channel, command_client.STATUS)[:33])
+    return dict(zip(command_client.STATUS_FIELDS, values))
+
+
+def main():
+    host = subprocess.Popen([sys.argv[1]], stdout=subprocess.PIPE, text=True)
+    try:
+        pty = host.stdout.readline().strip()
+        check(pty.startswith("/dev/"), "command_host printed %r instead of its pty" % pty)
+        channel = command_client.Channel(pty, 0, 0.5)
+
+        check(client(pty, "ping").startswith("pong"), "ping is answered")
+
+        out = client(pty, "config", "--mode", "2", "--rate", "0,129025,-1,10,5", "--critical", "127250,129026")
+        check(out.strip() == "committed", "config is committed")
+        values = status(channel)
+        check(values["config_generation"] == 1, "one transaction is counted")
+        check(values["mode"] == 2, "the mode of the transaction is applied")
+
+        # A request with a bad CRC is dropped without a response, the next one is answered
+        frame = bytearray(command_client.encode(command_client.PING, 200))
+        frame[-1] ^= 0xFF
+        channel.write(bytes(frame))
+        check(channel.receive() is None, "a frame with a bad CRC is not answered")
+        check(status(channel)["crc_errors"] == 1, "the bad CRC is counted")
+        check(client(pty, "ping").startswith("pong"), "ping is answered after a bad CRC")
+
+        client(pty, "inject", "0", "3", "129025", "42", "0011223344556677", "--count", "500", "--per-frame", "16")
+        values = status(channel)
+        check(values["injected"] == 500, "every injected message is counted, got %d" % values["injected"])
+        check(values["inject_dropped"] == 0, "no injected message is dropped")
+
+        # A record for a controller the gateway does not have is answered as malformed
+        channel.send(command_client.INJECT, command_client.inject_record(7, 3, 129025, 42, b"\x00"))
+        response = channel.receive()
+        check(response is not None and response[0] == command_client.INJECT | command_client.RESPONSE and
+              response[2][0] == 1, "a malformed inject is answered with bad length")
+    finally:
+        host.terminate()
+        host.wait()
+
+    print("%d failures" % failures)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
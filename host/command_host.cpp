@@ -0,0 +1,175 @@
+/**
+ * @file command_host.cpp
+ *
+ * @brief Host build of the command channel, answers tools/command_client.py on a pty
+ *
+ * Prints the path of the pty, then reads frames from it with tCommandParser and answers them like command_task does.
+ * A commit is applied at once, there is no WASM pthread. Injected messages are counted as sent, there are no send
+ * queues. CMD_MODULE_COMMIT counts a swap of a module that passes its checks.
+*/
+#include "command_channel.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define HOST_CONTROLLERS    3       //!< Controller numbers accepted by CMD_INJECT
+#define HOST_MODULE_MAX     65536   //!< Largest module accepted
+
+static int pty = -1;
+static command_config staged;
+static command_status status;
+static command_module module;
+
+static void respond(const command_frame &request, uint8_t code, const uint8_t *data, size_t data_length)
+{
+    static uint8_t payload[CMD_MAX_PAYLOAD];
+    static uint8_t frame[CMD_MAX_FRAME];
+    payload[0] = code;
+    if (data_length > 0) {
+        memcpy(&payload[1], data, data_length);
+    }
+    size_t size = command_encode(request.type | CMD_RESPONSE, request.seq, payload, 1 + data_length, frame, sizeof(frame));
+    if (write(pty, frame, size) != static_cast<ssize_t>(size)) {
+        perror("write");
+    }
+}
+
+static uint8_t commit()
+{
+    if (!staged.open) {
+        return CMD_ERR_NO_CONFIG;
+    }
+    staged.open = false;
+    if (staged.mode >= 0) {
+        status.mode = static_cast<uint8_t>(staged.mode);
+    }
+    status.config_generation++;
+    return CMD_OK;
+}
+
+static bool inject(const command_frame &frame)
+{
+    static NMEA_msg msg;
+    size_t offset = 0;
+    while (command_next_inject(frame, offset, msg, HOST_CONTROLLERS)) {
+        status.injected++;
+    }
+    return offset == frame.length;
+}
+
+static uint8_t module_start(const command_frame &frame)
+{
+    free(module.buffer);
+    uint8_t code = command_module_begin(module, frame, HOST_MODULE_MAX);
+    if (code != CMD_OK) {
+        return code;
+    }
+    module.buffer = static_cast<uint8_t*>(malloc(module.size));
+    if (module.buffer == NULL) {
+        module.open = false;
+        return CMD_ERR_FULL;
+    }
+    return CMD_OK;
+}
+
+static uint8_t module_commit()
+{
+    uint8_t code = command_module_finish(module);
+    if (code == CMD_OK) {
+        status.module_swaps++;
+    }
+    free(module.buffer);
+    module.buffer = NULL;
+    return code;
+}
+
+static void handle(const tCommandParser &parser, const command_frame &frame)
+{
+    switch (frame.type) {
+    case CMD_INJECT:
+        if (!inject(frame)) {
+            respond(frame, CMD_ERR_LENGTH, NULL, 0);
+        }
+        break;
+    case CMD_PING:
+        respond(frame, CMD_OK, NULL, 0);
+        break;
+    case CMD_STATUS: {
+        status.frames = parser.FrameCount;
+        status.crc_errors = parser.CrcErrorCount;
+        status.length_errors = parser.LengthErrorCount;
+        uint8_t data[40];
+        respond(frame, CMD_OK, data, command_status_encode(status, data));
+        break;
+    }
+    case CMD_CONFIG_BEGIN:
+        command_config_begin(staged);
+        respond(frame, CMD_OK, NULL, 0);
+        break;
+    case CMD_CONFIG_COMMIT:
+        respond(frame, commit(), NULL, 0);
+        break;
+    case CMD_MODULE_BEGIN:
+        respond(frame, module_start(frame), NULL, 0);
+        break;
+    case CMD_MODULE_DATA:
+        respond(frame, command_module_write(module, frame), NULL, 0);
+        break;
+    case CMD_MODULE_COMMIT:
+        respond(frame, module_commit(), NULL, 0);
+        break;
+    default:
+        respond(frame, command_config_stage(staged, frame), NULL, 0);
+        break;
+    }
+}
+
+int main()
+{
+    pty = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty < 0 || grantpt(pty) != 0 || unlockpt(pty) != 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    // Keep the client side open in raw mode, so the pty stays up between clients and passes every byte
+    const char *path = ptsname(pty);
+    int client = open(path, O_RDWR | O_NOCTTY);
+    struct termios raw;
+    if (client < 0 || tcgetattr(client, &raw) != 0) {
+        perror(path);
+        return 1;
+    }
+    cfmakeraw(&raw);
+    tcsetattr(client, TCSANOW, &raw);
+    printf("%s\n", path);
+    fflush(stdout);
+
+    static tCommandParser parser;
+    static uint8_t chunk[256];
+    status.mode = 1;
+    for (;;) {
+        struct pollfd fd = {pty, POLLIN, 0};
+        if (poll(&fd, 1, -1) < 0) {
+            perror("poll");
+            return 1;
+        }
+        ssize_t len = read(pty, chunk, sizeof(chunk));
+        if (len < 0) {
+            perror("read");
+            return 1;
+        }
+        size_t offset = 0;
+        while (offset < static_cast<size_t>(len)) {
+            size_t consumed = 0;
+            bool complete = parser.Feed(&chunk[offset], len - offset, consumed);
+            offset += consumed;
+            if (complete) {
+                handle(parser, parser.GetFrame());
+            }
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/**
+ * @file echo_filter_check.cpp
+ *
+ * @brief Host check of tEchoFilter, see echo_filter.h
+*/
+#include "echo_filter.h"
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+int main()
+{
+    tEchoFilter filter;
+    const uint8_t heading[8] = {0xff, 0x10, 0x27, 0x00, 0x00, 0x00, 0x00, 0xfd};
+    uint32_t can_id = tEchoFilter::CanId(2, 127250, 35);
+    uint32_t hash = tEchoFilter::PayloadHash(heading, sizeof(heading));
+    int64_t now = 1000000;
+
+    // Received on controller 1 and forwarded to controller 0
+    CHECK(!filter.IsEcho(1, can_id, hash, now));
+    filter.Record(0, can_id, hash, now);
+
+    // Our frame comes back on controller 0
+    CHECK(filter.IsEcho(0, can_id, hash, now + 1000));
+
+    // The next unchanged period of the same message on its ingress bus is not ours
+    CHECK(!filter.IsEcho(1, can_id, hash, now + 1000));
+
+    // Forwarded to two buses, each one recognizes its own echo
+    filter.Record(2, can_id, hash, now);
+    CHECK(filter.IsEcho(0, can_id, hash, now + 2000));
+    CHECK(filter.IsEcho(2, can_id, hash, now + 2000));
+    CHECK(!filter.IsEcho(1, can_id, hash, now + 2000));
+
+    // A different payload or an expired record is not an echo
+    const uint8_t changed[8] = {0xff, 0x11, 0x27, 0x00, 0x00, 0x00, 0x00, 0xfd};
+    CHECK(!filter.IsEcho(0, can_id, tEchoFilter::PayloadHash(changed, sizeof(changed)), now + 1000));
+    CHECK(!filter.IsEcho(0, can_id, hash, now + ECHO_FILTER_WINDOW_US));
+    CHECK(filter.RecordedCount == 2);
+    CHECK(filter.EvictedCount == 0);
+
+    if (failures == 0) {
+        printf("echo_filter_check: ok\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file load_ramp_check.cpp
+ *
+ * @brief Host check of tTrafficGenerator and tLoadRamp against a tMcp2515Sim, see load_gen.h
+ *
+ * Ramps single frame traffic into the CAN side of the model like load_test_mcp_sim does for mcp_sim_rx. Time is
+ * simulated, the reader works for one tick after the arrivals of the tick and every frame costs the time its READ
+ * STATUS and READ RX BUFFER transactions hold the SPI bus. That gives a known ceiling, the sustained rate the ramp
+ * finds must be within one step below it.
+*/
+#include "load_gen.h"
+#include "mcp2515_sim.h"
+#include <stdio.h>
+
+#define RAMP_START_RATE     5000    // Messages per second of the first step
+#define RAMP_STEP_RATE      5000    // Rate added after every clean step
+#define RAMP_MAX_RATE       200000  // Far above the ceiling, the ramp must end on drops
+#define RAMP_DROP_PER_MILLE 1
+#define RAMP_STEP_US        1000000
+#define RAMP_DRAIN_US       100000
+#define RAMP_TICK_US        100
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static const uint8_t read_status[2] = {0xA0, 0x00};
+static const uint8_t read_rx_buffer[2][14] = {{0x90}, {0x94}};
+
+/// @brief Reads one frame out of the model, false if none is waiting
+static bool read_frame(tMcp2515Sim &sim)
+{
+    uint8_t rx[14];
+    sim.Transfer(read_status, rx, sizeof(read_status));
+    if ((rx[1] & 0x03) == 0) {
+        return false;
+    }
+    int i = (rx[1] & 0x01) ? 0 : 1;
+    sim.Transfer(read_rx_buffer[i], rx, sizeof(read_rx_buffer[i]));
+    return true;
+}
+
+int main()
+{
+    static tMcp2515Sim sim;
+    static NMEA_msg msg;
+    tTrafficGenerator generator(BENCH_MIX_SINGLE_FRAME, 0, 1);
+    tLoadRamp ramp(RAMP_START_RATE, RAMP_STEP_RATE, RAMP_MAX_RATE, RAMP_DROP_PER_MILLE);
+
+    // Bus time of one frame: a READ STATUS and a READ RX BUFFER transaction
+    sim.Transfer(read_status, NULL, sizeof(read_status));
+    sim.Transfer(read_rx_buffer[0], NULL, sizeof(read_rx_buffer[0]));
+    const uint64_t frame_ns = sim.BusTimeNs();
+    const uint32_t ceiling = static_cast<uint32_t>(1000000000ULL / frame_ns);
+    sim.ResetCounters();
+
+    int64_t now = 0;
+    uint32_t last_rate = 0;
+    while (!ramp.Done()) {
+        uint32_t offered = 0;
+        uint32_t delivered = 0;
+        int64_t carried_ns = 0;
+        const int64_t start = now;
+        generator.SetRate(ramp.CurrentRate(), start);
+        for (;;) {
+            now += RAMP_TICK_US;
+            bool arriving = now - start <= RAMP_STEP_US;
+            if ((!arriving && sim.Pending() == 0) || now - start > RAMP_STEP_US + RAMP_DRAIN_US) {
+                break;
+            }
+            size_t due = arriving ? generator.Due(now) : 0;
+            for (size_t i = 0; i < due; i++) {
+                generator.Next(msg);
+                sim.Receive((static_cast<unsigned long>(msg.priority) << 26) | (msg.PGN << 8) | msg.source,
+                    static_cast<uint8_t>(msg.data_length_bytes), msg.data);
+                offered++;
+            }
+
+            // The reader works until the tick is used up
+            const uint64_t bus_start_ns = sim.BusTimeNs();
+            int64_t spent_ns = carried_ns;
+            while (spent_ns < RAMP_TICK_US * 1000LL && read_frame(sim)) {
+                delivered++;
+                spent_ns = carried_ns + static_cast<int64_t>(sim.BusTimeNs() - bus_start_ns);
+            }
+            carried_ns = spent_ns > RAMP_TICK_US * 1000LL ? spent_ns - RAMP_TICK_US * 1000LL : 0;
+        }
+        while (read_frame(sim)) {} // what is left did not make it through the drain
+        uint32_t dropped = offered - delivered;
+
+        // The generator hands out the rate, give or take the message still pending at the end of the step
+        CHECK(offered + 1 >= ramp.CurrentRate() && offered <= ramp.CurrentRate());
+        CHECK(dropped >= sim.FramesLost);
+        sim.ResetCounters();
+
+        load_test_report("host_mcp_sim_rx", BENCH_MIX_SINGLE_FRAME, ramp.CurrentRate(), offered, delivered, dropped);
+        last_rate = ramp.CurrentRate();
+        ramp.StepDone(offered, delivered, dropped, RAMP_STEP_US);
+    }
+    load_test_report_sustained("host_mcp_sim_rx", BENCH_MIX_SINGLE_FRAME, ramp.SustainedRate());
+
+    // The ramp ends on the first step above the ceiling, the last clean step is at most one step below it
+    CHECK(last_rate < RAMP_MAX_RATE);
+    CHECK(last_rate > ceiling);
+    CHECK(ramp.SustainedRate() <= ceiling);
+    CHECK(ramp.SustainedRate() + RAMP_STEP_RATE > ceiling);
+
+    // A ramp without drops ends at its maximum rate
+    tLoadRamp clean(100, 100, 300, 0);
+    while (!clean.Done()) {
+        clean.StepDone(clean.CurrentRate(), clean.CurrentRate(), 0, RAMP_STEP_US);
+    }
+    CHECK(clean.SustainedRate() == 300);
+
+    if (failures == 0) {
+        printf("load_ramp_check: ok, ceiling %u msgs/s\n", static_cast<unsigned>(ceiling));
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -11,11 +11,16 @@
  * * priority
  * * data_length_bytes 
  * * data array
+ * * timestamp_us
+ * 
+ * timestamp_us is the esp_timer time in microseconds at which the frame completing the message was read from the 
+ * controller (TWAI alert or MCP interrupt). Replayed messages are stamped when they are parsed, 0 means unknown.
  * 
 */
 #ifndef NMEA_MSG_H
 #define NMEA_MSG_H
 
+#include <stdint.h>
 #include <vector>
 
 
@@ -27,6 +32,7 @@ struct NMEA_msg {
     uint8_t priority : 3;
     int data_length_bytes;
     uint8_t data[MaxDataLen];
+    int64_t timestamp_us;
 };
 
 #endif //NMEA_MSG_Hcode 
\ No newline at end of file
@@ -0,0 +1,165 @@
+/**
+ * @file actisense_reader.cpp
+ *
+ * @brief Block oriented Actisense NGT-1 stream parser
+*/
+#include "actisense_reader.h"
+#include <string.h>
+
+#define ACTISENSE_DLE               0x10 // Escape
+#define ACTISENSE_STX               0x02 // Start of text
+#define ACTISENSE_ETX               0x03 // End of text
+#define ACTISENSE_MSG_N2K_DATA      0x93 // N2k message received
+#define ACTISENSE_MSG_N2K_REQUEST   0x94 // N2k message to send
+
+tActisenseBlockReader::tActisenseBlockReader()
+{
+    DefaultSource=65;
+    ControllerNumber=0;
+    MsgCount=0;
+    ErrorCount=0;
+    Reset();
+}
+
+bool tActisenseBlockReader::AppendRun(const uint8_t *run, size_t len)
+{
+    if (MsgWritePos + len > ACTISENSE_MAX_MSG_BUF_LEN) {
+        return false;
+    }
+    memcpy(&MsgBuf[MsgWritePos], run, len);
+    MsgWritePos += len;
+
+    uint8_t sum = ByteSum;
+    for (size_t i = 0; i < len; i++) {
+        sum += run[i];
+    }
+    ByteSum = sum;
+    return true;
+}
+
+bool tActisenseBlockReader::CheckMessage(NMEA_msg &msg)
+{
+    // Buffer holds: type, length, payload..., checksum
+    if (MsgWritePos < 3 || MsgWritePos != MsgBuf[1] + 3) {
+        return false;
+    }
+    // Sum of all bytes including the checksum must be 0
+    if (ByteSum != 0) {
+        return false;
+    }
+
+    const uint8_t type = MsgBuf[0];
+    int i = 2;
+    int min_len;
+    if (type == ACTISENSE_MSG_N2K_DATA) {
+        min_len = 2 + 11 + 1; // type and length, priority, PGN (3), destination, source, timestamp (4), data length, checksum
+    } else if (type == ACTISENSE_MSG_N2K_REQUEST) {
+        min_len = 2 + 6 + 1; // type and length, priority, PGN (3), destination, data length, checksum
+    } else {
+        return false;
+    }
+    if (MsgWritePos < min_len) {
+        return false;
+    }
+
+    msg.controller_number = ControllerNumber;
+    msg.priority = MsgBuf[i++] & 0x07;
+    msg.PGN = (uint32_t)MsgBuf[i] | ((uint32_t)MsgBuf[i+1] << 8) | ((uint32_t)MsgBuf[i+2] << 16);
+    i += 3;
+    i++; // destination, not stored in NMEA_msg
+    if (type == ACTISENSE_MSG_N2K_DATA) {
+        msg.source = MsgBuf[i++];
+        i += 4; // timestamp
+    } else {
+        msg.source = DefaultSource;
+    }
+
+    int data_len = MsgBuf[i++];
+    if (data_len > NMEA_msg::MaxDataLen || i + data_len != MsgWritePos - 1) {
+        return false;
+    }
+    msg.data_length_bytes = data_len;
+    memcpy(msg.data, &MsgBuf[i], data_len);
+    memset(&msg.data[data_len], 0, NMEA_msg::MaxDataLen - data_len);
+    msg.timestamp_us = 0; // the log timestamp is in the clock of the logger, the replay task stamps the message
+    return true;
+}
+
+size_t tActisenseBlockReader::Parse(const uint8_t *buf, size_t len, NMEA_msg *msgs, size_t max_msgs, size_t &consumed)
+{
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    size_t count = 0;
+
+    while (p < end && count < max_msgs) {
+        switch (State) {
+            case WaitStart: {
+                const uint8_t *dle = static_cast<const uint8_t*>(memchr(p, ACTISENSE_DLE, end - p));
+                if (dle == NULL) {
+                    p = end;
+                } else {
+                    p = dle + 1;
+                    State = StartEscape;
+                }
+                break;
+            }
+            case StartEscape:
+                if (*p == ACTISENSE_STX) {
+                    ClearBuffer();
+                    State = InMsg;
+                } else {
+                    State = WaitStart;
+                }
+                p++;
+                break;
+            case InMsg: {
+                // Copy everything up to the next escape in one go
+                const uint8_t *dle = static_cast<const uint8_t*>(memchr(p, ACTISENSE_DLE, end - p));
+                const uint8_t *run_end = (dle == NULL) ? end : dle;
+                if (!AppendRun(p, run_end - p)) {
+                    ErrorCount++;
+                    State = WaitStart;
+                    p = run_end;
+                    break;
+                }
+                p = run_end;
+                if (dle != NULL) {
+                    p++;
+                    State = MsgEscape;
+                }
+                break;
+            }
+            case MsgEscape:
+                if (*p == ACTISENSE_DLE) {
+                    // Escaped DLE is a data byte
+                    if (AppendRun(p, 1)) {
+                        State = InMsg;
+                    } else {
+                        ErrorCount++;
+                        State = WaitStart;
+                    }
+                } else if (*p == ACTISENSE_ETX) {
+                    if (CheckMessage(msgs[count])) {
+                        count++;
+                        MsgCount++;
+                    } else {
+                        ErrorCount++;
+                    }
+                    State = WaitStart;
+                } else if (*p == ACTISENSE_STX) {
+                    // Previous message was cut off, start over
+                    ErrorCount++;
+                    ClearBuffer();
+                    State = InMsg;
+                } else {
+                    ErrorCount++;
+                    State = WaitStart;
+                }
+                p++;
+                break;
+        }
+    }
+
+    consumed = p - buf;
+    return count;
+}
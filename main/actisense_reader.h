@@ -0,0 +1,97 @@
+/**
+ * @file actisense_reader.h
+ *
+ * @brief Block oriented Actisense NGT-1 stream parser
+ *
+ * Replaces the byte by byte tActisenseReader (AddByteToBuffer) with a parser that is fed whole chunks read from a UART
+ * or a log file. Runs of unescaped bytes are located with memchr and copied in one go, and completed messages are
+ * written straight into a caller supplied NMEA_msg array so they can be pushed to a queue in batches.
+ *
+ * Supported message types:
+ *
+ * * 0x93 - N2k message received (priority, PGN, destination, source, timestamp, length, data)
+ * * 0x94 - N2k message to send (priority, PGN, destination, length, data), source is set to the default source
+ *
+ * The parser has no ESP-IDF dependencies so it can also be used on the host.
+*/
+#ifndef ACTISENSE_READER_H
+#define ACTISENSE_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "NMEA_msg.h"
+
+#define ACTISENSE_MAX_MSG_BUF_LEN 300 //!< Same limit as MAX_STREAM_MSG_BUF_LEN in the old tActisenseReader
+
+class tActisenseBlockReader
+{
+protected:
+    enum tState {
+        WaitStart,      //!< Looking for DLE STX
+        StartEscape,    //!< DLE seen while looking for start
+        InMsg,          //!< Copying message bytes
+        MsgEscape       //!< DLE seen inside a message
+    };
+
+    tState State;
+    uint8_t MsgBuf[ACTISENSE_MAX_MSG_BUF_LEN];
+    int MsgWritePos;
+    uint8_t ByteSum;
+    uint8_t DefaultSource;
+    uint8_t ControllerNumber;
+
+    // Statistics
+    unsigned long MsgCount;
+    unsigned long ErrorCount;
+
+    /**
+     * @brief Appends a run of unescaped bytes to the message buffer
+     * @return false if the buffer would overflow, message is discarded
+    */
+    bool AppendRun(const uint8_t *run, size_t len);
+
+    /**
+     * @brief Validates the buffered message and converts it
+     * @param[out] msg filled in if the message is valid
+     * @return true if msg holds a valid message
+    */
+    bool CheckMessage(NMEA_msg &msg);
+
+    void ClearBuffer() { MsgWritePos=0; ByteSum=0; }
+
+public:
+    tActisenseBlockReader();
+
+    /**
+     * @brief Sets the source used for 0x94 messages which do not carry one
+    */
+    void SetDefaultSource(uint8_t source) { DefaultSource=source; }
+
+    /**
+     * @brief Sets the controller number written into every parsed NMEA_msg
+    */
+    void SetControllerNumber(uint8_t controller_number) { ControllerNumber=controller_number; }
+
+    /**
+     * @brief Parses a chunk of the Actisense stream
+     *
+     * Parsing stops when the chunk is used up or when max_msgs messages have been written. Partial messages are kept
+     * between calls, so the stream may be split anywhere. Call again with buf+consumed if consumed < len.
+     *
+     * @param[in] buf chunk of raw stream bytes
+     * @param[in] len number of bytes in buf
+     * @param[out] msgs array that parsed messages are written to
+     * @param[in] max_msgs size of msgs
+     * @param[out] consumed number of bytes of buf that were processed
+     * @return number of messages written to msgs
+    */
+    size_t Parse(const uint8_t *buf, size_t len, NMEA_msg *msgs, size_t max_msgs, size_t &consumed);
+
+    /// @brief Resets the parser state, any partial message is discarded
+    void Reset() { State=WaitStart; ClearBuffer(); }
+
+    unsigned long GetMsgCount() const { return MsgCount; }
+    unsigned long GetErrorCount() const { return ErrorCount; }
+};
+
+#endif //ACTISENSE_READER_H
@@ -0,0 +1,91 @@
+/**
+ * @file benchmark.cpp
+ *
+ * @brief Helpers for the per-message microbenchmarks
+*/
+#include "benchmark.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+
+struct bench_pgn {
+    uint32_t PGN;
+    uint8_t priority;
+    uint8_t length;
+};
+
+static const bench_pgn single_frame_pgns[] = {
+    {127250, 2, 8},   // Vessel heading
+    {129025, 2, 8},   // Position, rapid update
+    {129026, 2, 8},   // COG & SOG, rapid update
+    {127488, 2, 8},   // Engine parameters, rapid update
+    {130306, 2, 8},   // Wind data
+};
+
+static const bench_pgn fast_packet_pgns[] = {
+    {129029, 3, 43},  // GNSS position data
+    {129038, 4, 28},  // AIS class A position report
+    {127489, 2, 26},  // Engine parameters, dynamic
+    {126996, 6, 134}, // Product information
+};
+
+#define SINGLE_FRAME_PGN_COUNT (sizeof(single_frame_pgns) / sizeof(single_frame_pgns[0]))
+#define FAST_PACKET_PGN_COUNT (sizeof(fast_packet_pgns) / sizeof(fast_packet_pgns[0]))
+
+static uint32_t bench_rand(uint32_t &state)
+{
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+const char* bench_mix_name(BENCH_MIX mix)
+{
+    switch (mix) {
+        case BENCH_MIX_SINGLE_FRAME: return "single_frame";
+        case BENCH_MIX_FAST_PACKET: return "fast_packet";
+        case BENCH_MIX_TYPICAL: return "typical";
+        default: return "unknown";
+    }
+}
+
+void bench_fill_mix(NMEA_msg *msgs, size_t n, BENCH_MIX mix, uint8_t controller_number, uint32_t seed)
+{
+    uint32_t state = (seed == 0) ? 1 : seed;
+    for (size_t i = 0; i < n; i++) {
+        bool fast_packet;
+        if (mix == BENCH_MIX_SINGLE_FRAME) {
+            fast_packet = false;
+        } else if (mix == BENCH_MIX_FAST_PACKET) {
+            fast_packet = true;
+        } else {
+            fast_packet = (bench_rand(state) % 5) == 0;
+        }
+
+        const bench_pgn &pgn = fast_packet ? fast_packet_pgns[bench_rand(state) % FAST_PACKET_PGN_COUNT]
+                                           : single_frame_pgns[bench_rand(state) % SINGLE_FRAME_PGN_COUNT];
+        NMEA_msg &msg = msgs[i];
+        msg.controller_number = controller_number;
+        msg.PGN = pgn.PGN;
+        msg.priority = pgn.priority;
+        msg.source = 1 + (bench_rand(state) % 12);
+        msg.data_length_bytes = pgn.length;
+        for (int j = 0; j < pgn.length; j++) {
+            msg.data[j] = static_cast<uint8_t>(bench_rand(state));
+        }
+        memset(&msg.data[pgn.length], 0, NMEA_msg::MaxDataLen - pgn.length);
+        msg.timestamp_us = 0;
+    }
+}
+
+void bench_report(const char *stage, BENCH_MIX mix, uint32_t n, uint64_t cycles, uint32_t cpu_freq_mhz)
+{
+    if (n == 0 || cpu_freq_mhz == 0) {
+        return;
+    }
+    uint64_t cycles_per_msg = cycles / n;
+    uint64_t ns_per_msg = (cycles * 1000) / ((uint64_t)n * cpu_freq_mhz);
+    printf("BENCH,%s,%s,%" PRIu32 ",%" PRIu64 ",%" PRIu64 "\n", stage, bench_mix_name(mix), n, cycles_per_msg, ns_per_msg);
+}
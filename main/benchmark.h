@@ -0,0 +1,59 @@
+/**
+ * @file benchmark.h
+ *
+ * @brief Helpers for the per-message microbenchmarks
+ *
+ * Generates realistic NMEA 2000 message mixes and prints results in a machine readable format:
+ *
+ * `BENCH,<stage>,<mix>,<messages>,<cycles per message>,<ns per message>`
+ *
+ * The mixes are built from PGNs commonly seen on a boat:
+ *
+ * * single frame - heading, position rapid update, COG/SOG, engine rapid update, wind (8 bytes)
+ * * fast packet  - GNSS position, AIS class A position, engine dynamic, product information (26 - 134 bytes)
+*/
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "NMEA_msg.h"
+
+/// @brief Message mixes used by the benchmarks
+enum BENCH_MIX {
+    BENCH_MIX_SINGLE_FRAME = 0, //!< Only single frame PGNs
+    BENCH_MIX_FAST_PACKET = 1,  //!< Only fast packet PGNs
+    BENCH_MIX_TYPICAL = 2,      //!< 80% single frame, 20% fast packet
+    BENCH_MIX_COUNT
+};
+
+/**
+ * @brief Returns the name of a mix for reports
+*/
+const char* bench_mix_name(BENCH_MIX mix);
+
+/**
+ * @brief Fills an array with messages following a mix
+ *
+ * Payloads are pseudo random but deterministic for a given seed, so runs can be compared.
+ *
+ * @param[out] msgs array to fill
+ * @param[in] n number of messages
+ * @param[in] mix message mix
+ * @param[in] controller_number controller number written to every message
+ * @param[in] seed seed for the payload generator
+*/
+void bench_fill_mix(NMEA_msg *msgs, size_t n, BENCH_MIX mix, uint8_t controller_number, uint32_t seed);
+
+/**
+ * @brief Prints one benchmark result line
+ *
+ * @param[in] stage name of the measured function or queue hop
+ * @param[in] mix mix used for the run
+ * @param[in] n number of messages processed
+ * @param[in] cycles total CPU cycles for the run
+ * @param[in] cpu_freq_mhz CPU frequency used to convert cycles to ns
+*/
+void bench_report(const char *stage, BENCH_MIX mix, uint32_t n, uint64_t cycles, uint32_t cpu_freq_mhz);
+
+#endif //BENCHMARK_H
@@ -0,0 +1,128 @@
+/**
+ * @file bus_load.cpp
+ *
+ * @brief Bus load estimation and load shedding ahead of the WASM app
+*/
+#include "bus_load.h"
+#include <string.h>
+
+#define CAN_EXT_FRAME_OVERHEAD_BITS     67  // SOF, 29 bit id, SRR, IDE, RTR, r1, r0, DLC, CRC, delimiters, ACK, EOF, IFS
+#define CAN_STUFFED_BITS                54  // bits before the CRC delimiter that are subject to stuffing, excluding data
+#define FAST_PACKET_FIRST_FRAME_BYTES   6
+#define FAST_PACKET_FRAME_BYTES         7
+
+tBusLoadEstimator::tBusLoadEstimator()
+{
+    memset(SlotBits, 0, sizeof(SlotBits));
+    memset(SlotFrames, 0, sizeof(SlotFrames));
+    CurrentSlot = 0;
+    CurrentSlotStart = 0;
+}
+
+uint32_t tBusLoadEstimator::FramesForMessage(int data_length_bytes)
+{
+    if (data_length_bytes <= 8) {
+        return 1;
+    }
+    return 1 + (data_length_bytes - FAST_PACKET_FIRST_FRAME_BYTES + FAST_PACKET_FRAME_BYTES - 1) / FAST_PACKET_FRAME_BYTES;
+}
+
+uint32_t tBusLoadEstimator::BitsForMessage(int data_length_bytes)
+{
+    // NMEA 2000 frames always carry 8 data bytes except single frame messages that are shorter
+    uint32_t frame_data_bytes = (data_length_bytes < 8) ? data_length_bytes : 8;
+    uint32_t frame_bits = CAN_EXT_FRAME_OVERHEAD_BITS + 8 * frame_data_bytes;
+    // Worst case stuffing is one bit in four, random data averages about half of that
+    frame_bits += (CAN_STUFFED_BITS + 8 * frame_data_bytes) / 8;
+    return FramesForMessage(data_length_bytes) * frame_bits;
+}
+
+void tBusLoadEstimator::Advance(int64_t now_us)
+{
+    if (CurrentSlotStart == 0) {
+        CurrentSlotStart = now_us;
+        return;
+    }
+    int64_t elapsed_slots = (now_us - CurrentSlotStart) / BUS_LOAD_SLOT_US;
+    if (elapsed_slots <= 0) {
+        return;
+    }
+    if (elapsed_slots > BUS_LOAD_WINDOW_SLOTS) {
+        elapsed_slots = BUS_LOAD_WINDOW_SLOTS;
+    }
+    for (int64_t i = 0; i < elapsed_slots; i++) {
+        CurrentSlot = (CurrentSlot + 1) % BUS_LOAD_WINDOW_SLOTS;
+        SlotBits[CurrentSlot] = 0;
+        SlotFrames[CurrentSlot] = 0;
+    }
+    CurrentSlotStart = now_us - ((now_us - CurrentSlotStart) % BUS_LOAD_SLOT_US);
+}
+
+void tBusLoadEstimator::AddMessage(int data_length_bytes, int64_t now_us)
+{
+    Advance(now_us);
+    SlotBits[CurrentSlot] += BitsForMessage(data_length_bytes);
+    SlotFrames[CurrentSlot] += FramesForMessage(data_length_bytes);
+}
+
+uint32_t tBusLoadEstimator::BitsPerSecond(int64_t now_us)
+{
+    Advance(now_us);
+    uint64_t bits = 0;
+    for (int i = 0; i < BUS_LOAD_WINDOW_SLOTS; i++) {
+        bits += SlotBits[i];
+    }
+    return static_cast<uint32_t>((bits * 1000000) / (BUS_LOAD_WINDOW_SLOTS * BUS_LOAD_SLOT_US));
+}
+
+uint32_t tBusLoadEstimator::FramesPerSecond(int64_t now_us)
+{
+    Advance(now_us);
+    uint64_t frames = 0;
+    for (int i = 0; i < BUS_LOAD_WINDOW_SLOTS; i++) {
+        frames += SlotFrames[i];
+    }
+    return static_cast<uint32_t>((frames * 1000000) / (BUS_LOAD_WINDOW_SLOTS * BUS_LOAD_SLOT_US));
+}
+
+//-----------------------------------------------------------------------------------------------------------------------------
+
+tLoadShedder::tLoadShedder()
+{
+    Config = NULL;
+    SampleCounter = 0;
+    ShedCount = 0;
+    SampledOutCount = 0;
+}
+
+bool tLoadShedder::IsCritical(uint32_t PGN) const
+{
+    for (size_t i = 0; i < Config->critical_pgn_count; i++) {
+        if (Config->critical_pgns[i] == PGN) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool tLoadShedder::Admit(uint32_t PGN, uint8_t priority, uint32_t bus_utilization_percent, uint32_t queue_fill_percent)
+{
+    if (Config == NULL) {
+        return true;
+    }
+    bool overloaded = bus_utilization_percent >= Config->overload_percent
+                   || queue_fill_percent >= Config->queue_high_water_percent;
+    if (!overloaded || IsCritical(PGN)) {
+        return true;
+    }
+    if (priority >= Config->low_priority) {
+        ShedCount++;
+        return false;
+    }
+    SampleCounter++;
+    if (Config->sample_rate <= 1 || (SampleCounter % Config->sample_rate) == 0) {
+        return true;
+    }
+    SampledOutCount++;
+    return false;
+}
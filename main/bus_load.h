@@ -0,0 +1,106 @@
+/**
+ * @file bus_load.h
+ *
+ * @brief Bus load estimation and load shedding ahead of the WASM app
+ *
+ * tBusLoadEstimator keeps a sliding window of received bits and frames for one controller. Bits are estimated from
+ * the message length: an extended CAN frame with n data bytes is 67 + 8n bits plus bit stuffing, and a fast packet
+ * message of length L is sent as 1 + ceil((L - 6) / 7) frames of 8 data bytes.
+ *
+ * tLoadShedder decides whether a received message is passed to the WASM app. When the bus it came from or the rx
+ * queue is overloaded, critical PGNs are always admitted, low priority PGNs are shed and all other PGNs are sampled.
+ *
+ * Both classes take the time as a parameter and have no ESP-IDF dependencies. Reading the load also moves the window, so
+ * readers on other tasks need the same lock as the writer.
+*/
+#ifndef BUS_LOAD_H
+#define BUS_LOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUS_LOAD_WINDOW_SLOTS   10          //!< Number of slots in the sliding window
+#define BUS_LOAD_SLOT_US        100000      //!< Length of one slot, window is BUS_LOAD_WINDOW_SLOTS * BUS_LOAD_SLOT_US
+#define NMEA2000_BITRATE        250000      //!< NMEA 2000 bus bit rate
+
+class tBusLoadEstimator
+{
+protected:
+    uint32_t SlotBits[BUS_LOAD_WINDOW_SLOTS];
+    uint32_t SlotFrames[BUS_LOAD_WINDOW_SLOTS];
+    int CurrentSlot;
+    int64_t CurrentSlotStart;
+
+    /**
+     * @brief Moves the window forward to now, clearing slots that have expired
+    */
+    void Advance(int64_t now_us);
+
+public:
+    tBusLoadEstimator();
+
+    /**
+     * @brief Adds a received message to the window
+     * @param[in] data_length_bytes length of the NMEA 2000 message
+     * @param[in] now_us current time in microseconds
+    */
+    void AddMessage(int data_length_bytes, int64_t now_us);
+
+    /// @brief Estimated bits per second on the bus over the window
+    uint32_t BitsPerSecond(int64_t now_us);
+
+    /// @brief Frames per second on the bus over the window
+    uint32_t FramesPerSecond(int64_t now_us);
+
+    /// @brief Estimated bus utilization in percent
+    uint32_t UtilizationPercent(int64_t now_us) { return Utilization(BitsPerSecond(now_us)); }
+
+    /// @brief Bus utilization in percent at a bit rate
+    static uint32_t Utilization(uint32_t bits_per_s) { return (bits_per_s * 100) / NMEA2000_BITRATE; }
+
+    /// @brief Number of CAN frames used to send a message
+    static uint32_t FramesForMessage(int data_length_bytes);
+
+    /// @brief Estimated number of bits on the wire used to send a message, including stuffing
+    static uint32_t BitsForMessage(int data_length_bytes);
+};
+
+/// @brief Settings for tLoadShedder
+struct load_shedder_config {
+    uint32_t overload_percent;          //!< Bus utilization above which the bus is overloaded
+    uint32_t queue_high_water_percent;  //!< RX queue fill level above which the WASM stage is overloaded
+    uint8_t low_priority;               //!< Messages with this priority or higher (lower urgency) are shed under overload
+    uint32_t sample_rate;               //!< 1 in sample_rate of other non critical messages is admitted under overload
+    const uint32_t *critical_pgns;      //!< PGNs that are always admitted
+    size_t critical_pgn_count;
+};
+
+class tLoadShedder
+{
+protected:
+    const load_shedder_config *Config;
+    uint32_t SampleCounter;
+
+public:
+    unsigned long ShedCount;        //!< Low priority messages dropped
+    unsigned long SampledOutCount;  //!< Non critical messages dropped by sampling
+
+    tLoadShedder();
+
+    void SetConfig(const load_shedder_config *config) { Config=config; }
+
+    /**
+     * @brief Decides if a message is passed on to the WASM app
+     * @param[in] PGN
+     * @param[in] priority
+     * @param[in] bus_utilization_percent utilization of the bus the message was received on
+     * @param[in] queue_fill_percent fill level of the rx queue
+     * @return true if the message should be admitted
+    */
+    bool Admit(uint32_t PGN, uint8_t priority, uint32_t bus_utilization_percent, uint32_t queue_fill_percent);
+
+    /// @brief true if the message is on the critical list
+    bool IsCritical(uint32_t PGN) const;
+};
+
+#endif //BUS_LOAD_H
@@ -0,0 +1,271 @@
+/**
+ * @file command_channel.cpp
+ *
+ * @brief Framed binary commands from the Raspberry Pi
+*/
+#include "command_channel.h"
+#include "telemetry.h"
+#include "wasm_image.h"
+#include <string.h>
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) |
+        (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+/// @brief CRC of a frame without its sync bytes, header is type, seq and length
+static uint16_t frame_crc(const uint8_t *header, const uint8_t *payload, uint16_t length)
+{
+    return telemetry_crc16(payload, length, telemetry_crc16(header, CMD_HEADER_BYTES - 2));
+}
+
+tCommandParser::tCommandParser()
+{
+    State = WAIT_SYNC0;
+    Pos = 0;
+    FrameCount = 0;
+    CrcErrorCount = 0;
+    LengthErrorCount = 0;
+}
+
+bool tCommandParser::Feed(const uint8_t *data, size_t length, size_t &consumed)
+{
+    consumed = 0;
+    while (consumed < length) {
+        uint8_t byte = data[consumed++];
+        switch (State) {
+        case WAIT_SYNC0:
+            if (byte == CMD_SYNC0) {
+                State = WAIT_SYNC1;
+            }
+            break;
+        case WAIT_SYNC1:
+            State = (byte == CMD_SYNC1) ? HEADER : (byte == CMD_SYNC0 ? WAIT_SYNC1 : WAIT_SYNC0);
+            Pos = 0;
+            break;
+        case HEADER:
+            Header[Pos++] = byte;
+            if (Pos == sizeof(Header)) {
+                Frame.type = Header[0];
+                Frame.seq = Header[1];
+                Frame.length = get_u16(&Header[2]);
+                Pos = 0;
+                if (Frame.length > CMD_MAX_PAYLOAD) {
+                    LengthErrorCount++;
+                    State = WAIT_SYNC0;
+                }
+                else {
+                    State = (Frame.length == 0) ? CRC : PAYLOAD;
+                }
+            }
+            break;
+        case PAYLOAD:
+            Frame.payload[Pos++] = byte;
+            if (Pos == Frame.length) {
+                Pos = 0;
+                State = CRC;
+            }
+            break;
+        case CRC:
+            Crc[Pos++] = byte;
+            if (Pos == CMD_CRC_BYTES) {
+                State = WAIT_SYNC0;
+                if (get_u16(Crc) != frame_crc(Header, Frame.payload, Frame.length)) {
+                    CrcErrorCount++;
+                    break;
+                }
+                FrameCount++;
+                return true;
+            }
+            break;
+        }
+    }
+    return false;
+}
+
+size_t command_encode(uint8_t type, uint8_t seq, const uint8_t *payload, uint16_t length, uint8_t *out, size_t out_size)
+{
+    size_t size = CMD_HEADER_BYTES + length + CMD_CRC_BYTES;
+    if (length > CMD_MAX_PAYLOAD || out_size < size) {
+        return 0;
+    }
+    out[0] = CMD_SYNC0;
+    out[1] = CMD_SYNC1;
+    out[2] = type;
+    out[3] = seq;
+    out[4] = length & 0xff;
+    out[5] = length >> 8;
+    if (length > 0) {
+        memcpy(&out[CMD_HEADER_BYTES], payload, length);
+    }
+    uint16_t crc = frame_crc(&out[2], &out[CMD_HEADER_BYTES], length);
+    out[CMD_HEADER_BYTES + length] = crc & 0xff;
+    out[CMD_HEADER_BYTES + length + 1] = crc >> 8;
+    return size;
+}
+
+void command_config_begin(command_config &config)
+{
+    config.open = true;
+    config.mode = -1;
+    config.rate_rule_count = 0;
+    config.critical_set = false;
+    config.critical_pgn_count = 0;
+}
+
+uint8_t command_config_stage(command_config &config, const command_frame &frame)
+{
+    if (!config.open) {
+        return CMD_ERR_NO_CONFIG;
+    }
+    switch (frame.type) {
+    case CMD_CONFIG_MODE:
+        if (frame.length != 1) {
+            return CMD_ERR_LENGTH;
+        }
+        if (frame.payload[0] > 3) {
+            return CMD_ERR_RANGE;
+        }
+        config.mode = frame.payload[0];
+        return CMD_OK;
+    case CMD_CONFIG_RATE: {
+        if (frame.length != CMD_RATE_RULE_BYTES) {
+            return CMD_ERR_LENGTH;
+        }
+        if (config.rate_rule_count >= CMD_MAX_RATE_RULES) {
+            return CMD_ERR_FULL;
+        }
+        rate_limit_rule &rule = config.rate_rules[config.rate_rule_count];
+        rule.controller_number = static_cast<int8_t>(frame.payload[0]);
+        rule.PGN = static_cast<int32_t>(get_u32(&frame.payload[1]));
+        rule.source = static_cast<int16_t>(get_u16(&frame.payload[5]));
+        rule.rate_per_s = get_u32(&frame.payload[7]);
+        rule.burst = get_u32(&frame.payload[11]);
+        if (rule.controller_number < RATE_LIMIT_ANY || rule.PGN < RATE_LIMIT_ANY || rule.source < RATE_LIMIT_ANY ||
+            rule.source > 0xff) {
+            return CMD_ERR_RANGE;
+        }
+        config.rate_rule_count++;
+        return CMD_OK;
+    }
+    case CMD_CONFIG_CRITICAL:
+        if (frame.length % 4 != 0) {
+            return CMD_ERR_LENGTH;
+        }
+        if (frame.length / 4 > CMD_MAX_CRITICAL_PGNS) {
+            return CMD_ERR_FULL;
+        }
+        config.critical_pgn_count = frame.length / 4;
+        for (size_t i = 0; i < config.critical_pgn_count; i++) {
+            config.critical_pgns[i] = get_u32(&frame.payload[i * 4]);
+        }
+        config.critical_set = true;
+        return CMD_OK;
+    default:
+        return CMD_ERR_UNKNOWN;
+    }
+}
+
+bool command_next_inject(const command_frame &frame, size_t &offset, NMEA_msg &msg, uint8_t controller_count)
+{
+    if (offset + CMD_INJECT_HEADER_BYTES > frame.length) {
+        return false;
+    }
+    const uint8_t *record = &frame.payload[offset];
+    uint8_t data_length = record[7];
+    uint32_t PGN = get_u32(&record[2]);
+    if (record[0] >= controller_count || record[1] > 7 || PGN > 0x3ffff || data_length > NMEA_msg::MaxDataLen ||
+        offset + CMD_INJECT_HEADER_BYTES + data_length > frame.length) {
+        return false;
+    }
+    msg.controller_number = record[0];
+    msg.priority = record[1];
+    msg.PGN = PGN;
+    msg.source = record[6];
+    msg.data_length_bytes = data_length;
+    memcpy(msg.data, &record[CMD_INJECT_HEADER_BYTES], data_length);
+    offset += CMD_INJECT_HEADER_BYTES + data_length;
+    return true;
+}
+
+uint8_t command_module_begin(command_module &module, const command_frame &frame, uint32_t max_size)
+{
+    module.open = false;
+    module.buffer = NULL;
+    module.received = 0;
+    if (frame.length != CMD_MODULE_BEGIN_BYTES) {
+        return CMD_ERR_LENGTH;
+    }
+    module.size = get_u32(&frame.payload[0]);
+    module.crc = get_u16(&frame.payload[4]);
+    module.flags = frame.payload[6];
+    if (module.size == 0 || (module.flags & ~CMD_MODULE_PERSIST) != 0) {
+        return CMD_ERR_RANGE;
+    }
+    if (module.size > max_size) {
+        return CMD_ERR_FULL;
+    }
+    module.open = true;
+    return CMD_OK;
+}
+
+uint8_t command_module_write(command_module &module, const command_frame &frame)
+{
+    if (!module.open || module.buffer == NULL) {
+        return CMD_ERR_NO_CONFIG;
+    }
+    if (frame.length < CMD_MODULE_OFFSET_BYTES) {
+        return CMD_ERR_LENGTH;
+    }
+    uint32_t offset = get_u32(&frame.payload[0]);
+    uint32_t length = frame.length - CMD_MODULE_OFFSET_BYTES;
+    if (offset > module.received || length > module.size - offset) {
+        return CMD_ERR_RANGE;
+    }
+    if (offset + length <= module.received) {
+        return CMD_OK; // sent again after a lost response
+    }
+    memcpy(&module.buffer[offset], &frame.payload[CMD_MODULE_OFFSET_BYTES], length);
+    module.received = offset + length;
+    return CMD_OK;
+}
+
+uint8_t command_module_finish(command_module &module)
+{
+    if (!module.open || module.buffer == NULL) {
+        return CMD_ERR_NO_CONFIG;
+    }
+    module.open = false;
+    if (module.received != module.size || !wasm_image_check(module.buffer, module.size, module.crc)) {
+        return CMD_ERR_CHECK;
+    }
+    return CMD_OK;
+}
+
+size_t command_status_encode(const command_status &status, uint8_t *out)
+{
+    put_u32(&out[0], status.config_generation);
+    put_u32(&out[4], status.frames);
+    put_u32(&out[8], status.crc_errors);
+    put_u32(&out[12], status.length_errors);
+    put_u32(&out[16], status.injected);
+    put_u32(&out[20], status.inject_dropped);
+    out[24] = status.mode;
+    put_u32(&out[25], status.module_swaps);
+    put_u32(&out[29], status.module_swap_us);
+    return 33;
+}
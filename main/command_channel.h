@@ -0,0 +1,207 @@
+/**
+ * @file command_channel.h
+ *
+ * @brief Framed binary commands from the Raspberry Pi
+ *
+ * A frame is
+ *
+ * | bytes | field                                               |
+ * |-------|-----------------------------------------------------|
+ * | 2     | CMD_SYNC0, CMD_SYNC1                                |
+ * | 1     | type, a CMD_TYPE. Responses have CMD_RESPONSE set   |
+ * | 1     | seq, copied into the response                       |
+ * | 2     | payload length, little endian, up to CMD_MAX_PAYLOAD |
+ * | n     | payload, multi byte fields little endian            |
+ * | 2     | CRC-16/XMODEM of type, seq, length and payload, little endian, like telemetry_crc16 |
+ *
+ * Configuration is sent as a transaction: CMD_CONFIG_BEGIN, any number of CMD_CONFIG_* frames that fill a staged
+ * command_config, then CMD_CONFIG_COMMIT, which applies all of it at once. Every request except CMD_INJECT is answered
+ * with a frame of type `request | CMD_RESPONSE` whose payload starts with a CMD_STATUS_CODE.
+ *
+ * CMD_INJECT is the streaming channel for messages to be sent on the buses. It carries one or more records of
+ * controller (1), priority (1), PGN (4), source (1), data length (1) and data, and is not answered unless it is
+ * malformed, so the Pi can send at line rate. Messages that do not fit a send queue are counted, see CMD_STATUS.
+ *
+ * A new WASM app is streamed as CMD_MODULE_BEGIN, CMD_MODULE_DATA frames with consecutive offsets and
+ * CMD_MODULE_COMMIT, which checks the module and hands it to the gateway to be swapped in. A CMD_MODULE_DATA frame that
+ * is sent again after a lost response is answered with CMD_OK and not written twice.
+ *
+ * The parser and encoder have no ESP-IDF dependencies, the same code can run on the host against a pty.
+*/
+#ifndef COMMAND_CHANNEL_H
+#define COMMAND_CHANNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "NMEA_msg.h"
+#include "rate_limit.h"
+
+#define CMD_SYNC0               0xa5
+#define CMD_SYNC1               0x5a
+#define CMD_MAX_PAYLOAD         512
+#define CMD_HEADER_BYTES        6   //!< Sync, type, seq and length
+#define CMD_CRC_BYTES           2
+#define CMD_MAX_FRAME           (CMD_HEADER_BYTES + CMD_MAX_PAYLOAD + CMD_CRC_BYTES)
+#define CMD_MAX_RATE_RULES      8   //!< Rate rules in one transaction
+#define CMD_MAX_CRITICAL_PGNS   16  //!< Length of the critical PGN list
+#define CMD_RATE_RULE_BYTES     15  //!< Payload of CMD_CONFIG_RATE
+#define CMD_INJECT_HEADER_BYTES 8   //!< Record header in CMD_INJECT, followed by the data
+#define CMD_MODULE_BEGIN_BYTES  7   //!< Payload of CMD_MODULE_BEGIN
+#define CMD_MODULE_OFFSET_BYTES 4   //!< Offset in CMD_MODULE_DATA, followed by the module bytes
+#define CMD_MODULE_PERSIST      0x01 //!< CMD_MODULE_BEGIN flag, also write the module to the wasm_app partition
+
+enum CMD_TYPE {
+    CMD_PING            = 0x01, //!< No payload, answered with CMD_OK
+    CMD_STATUS          = 0x02, //!< No payload, answered with CMD_OK and a command_status
+    CMD_CONFIG_BEGIN    = 0x10, //!< Starts a transaction, discards a staged one
+    CMD_CONFIG_MODE     = 0x11, //!< u8 T connector mode 0 - 3
+    CMD_CONFIG_RATE     = 0x12, //!< i8 controller, i32 PGN, i16 source, u32 rate per s, u32 burst, see SetTxRate
+    CMD_CONFIG_CRITICAL = 0x13, //!< u32 PGNs replacing the list of PGNs that are never shed, may be empty
+    CMD_CONFIG_COMMIT   = 0x1f, //!< Applies the staged configuration
+    CMD_INJECT          = 0x20, //!< Messages to send, see the file description
+    CMD_MODULE_BEGIN    = 0x30, //!< u32 module size, u16 CRC-16/XMODEM of the module, u8 flags. Discards a started module
+    CMD_MODULE_DATA     = 0x31, //!< u32 offset, module bytes
+    CMD_MODULE_LOAD     = 0x32, //!< No payload, swaps in the module stored in the wasm_app partition
+    CMD_MODULE_COMMIT   = 0x3f, //!< Checks the streamed module and swaps it in, the swap is reported by CMD_STATUS
+    CMD_RESPONSE        = 0x80
+};
+
+enum CMD_STATUS_CODE {
+    CMD_OK              = 0,
+    CMD_ERR_LENGTH      = 1,    //!< Payload length does not match the type
+    CMD_ERR_UNKNOWN     = 2,    //!< Unknown type
+    CMD_ERR_RANGE       = 3,    //!< A field is out of range
+    CMD_ERR_NO_CONFIG   = 4,    //!< CMD_CONFIG_* without CMD_CONFIG_BEGIN
+    CMD_ERR_FULL        = 5,    //!< More rules or PGNs than fit, or a module larger than fits
+    CMD_ERR_BUSY        = 6,    //!< A module is still being loaded
+    CMD_ERR_CHECK       = 7     //!< The module is incomplete, not a WASM binary or does not match its CRC
+};
+
+/// @brief A received frame
+struct command_frame {
+    uint8_t type;
+    uint8_t seq;
+    uint16_t length;
+    uint8_t payload[CMD_MAX_PAYLOAD];
+};
+
+/// @brief Configuration staged by a transaction
+struct command_config {
+    bool open;                                          //!< Between CMD_CONFIG_BEGIN and CMD_CONFIG_COMMIT
+    int mode;                                           //!< New T connector mode, -1 to keep
+    rate_limit_rule rate_rules[CMD_MAX_RATE_RULES];     //!< Added to the WASM rate limits, burst 0 removes a rule
+    size_t rate_rule_count;
+    bool critical_set;                                  //!< critical_pgns replaces the list
+    uint32_t critical_pgns[CMD_MAX_CRITICAL_PGNS];
+    size_t critical_pgn_count;
+};
+
+/// @brief WASM module being streamed
+struct command_module {
+    bool open;                      //!< Between CMD_MODULE_BEGIN and CMD_MODULE_COMMIT
+    uint8_t *buffer;                //!< size bytes, provided by the caller after command_module_begin()
+    uint32_t size;
+    uint16_t crc;
+    uint8_t flags;                  //!< CMD_MODULE_PERSIST
+    uint32_t received;              //!< Bytes written to buffer, in order
+};
+
+/// @brief Payload of the CMD_STATUS response after the status code, 33 bytes
+struct command_status {
+    uint32_t config_generation;     //!< Committed transactions since boot
+    uint32_t frames;                //!< Valid frames received
+    uint32_t crc_errors;
+    uint32_t length_errors;         //!< Frames longer than CMD_MAX_PAYLOAD
+    uint32_t injected;              //!< Messages from CMD_INJECT added to a send queue
+    uint32_t inject_dropped;        //!< Messages from CMD_INJECT that did not fit a send queue
+    uint8_t mode;
+    uint32_t module_swaps;          //!< WASM modules swapped in since boot
+    uint32_t module_swap_us;        //!< Time the WASM pthread took for the last swap
+};
+
+class tCommandParser
+{
+protected:
+    enum PARSE_STATE { WAIT_SYNC0, WAIT_SYNC1, HEADER, PAYLOAD, CRC };
+    PARSE_STATE State;
+    uint8_t Header[CMD_HEADER_BYTES - 2];
+    uint8_t Crc[CMD_CRC_BYTES];
+    size_t Pos;
+    command_frame Frame;
+
+public:
+    unsigned long FrameCount;       //!< Valid frames
+    unsigned long CrcErrorCount;    //!< Frames dropped for a CRC mismatch
+    unsigned long LengthErrorCount; //!< Frames dropped for a length above CMD_MAX_PAYLOAD
+
+    tCommandParser();
+
+    /**
+     * @brief Feeds received bytes until a frame is complete
+     *
+     * Bytes before a sync sequence are skipped, so the parser recovers from noise and dropped bytes.
+     *
+     * @param[in] data
+     * @param[in] length
+     * @param[out] consumed bytes used, feed the rest after handling the frame
+     * @return true if a valid frame is ready in GetFrame()
+    */
+    bool Feed(const uint8_t *data, size_t length, size_t &consumed);
+
+    /// @brief The last valid frame, until the next call to Feed()
+    const command_frame& GetFrame() const { return Frame; }
+};
+
+/**
+ * @brief Builds a frame
+ * @return bytes written to out, 0 if out_size is too small or length is above CMD_MAX_PAYLOAD
+*/
+size_t command_encode(uint8_t type, uint8_t seq, const uint8_t *payload, uint16_t length, uint8_t *out, size_t out_size);
+
+/// @brief Empties a staged configuration and opens the transaction
+void command_config_begin(command_config &config);
+
+/**
+ * @brief Adds a CMD_CONFIG_* frame to a staged configuration
+ * @return CMD_STATUS_CODE
+*/
+uint8_t command_config_stage(command_config &config, const command_frame &frame);
+
+/**
+ * @brief Reads the next record of a CMD_INJECT payload
+ * @param[in] frame
+ * @param[in,out] offset start of the record, moved past it
+ * @param[out] msg timestamp_us is not set
+ * @param[in] controller_count controller numbers at or above this are malformed
+ * @return false at the end of the payload or if the record is malformed (offset != frame.length)
+*/
+bool command_next_inject(const command_frame &frame, size_t &offset, NMEA_msg &msg, uint8_t controller_count);
+
+/**
+ * @brief Starts receiving a module from a CMD_MODULE_BEGIN frame
+ *
+ * Sets size, crc and flags and opens the module. The caller then points buffer at size bytes.
+ *
+ * @param[out] module
+ * @param[in] frame
+ * @param[in] max_size largest module that is accepted
+ * @return CMD_STATUS_CODE
+*/
+uint8_t command_module_begin(command_module &module, const command_frame &frame, uint32_t max_size);
+
+/**
+ * @brief Copies the bytes of a CMD_MODULE_DATA frame into the module buffer
+ * @return CMD_STATUS_CODE, CMD_ERR_RANGE if the offset is not the next byte or the data runs past the module size
+*/
+uint8_t command_module_write(command_module &module, const command_frame &frame);
+
+/**
+ * @brief Closes a module that has been received completely
+ * @return CMD_STATUS_CODE, CMD_ERR_CHECK if bytes are missing or the module does not match its CRC
+*/
+uint8_t command_module_finish(command_module &module);
+
+/// @brief Writes a command_status in its wire layout, returns the bytes written
+size_t command_status_encode(const command_status &status, uint8_t *out);
+
+#endif //COMMAND_CHANNEL_H
@@ -0,0 +1,59 @@
+/**
+ * @file deferred_log.cpp
+ *
+ * @brief Ring of unformatted log messages, formatted later by a low priority task
+*/
+#include "deferred_log.h"
+
+tDeferredLogRing::tDeferredLogRing()
+{
+    for (uint32_t i = 0; i < DEFERRED_LOG_RECORDS; i++) {
+        // Never position + 1 of the first round, so no slot looks complete
+        Records[i].seq.store(0, std::memory_order_relaxed);
+    }
+    Head.store(0, std::memory_order_relaxed);
+    Tail.store(0, std::memory_order_relaxed);
+    OverflowCount.store(0, std::memory_order_relaxed);
+}
+
+bool tDeferredLogRing::Record(uint8_t level, const char *tag, const char *format, uint32_t timestamp_ms, const uint32_t *args, int arg_count)
+{
+    uint32_t position = Head.load(std::memory_order_relaxed);
+    do {
+        if (position - Tail.load(std::memory_order_acquire) >= DEFERRED_LOG_RECORDS) {
+            OverflowCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!Head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed));
+
+    deferred_log_record &record = Records[position & (DEFERRED_LOG_RECORDS - 1)];
+    deferred_log_entry &entry = record.entry;
+    if (arg_count > DEFERRED_LOG_ARGS) {
+        arg_count = DEFERRED_LOG_ARGS;
+    }
+    entry.level = level;
+    entry.arg_count = static_cast<uint8_t>(arg_count);
+    entry.timestamp_ms = timestamp_ms;
+    entry.tag = tag;
+    entry.format = format;
+    for (int i = 0; i < DEFERRED_LOG_ARGS; i++) {
+        entry.args[i] = i < arg_count ? args[i] : 0;
+    }
+    record.seq.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool tDeferredLogRing::Take(deferred_log_entry &entry)
+{
+    uint32_t position = Tail.load(std::memory_order_relaxed);
+    if (position == Head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    deferred_log_record &record = Records[position & (DEFERRED_LOG_RECORDS - 1)];
+    if (record.seq.load(std::memory_order_acquire) != position + 1) {
+        return false; // reserved, not written yet
+    }
+    entry = record.entry;
+    Tail.store(position + 1, std::memory_order_release); // frees the slot for the producers
+    return true;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file deferred_log.h
+ *
+ * @brief Ring of unformatted log messages, formatted later by a low priority task
+ *
+ * Hot paths record the format string, its integer arguments and a timestamp instead of formatting and writing the
+ * message on the calling task. The format string itself is the message ID, it is a literal and stays valid. The log
+ * task takes the records out and formats them, so a burst of warnings at line rate costs the hot path a few stores.
+ *
+ * Any number of tasks can Record() into a ring at once without a lock, one task must Take() the records out. A record
+ * that does not fit is dropped and counted in OverflowCount. The gateway keeps one ring per core so producers on
+ * different cores do not contend.
+ *
+ * The class has no ESP-IDF dependencies.
+*/
+#ifndef DEFERRED_LOG_H
+#define DEFERRED_LOG_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define DEFERRED_LOG_RECORDS    64  //!< Records per ring, must be a power of two
+#define DEFERRED_LOG_ARGS       4   //!< Integer arguments per message, at most 32 bits each
+
+/// @brief One log message, not yet formatted
+struct deferred_log_entry {
+    uint8_t level;                      //!< esp_log_level_t of the message
+    uint8_t arg_count;
+    uint32_t timestamp_ms;              //!< Time the message was recorded
+    const char *tag;
+    const char *format;                 //!< printf format, a literal
+    uint32_t args[DEFERRED_LOG_ARGS];
+};
+
+/// @brief A ring slot, seq tells the consumer when the entry is complete
+struct deferred_log_record {
+    std::atomic<uint32_t> seq;          //!< Ring position + 1 once the entry is written
+    deferred_log_entry entry;
+};
+
+class tDeferredLogRing
+{
+protected:
+    deferred_log_record Records[DEFERRED_LOG_RECORDS];
+    std::atomic<uint32_t> Head;         //!< Next position to reserve
+    std::atomic<uint32_t> Tail;         //!< Next position to take
+
+public:
+    std::atomic<uint32_t> OverflowCount;    //!< Messages dropped because the ring was full
+
+    tDeferredLogRing();
+
+    /**
+     * @brief Stores a message, lock free
+     * @param[in] level
+     * @param[in] tag
+     * @param[in] format literal printf format using only integer conversions
+     * @param[in] timestamp_ms
+     * @param[in] args
+     * @param[in] arg_count at most DEFERRED_LOG_ARGS, more are ignored
+     * @return false if the ring was full and the message was dropped
+    */
+    bool Record(uint8_t level, const char *tag, const char *format, uint32_t timestamp_ms, const uint32_t *args, int arg_count);
+
+    /**
+     * @brief Takes the oldest complete message out, only called by the consumer
+     *
+     * Stops at a record that is reserved but still being written, even if later ones are complete, so messages
+     * come out in the order they were reserved.
+     *
+     * @param[out] entry
+     * @return false if there is no complete message
+    */
+    bool Take(deferred_log_entry &entry);
+};
+
+#endif //DEFERRED_LOG_H
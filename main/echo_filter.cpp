@@ -0,0 +1,80 @@
+/**
+ * @file echo_filter.cpp
+ *
+ * @brief Recognizes messages the gateway sent itself when they are received again
+*/
+#include "echo_filter.h"
+
+#define FNV_OFFSET_BASIS    2166136261u
+#define FNV_PRIME           16777619u
+
+tEchoFilter::tEchoFilter()
+{
+    for (int i = 0; i < ECHO_FILTER_SLOTS; i++) {
+        Entries[i].sent_us = 0;
+    }
+    RecordedCount = 0;
+    EvictedCount = 0;
+}
+
+uint32_t tEchoFilter::CanId(uint8_t priority, uint32_t PGN, uint8_t source)
+{
+    return (static_cast<uint32_t>(priority & 0x07) << 26) | ((PGN & 0x3ffff) << 8) | source;
+}
+
+uint32_t tEchoFilter::PayloadHash(const uint8_t *data, int data_length_bytes)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < data_length_bytes; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return (hash ^ static_cast<uint32_t>(data_length_bytes)) * FNV_PRIME;
+}
+
+uint32_t tEchoFilter::SlotIndex(uint8_t controller_number, uint32_t can_id, uint32_t payload_hash)
+{
+    uint32_t mixed = ((can_id ^ (static_cast<uint32_t>(controller_number) << 29)) * 0x9e3779b1u) ^ payload_hash;
+    return (mixed ^ (mixed >> 16)) & (ECHO_FILTER_SLOTS - 1);
+}
+
+void tEchoFilter::Record(uint8_t controller_number, uint32_t can_id, uint32_t payload_hash, int64_t now_us)
+{
+    uint32_t index = SlotIndex(controller_number, can_id, payload_hash);
+    int target = -1;
+    for (int i = 0; i < ECHO_FILTER_PROBES; i++) {
+        uint32_t slot = (index + i) & (ECHO_FILTER_SLOTS - 1);
+        echo_filter_entry &entry = Entries[slot];
+        bool live = entry.sent_us != 0 && now_us - entry.sent_us < ECHO_FILTER_WINDOW_US;
+        if (!live || (entry.controller_number == controller_number && entry.can_id == can_id &&
+                      entry.payload_hash == payload_hash)) {
+            target = slot; // free, expired or the same message sent again
+            break;
+        }
+        if (target < 0 || entry.sent_us < Entries[target].sent_us) {
+            target = slot;
+        }
+    }
+    echo_filter_entry &entry = Entries[target];
+    if (entry.sent_us != 0 && now_us - entry.sent_us < ECHO_FILTER_WINDOW_US &&
+        (entry.controller_number != controller_number || entry.can_id != can_id || entry.payload_hash != payload_hash)) {
+        EvictedCount++;
+    }
+    entry.can_id = can_id;
+    entry.payload_hash = payload_hash;
+    entry.sent_us = now_us != 0 ? now_us : 1;
+    entry.controller_number = controller_number;
+    RecordedCount++;
+}
+
+bool tEchoFilter::IsEcho(uint8_t controller_number, uint32_t can_id, uint32_t payload_hash, int64_t now_us) const
+{
+    uint32_t index = SlotIndex(controller_number, can_id, payload_hash);
+    for (int i = 0; i < ECHO_FILTER_PROBES; i++) {
+        const echo_filter_entry &entry = Entries[(index + i) & (ECHO_FILTER_SLOTS - 1)];
+        if (entry.sent_us != 0 && entry.controller_number == controller_number && entry.can_id == can_id &&
+            entry.payload_hash == payload_hash && now_us - entry.sent_us < ECHO_FILTER_WINDOW_US) {
+            return true;
+        }
+    }
+    return false;
+}
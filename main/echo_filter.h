@@ -0,0 +1,75 @@
+/**
+ * @file echo_filter.h
+ *
+ * @brief Recognizes messages the gateway sent itself when they are received again
+ *
+ * Every message a controller sends is recorded with the controller, its CAN ID, a hash of its payload and the time. A
+ * message received on a controller that matches a record of that controller younger than ECHO_FILTER_WINDOW_US is an
+ * echo of our own traffic on that bus and must not be forwarded again. The same frame received on another bus, e.g.
+ * the next period of the message the gateway forwarded from there, is not an echo.
+ *
+ * The CAN ID is built from priority, PGN and source, so a device using the same address as the gateway only
+ * collides if it also sends the same payload within the window.
+ *
+ * Records live in a fixed size open addressing table, Record() and IsEcho() look at no more than ECHO_FILTER_PROBES
+ * slots. When all probed slots hold live records the oldest is replaced and counted as evicted.
+ *
+ * The time is passed in by the caller and no locking is done, the class has no ESP-IDF dependencies.
+*/
+#ifndef ECHO_FILTER_H
+#define ECHO_FILTER_H
+
+#include <stdint.h>
+
+#define ECHO_FILTER_SLOTS       128     //!< Table size, must be a power of two
+#define ECHO_FILTER_PROBES      4       //!< Slots looked at per lookup
+#define ECHO_FILTER_WINDOW_US   100000  //!< How long a sent message is remembered
+
+/// @brief A recently sent message
+struct echo_filter_entry {
+    uint32_t can_id;
+    uint32_t payload_hash;
+    int64_t sent_us;            //!< 0 for a free slot
+    uint8_t controller_number;  //!< Controller the message was sent on
+};
+
+class tEchoFilter
+{
+protected:
+    echo_filter_entry Entries[ECHO_FILTER_SLOTS];
+
+    static uint32_t SlotIndex(uint8_t controller_number, uint32_t can_id, uint32_t payload_hash);
+
+public:
+    unsigned long RecordedCount;    //!< Messages recorded
+    unsigned long EvictedCount;     //!< Records replaced before they expired, the table is too small if this grows
+
+    tEchoFilter();
+
+    /// @brief CAN ID of a message, without the destination
+    static uint32_t CanId(uint8_t priority, uint32_t PGN, uint8_t source);
+
+    /// @brief FNV-1a hash of the payload and its length
+    static uint32_t PayloadHash(const uint8_t *data, int data_length_bytes);
+
+    /**
+     * @brief Records a sent message
+     * @param[in] controller_number controller it was sent on
+     * @param[in] can_id from CanId()
+     * @param[in] payload_hash from PayloadHash()
+     * @param[in] now_us current time
+    */
+    void Record(uint8_t controller_number, uint32_t can_id, uint32_t payload_hash, int64_t now_us);
+
+    /**
+     * @brief Checks if a received message was sent by the gateway on the same controller within the window
+     * @param[in] controller_number controller it was received on
+     * @param[in] can_id from CanId()
+     * @param[in] payload_hash from PayloadHash()
+     * @param[in] now_us current time
+     * @return true if it is an echo
+    */
+    bool IsEcho(uint8_t controller_number, uint32_t can_id, uint32_t payload_hash, int64_t now_us) const;
+};
+
+#endif //ECHO_FILTER_H
@@ -0,0 +1,78 @@
+/**
+ * @file latency_hist.cpp
+ *
+ * @brief Fixed size latency histogram for percentile reporting
+*/
+#include "latency_hist.h"
+#include <string.h>
+
+tLatencyHistogram::tLatencyHistogram()
+{
+    Reset();
+}
+
+void tLatencyHistogram::Reset()
+{
+    memset(Buckets, 0, sizeof(Buckets));
+    Samples = 0;
+    Max = 0;
+}
+
+int tLatencyHistogram::BucketIndex(uint32_t value_us)
+{
+    if (value_us < LATENCY_HIST_SUB_BUCKETS) {
+        return value_us;
+    }
+    int msb = 31 - __builtin_clz(value_us);
+    int shift = msb - LATENCY_HIST_SUB_BITS;
+    uint32_t sub = (value_us >> shift) & (LATENCY_HIST_SUB_BUCKETS - 1);
+    return (shift + 1) * LATENCY_HIST_SUB_BUCKETS + sub;
+}
+
+uint32_t tLatencyHistogram::BucketUpperBound(int index)
+{
+    if (index < LATENCY_HIST_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / LATENCY_HIST_SUB_BUCKETS - 1;
+    uint64_t sub = index % LATENCY_HIST_SUB_BUCKETS;
+    uint64_t upper = ((LATENCY_HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+    return upper > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(upper);
+}
+
+void tLatencyHistogram::Add(uint32_t value_us)
+{
+    Buckets[BucketIndex(value_us)]++;
+    Samples++;
+    if (value_us > Max) {
+        Max = value_us;
+    }
+}
+
+void tLatencyHistogram::Merge(const tLatencyHistogram &other)
+{
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        Buckets[i] += other.Buckets[i];
+    }
+    Samples += other.Samples;
+    if (other.Max > Max) {
+        Max = other.Max;
+    }
+}
+
+uint32_t tLatencyHistogram::Percentile(uint32_t per_mille) const
+{
+    if (Samples == 0) {
+        return 0;
+    }
+    uint64_t target = (static_cast<uint64_t>(Samples) * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        seen += Buckets[i];
+        if (seen >= target && seen > 0) {
+            uint32_t upper = BucketUpperBound(i);
+            return upper < Max ? upper : Max;
+        }
+    }
+    return Max;
+}
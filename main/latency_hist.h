@@ -0,0 +1,60 @@
+/**
+ * @file latency_hist.h
+ *
+ * @brief Fixed size latency histogram for percentile reporting
+ *
+ * Values in microseconds are counted in log-linear buckets: every power of two is split into
+ * LATENCY_HIST_SUB_BUCKETS linear steps, so a percentile is accurate to 1/LATENCY_HIST_SUB_BUCKETS of its value
+ * over the full 32 bit range. Values below LATENCY_HIST_SUB_BUCKETS are counted exactly.
+ *
+ * Add() is meant to be called from a single task. Reading from another task can miss a value that is added at the
+ * same time, which is fine for statistics.
+ *
+ * The class has no ESP-IDF dependencies.
+*/
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+
+#define LATENCY_HIST_SUB_BITS       3
+#define LATENCY_HIST_SUB_BUCKETS    (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS        ((32 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_BUCKETS)
+
+class tLatencyHistogram
+{
+protected:
+    uint32_t Buckets[LATENCY_HIST_BUCKETS];
+    uint32_t Samples;
+    uint32_t Max;
+
+    static int BucketIndex(uint32_t value_us);
+    static uint32_t BucketUpperBound(int index);
+
+public:
+    tLatencyHistogram();
+
+    /// @brief Clears all samples
+    void Reset();
+
+    /// @brief Adds one sample in microseconds
+    void Add(uint32_t value_us);
+
+    /// @brief Adds all samples of another histogram
+    void Merge(const tLatencyHistogram &other);
+
+    /**
+     * @brief Value below which a given share of the samples fall
+     * @param[in] per_mille share of the samples, 990 for p99
+     * @return upper bound of the bucket holding the percentile in microseconds, 0 if there are no samples
+    */
+    uint32_t Percentile(uint32_t per_mille) const;
+
+    /// @brief Number of samples since the last Reset()
+    uint32_t Count() const { return Samples; }
+
+    /// @brief Largest sample since the last Reset()
+    uint32_t MaxValue() const { return Max; }
+};
+
+#endif //LATENCY_HIST_H
@@ -0,0 +1,95 @@
+/**
+ * @file load_gen.cpp
+ *
+ * @brief Synthetic traffic generator and throughput ramp for the load test
+*/
+#include "load_gen.h"
+#include <stdio.h>
+#include <inttypes.h>
+
+#define LOAD_GEN_MAX_PENDING    LOAD_GEN_BATCH  // messages handed out at once after a long gap, limits bursts
+
+tTrafficGenerator::tTrafficGenerator(BENCH_MIX mix, uint8_t controller_number, uint32_t seed)
+{
+    Mix = mix;
+    ControllerNumber = controller_number;
+    Seed = seed;
+    BatchPos = LOAD_GEN_BATCH; // filled on first use
+    RatePerS = 0;
+    LastUs = 0;
+    PendingMilli = 0;
+}
+
+void tTrafficGenerator::SetRate(uint32_t rate_per_s, int64_t now_us)
+{
+    RatePerS = rate_per_s;
+    LastUs = now_us;
+    PendingMilli = 0;
+}
+
+size_t tTrafficGenerator::Due(int64_t now_us)
+{
+    int64_t elapsed_us = now_us - LastUs;
+    if (elapsed_us <= 0) {
+        return 0;
+    }
+    LastUs = now_us;
+    PendingMilli += (static_cast<uint64_t>(elapsed_us) * RatePerS) / 1000;
+    uint64_t due = PendingMilli / 1000;
+    if (due > LOAD_GEN_MAX_PENDING) {
+        due = LOAD_GEN_MAX_PENDING;
+        PendingMilli = due * 1000; // the caller fell behind, don't catch up with a larger burst later
+    }
+    PendingMilli -= due * 1000;
+    return static_cast<size_t>(due);
+}
+
+void tTrafficGenerator::Next(NMEA_msg &msg)
+{
+    if (BatchPos >= LOAD_GEN_BATCH) {
+        bench_fill_mix(Batch, LOAD_GEN_BATCH, Mix, ControllerNumber, ++Seed);
+        BatchPos = 0;
+    }
+    msg = Batch[BatchPos++];
+}
+
+tLoadRamp::tLoadRamp(uint32_t start_rate, uint32_t step_rate, uint32_t max_rate, uint32_t drop_per_mille)
+{
+    Rate = start_rate;
+    StepRate = step_rate;
+    MaxRate = max_rate;
+    DropPerMille = drop_per_mille;
+    Sustained = 0;
+    Finished = (start_rate == 0 || start_rate > max_rate);
+}
+
+void tLoadRamp::StepDone(uint32_t offered, uint32_t delivered, uint32_t dropped, int64_t elapsed_us)
+{
+    if (Finished) {
+        return;
+    }
+    bool clean = offered > 0 && static_cast<uint64_t>(dropped) * 1000 <= static_cast<uint64_t>(offered) * DropPerMille;
+    if (!clean) {
+        Finished = true;
+        return;
+    }
+    if (elapsed_us > 0) {
+        Sustained = static_cast<uint32_t>((static_cast<uint64_t>(delivered) * 1000000) / elapsed_us);
+    }
+    if (StepRate == 0 || Rate + StepRate > MaxRate) {
+        Finished = true;
+        return;
+    }
+    Rate += StepRate;
+}
+
+void load_test_report(const char *target, BENCH_MIX mix, uint32_t rate, uint32_t offered_per_s, uint32_t delivered_per_s, uint32_t dropped)
+{
+    printf("LOADTEST,%s,%s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", target, bench_mix_name(mix), rate,
+        offered_per_s, delivered_per_s, dropped);
+}
+
+void load_test_report_sustained(const char *target, BENCH_MIX mix, uint32_t sustained_per_s)
+{
+    printf("LOADTEST,%s,%s,sustained,%" PRIu32 "\n", target, bench_mix_name(mix), sustained_per_s);
+}
@@ -0,0 +1,105 @@
+/**
+ * @file load_gen.h
+ *
+ * @brief Synthetic traffic generator and throughput ramp for the load test
+ *
+ * tTrafficGenerator produces messages of a benchmark mix (see benchmark.h) at a set rate. The caller asks how many
+ * messages are due at the current time and injects them wherever it wants, e.g. a send queue or the receive handler.
+ *
+ * tLoadRamp raises the rate step by step and ends the ramp at the first step whose drops exceed a threshold. The
+ * delivered rate of the last clean step is the sustained throughput. Results are printed as:
+ *
+ * `LOADTEST,<target>,<mix>,<rate>,<offered msgs/s>,<delivered msgs/s>,<dropped>`
+ *
+ * `LOADTEST,<target>,<mix>,sustained,<delivered msgs/s>`
+ *
+ * Both classes take the time as a parameter and have no ESP-IDF dependencies, so a ramp can also be driven from a host
+ * build.
+*/
+#ifndef LOAD_GEN_H
+#define LOAD_GEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "NMEA_msg.h"
+#include "benchmark.h"
+
+#define LOAD_GEN_BATCH  32  //!< Messages generated at once
+
+class tTrafficGenerator
+{
+protected:
+    NMEA_msg Batch[LOAD_GEN_BATCH];
+    size_t BatchPos;
+    BENCH_MIX Mix;
+    uint8_t ControllerNumber;
+    uint32_t Seed;
+    uint32_t RatePerS;
+    int64_t LastUs;
+    uint64_t PendingMilli;  //!< Due messages times 1000 not yet handed out
+
+public:
+    tTrafficGenerator(BENCH_MIX mix, uint8_t controller_number, uint32_t seed);
+
+    /**
+     * @brief Sets the rate and restarts pacing
+     * @param[in] rate_per_s messages per second
+     * @param[in] now_us current time
+    */
+    void SetRate(uint32_t rate_per_s, int64_t now_us);
+
+    /**
+     * @brief Number of messages that became due since the last call
+     * @param[in] now_us current time
+    */
+    size_t Due(int64_t now_us);
+
+    /// @brief Fills the next message of the mix, timestamp_us is left to the caller
+    void Next(NMEA_msg &msg);
+};
+
+class tLoadRamp
+{
+protected:
+    uint32_t Rate;
+    uint32_t StepRate;
+    uint32_t MaxRate;
+    uint32_t DropPerMille;
+    uint32_t Sustained;
+    bool Finished;
+
+public:
+    /**
+     * @param[in] start_rate rate of the first step in messages per second
+     * @param[in] step_rate rate added after each clean step
+     * @param[in] max_rate the ramp ends after the step at this rate
+     * @param[in] drop_per_mille share of the offered messages that may be dropped in a clean step
+    */
+    tLoadRamp(uint32_t start_rate, uint32_t step_rate, uint32_t max_rate, uint32_t drop_per_mille);
+
+    /// @brief Rate of the current step in messages per second
+    uint32_t CurrentRate() const { return Rate; }
+
+    /**
+     * @brief Records the result of the current step and moves to the next one
+     * @param[in] offered messages injected
+     * @param[in] delivered messages that came out at the far end
+     * @param[in] dropped messages lost anywhere on the way
+     * @param[in] elapsed_us length of the step
+    */
+    void StepDone(uint32_t offered, uint32_t delivered, uint32_t dropped, int64_t elapsed_us);
+
+    /// @brief True once a step had too many drops or the maximum rate was measured
+    bool Done() const { return Finished; }
+
+    /// @brief Delivered messages per second of the last clean step, 0 if there was none
+    uint32_t SustainedRate() const { return Sustained; }
+};
+
+/// @brief Prints one step of a ramp
+void load_test_report(const char *target, BENCH_MIX mix, uint32_t rate, uint32_t offered_per_s, uint32_t delivered_per_s, uint32_t dropped);
+
+/// @brief Prints the sustained throughput of a ramp
+void load_test_report_sustained(const char *target, BENCH_MIX mix, uint32_t sustained_per_s);
+
+#endif //LOAD_GEN_H
@@ -15,9 +15,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "freertos/ringbuf.h"
 #include "NMEA_msg.h"
 #include "esp_log.h"
 #include <N2kMsg.h>
@@ -29,35 +32,109 @@
 #include <NMEA2000_mcp.h>
 
 #include "driver/gpio.h"
+#include "driver/uart.h"
 #include "bi-inc/attr_container.h"
 
 #include "wasm_export.h"
 #include "bh_read_file.h"
 #include "bh_getopt.h"
 #include "bh_platform.h"
+#ifdef MEMORY_BUDGET
+#include "wasm_exec_env.h" // WAMR internals, peak interpreter stack of an exec env
+#include "wasm_runtime.h"  // WAMR internals, app heap of a module instance
+#include "mem_alloc.h"
+#endif
 
 #include <queue>
 #include <string>
 #include <iomanip>
 #include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <tuple>
+#include <array>
 #include "driver/spi_master.h"
 
 //WebAssembley App
 #include "nmea_attack.h" 
 
+#include "actisense_reader.h"
+#include "benchmark.h"
+#include "bus_load.h"
+#include "tx_retry.h"
+#include "echo_filter.h"
+#include "rate_limit.h"
+#include "load_gen.h"
+#include "stream_conflator.h"
+#include "state_table.h"
+#include "telemetry.h"
+#include "deferred_log.h"
+#include "command_channel.h"
+#include "wasm_image.h"
+#include "mcp2515_batch.h"
+#include "mcp2515_sim.h"
+#include "task_topology.h"
+#include "latency_hist.h"
+#include "memory_budget.h"
+#include "nvs_flash.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_vfs_dev.h"
+#include "esp_partition.h"
+
 #define NATIVE_STACK_SIZE               (32*1024)
 #define NATIVE_HEAP_SIZE                (32*1024)
-#define PTHREAD_STACK_SIZE              4096
+#define WASM_HEAP_POOL_SIZE             (WASM_POOL_APPS*128*1024) // WAMR runtime pool: loaded module, instance, linear memory and exec env stack of each app
 #define MAX_DATA_LENGTH_BTYES           223
 #define MSG_BUFFER_SIZE                     (10 + 223*2) //10 bytes for id, 223*2 bytes for data
+#define MSG_STRING_SIZE                 (MSG_BUFFER_SIZE + 2) // longest nmea_to_chars output (2 digit source) and terminator
 #define MODE_BUFFER_SIZE                1 // 1 byte to store modes 0 -> 3
 #define MY_ESP_LOG_LEVEL                ESP_LOG_INFO // the log level for this file
+#define DEFERRED_LOG_LEVEL              MY_ESP_LOG_LEVEL // DLOG* calls above this level are compiled out
+#define DEFERRED_LOG_TEXT_SIZE          128 // longest formatted deferred message, longer ones are cut
+#define DEFERRED_LOG_IDLE_TICKS         pdMS_TO_TICKS(10) // time the log task sleeps between draining the rings
 
-#define STATS_TASK_PRIO     tskIDLE_PRIORITY //3
 #define STATS_TICKS         pdMS_TO_TICKS(1000)
-#define ARRAY_SIZE_OFFSET   5   //Increase this if print_real_time_stats returns ESP_ERR_INVALID_SIZE
+#define STATS_MAX_TASKS     32  //Increase this if print_real_time_stats returns ESP_ERR_INVALID_SIZE
+#define TELEMETRY_INTERVAL_MS   1000    // Interval between telemetry frames
+#define TELEMETRY_SINK_CONSOLE  0       // frames are written to the console UART, between the log lines
+#define TELEMETRY_SINK_RING     1       // frames are kept in telemetry_ring for a reader task, the oldest is dropped when full
+#define TELEMETRY_SINK          TELEMETRY_SINK_CONSOLE
+#define TELEMETRY_RING_FRAMES   4       // frames telemetry_ring holds
 #define TX_QUEUE_SIZE       100
 #define RX_QUEUE_SIZE       100
+#define GPIO_EVT_QUEUE_SIZE 10
+#define TX_RATE_MSGS_PER_S  1000 // default limit for messages the WASM app sends to one controller, per second
+#define TX_RATE_BURST       (TX_QUEUE_SIZE / 2) // messages the WASM app can send to one controller back to back
+#define TX_STALE_US         500000 // messages received longer ago than this are dropped instead of sent, 0 sends all
+#define TWAI_RX_IDLE_MS     100 // longest the TWAI receive task waits for an alert, the NMEA2000 library is run at least this often
+
+#define NUM_MCP_CONTROLLERS 2   // entries in mcp_devices
+#define NUM_CONTROLLERS     (1 + NUM_MCP_CONTROLLERS) // entries in controller_devices, see README to add a bus
+
+#define RX_OVERFLOW_DROP_NEWEST     0   // discard the message that did not fit
+#define RX_OVERFLOW_DROP_OLDEST     1   // discard the oldest queued message to make room
+#define RX_OVERFLOW_CONFLATE        2   // park the message, a newer one from the same controller, PGN and source replaces it
+#define RX_OVERFLOW_POLICY          RX_OVERFLOW_DROP_OLDEST // what HandleNMEA2000Msg does when rx_queue is full
+#define RX_CONFLATE_SLOTS           16  // messages that can be parked while rx_queue is full
+
+#define WASM_BUDGET_US              20000   // longest the WASM app may run on one message before it is terminated
+#define WASM_OVERRUN_FORWARD        0   // send the message unchanged on every other controller
+#define WASM_OVERRUN_DROP           1   // discard the message
+#define WASM_OVERRUN_POLICY         WASM_OVERRUN_FORWARD // what happens to a message the WASM app was terminated on
+
+#define SHED_OVERLOAD_PERCENT       70  // bus utilization at which load shedding starts
+#define SHED_QUEUE_HIGH_WATER       75  // rx queue fill level in percent at which load shedding starts
+#define SHED_LOW_PRIORITY           6   // priority 6 and 7 messages are shed under overload
+#define SHED_SAMPLE_RATE            4   // 1 in 4 of the remaining non critical messages is kept under overload
+
+#define BENCH_BATCH_SIZE    32  // Smaller than the queue sizes so no benchmarked call ever blocks on a full queue
+#define BENCH_ROUNDS        32  // Batches per stage and mix
+#define BENCH_CPU_FREQ_MHZ  CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define BENCH_MCP_MAX       8   // Simulated MCP controllers on one SPI host in the MCP receive benchmark
 
 #define MCP0_TX             GPIO_NUM_22
 #define MCP0_RX             GPIO_NUM_23
@@ -65,6 +142,29 @@
 #define MCP1_INT            10
 #define MCP2_CS             17
 #define MCP2_INT            11
+#define MCP_NO_INT          0xff // INT pin of a MCP controller that is polled
+
+#define MCP_BUS_TX_BURST    4   // Messages sent per MCP controller per round of the bus owner task
+#define MCP_BUS_IDLE_TICKS  pdMS_TO_TICKS(10) // Longest the bus owner task sleeps without an interrupt or new message
+
+#define LOAD_TEST_START_RATE        100     // Messages per second of the first load test step
+#define LOAD_TEST_STEP_RATE         100     // Rate added after every step without drops
+#define LOAD_TEST_MAX_RATE          4000    // Highest rate tried
+#define LOAD_TEST_STEP_MS           3000    // Length of one step
+#define LOAD_TEST_DRAIN_MS          1000    // Longest wait for the queues to empty after a step
+#define LOAD_TEST_DROP_PER_MILLE    1       // Drops above this share of the offered messages end the ramp
+#define LOAD_TEST_MIX               BENCH_MIX_TYPICAL
+#define LOAD_TEST_SIM_MAX_RATE      20000   // Highest rate tried on the simulated MCP controller, it has no CAN bus to saturate
+#define LOAD_TEST_SIM_TICK_US       100     // Simulated time between two arrivals of due messages at the simulated MCP controller
+#define LOAD_TEST_SIM_YIELD_TICKS   1000    // Simulated ticks between two yields of the load test task
+
+#define MEMORY_BUDGET_REPORT_MS         60000   // Interval between memory budget reports, peaks are kept across reports
+#define MEMORY_BUDGET_HEADROOM_PERCENT  25      // Margin added to measured peaks
+#define MEMORY_BUDGET_STACK_MIN         1024    // Smallest recommended task stack
+#define MEMORY_BUDGET_QUEUE_MIN         8       // Smallest recommended queue length
+
+#define TOPOLOGY_SWEEP_WARMUP_MS    5000    // Time for the queues to reach a steady state before measuring a layout
+#define TOPOLOGY_SWEEP_MEASURE_MS   30000   // Length of the measurement of one layout
 
 #define ESP_INTR_FLAG_DEFAULT 0
 /*
@@ -79,82 +179,538 @@
 #define MODE_SETTING_MASK  ((1ULL<<MODE_SETTING_PIN_LSB) | (1ULL<<MODE_SETTING_PIN_MSB))
 
 #define PRINT_STATS // Uncomment to print task stats periodically
+//#define TELEMETRY // Uncomment to send binary telemetry frames instead of printing task stats and status, see README
+#define MCP_BUS_OWNER_TASK // Comment out to run separate send and receive tasks for each MCP controller
+#define MCP_BATCHED_SPI // Comment out to let the NMEA2000_mcp library do its own SPI transactions
+//#define TWAI_RX_POLLING // Uncomment to poll the TWAI driver in a loop instead of waiting for its alerts, to compare CPU use and latency, see README
+#define WASM_HEAP_POOL // Comment out to let the WAMR runtime allocate from the system heap
+#define DEFERRED_LOG // Comment out to format the per message log calls (DLOG*) on the calling task
+//#define RX_CONFLATING_QUEUE // Uncomment to replace queued messages of periodic streams with newer ones instead of queueing those
+#define LOAD_SHEDDING // Comment out to pass every received message to the WASM app regardless of load
+#define WASM_BUDGET // Comment out to let the WASM app run as long as it takes on each message, see README
+//#define RUN_BENCHMARKS // Uncomment to run the per-message microbenchmarks instead of the gateway
+//#define LOAD_TEST // Uncomment to ramp synthetic traffic into every controller and the receive handler until drops appear, see README
+//#define MEMORY_BUDGET // Uncomment to record stack, queue, WASM stack, app heap and WASM pool peaks and print recommended sizes, see README
+//#define TOPOLOGY_SWEEP // Uncomment to measure one layout of topology_layouts per boot, see README
+//#define ACTISENSE_REPLAY // Uncomment to inject an Actisense stream (e.g. a recorded log) received on ACTISENSE_UART_NUM
+//#define COMMAND_CHANNEL // Uncomment to accept configuration and messages to send from the Pi on COMMAND_UART_NUM, see README
+//#define WASM_HOT_SWAP // Uncomment to run the WASM app from the wasm_app partition and swap in new apps without a reboot, see README
+
+#define ACTISENSE_UART_NUM          UART_NUM_1
+#define ACTISENSE_UART_BAUD         921600
+#define ACTISENSE_UART_TX_PIN       UART_PIN_NO_CHANGE
+#define ACTISENSE_UART_RX_PIN       GPIO_NUM_5
+#define ACTISENSE_UART_BUF_SIZE     4096    // UART driver rx buffer
+#define ACTISENSE_CHUNK_SIZE        512     // bytes handed to the parser per read
+#define ACTISENSE_BATCH_SIZE        16      // messages parsed before they are pushed to the queue
+#define ACTISENSE_TARGET_QUEUE      rx_queue // rx_queue to feed the WASM app, or a C*_tx_queue to send the log out on a bus
+#define ACTISENSE_CONTROLLER        C0_NUM  // controller number written into the replayed messages
+
+#define COMMAND_UART_NUM            UART_NUM_1
+#define COMMAND_UART_BAUD           921600
+#define COMMAND_UART_TX_PIN         GPIO_NUM_20 // to the RXD pin of the Pi
+#define COMMAND_UART_RX_PIN         GPIO_NUM_21 // from the TXD pin of the Pi
+#define COMMAND_UART_BUF_SIZE       4096    // UART driver rx buffer, holds injected messages while the send queues are full
+#define COMMAND_CHUNK_SIZE          256     // bytes handed to the parser per read
+
+#define WASM_PARTITION_LABEL        "wasm_app" // data partition holding a wasm_image_header and the module
+#define WASM_IMAGE_MAX_SIZE         (192*1024) // largest module accepted over the command channel
+#define WASM_PERSIST_CHUNK          4096    // bytes erased or written per flash operation when a module is stored
+
+#if WASM_ENABLE_GLOBAL_HEAP_POOL != 0 && !defined(WASM_HEAP_POOL)
+#define WASM_HEAP_POOL // a WAMR build with the global heap pool always runs from the pool
+#endif
+
+#if defined(WASM_BUDGET) && WASM_ENABLE_THREAD_MGR == 0
+// Without the thread manager the interpreter never checks for the termination and the app runs on, see README
+#error "WASM_BUDGET needs WAMR built with the thread manager, set CONFIG_WAMR_ENABLE_LIB_PTHREAD (see sdkconfig.defaults)"
+#endif
+#if defined(MEMORY_BUDGET) && WASM_ENABLE_MEMORY_PROFILING == 0
+// Only then the interpreter records the peak of the WASM stack
+#error "MEMORY_BUDGET needs WAMR built with memory profiling, set CONFIG_WAMR_ENABLE_MEMORY_PROFILING"
+#endif
+
+#if defined(COMMAND_CHANNEL) && defined(ACTISENSE_REPLAY) && COMMAND_UART_NUM == ACTISENSE_UART_NUM
+#error "COMMAND_CHANNEL and ACTISENSE_REPLAY need different UARTs"
+#endif
+
+#ifdef WASM_HOT_SWAP
+#define WASM_POOL_APPS  2 // the running app and the one being loaded live in the pool together
+#else
+#define WASM_POOL_APPS  1
+#endif
+
+#if defined(TELEMETRY) && !defined(PRINT_STATS)
+#define PRINT_STATS // telemetry frames are sent by the stats task
+#endif
 
 // Tag for ESP logging
 static const char* TAG_TWAI = "TWAI";
 static const char* TAG_WASM = "WASM";
-static const char* TAG_MCP1 = "MCP1";
-static const char* TAG_MCP2 = "MCP2";
 static const char* TAG_STATUS = "STATUS";
 
-spi_device_handle_t spi1; //!< MCP controller 1 spi handle
-spi_device_handle_t spi2; //!< MCP controller 2 spi handle
+/// @brief A MCP2515 on the SPI host
+struct mcp_device_config {
+    const char *tag;    //!< Log tag
+    int cs_pin;
+    int int_pin;        //!< Active low, MCP_NO_INT to poll
+};
+
+// MCP controllers on the one SPI host, numbered from 1 in this order. Controllers can share an INT pin (the MCP2515 
+// INT output wire-ORed with an external pull-up) to save GPIOs, the status of every controller on a low shared pin 
+// is then read to find the ones with frames.
+static constexpr mcp_device_config mcp_devices[] = {
+    {"MCP1", MCP1_CS, MCP1_INT},
+    {"MCP2", MCP2_CS, MCP2_INT},
+};
+static_assert(sizeof(mcp_devices) / sizeof(mcp_devices[0]) == NUM_MCP_CONTROLLERS, "NUM_MCP_CONTROLLERS does not match mcp_devices");
+
+spi_device_handle_t mcp_spi[NUM_MCP_CONTROLLERS]; //!< SPI handle of each MCP controller, filled in by Open()
 
 tNMEA2000_esp32c6 C0(MCP0_TX, MCP0_RX);   //!< Controller 0 -> TWAI, (TX_PIN, RX_PIN)
-tNMEA2000_mcp C1(&spi1,MCP1_CS,MCP_8MHZ,MCP1_INT,50);      //!< Controller 1 -> MCP,  (spi_handle, CS_PIN, mcp_clk_freq, INT_PIN, _rx_frame_buf_size)
-tNMEA2000_mcp C2(&spi2,MCP2_CS,MCP_8MHZ,MCP2_INT,50);      //!< Controller 2 -> MCP,  (spi_handle, CS_PIN, mcp_clk_freq, INT_PIN, _rx_frame_buf_size)
+#ifdef MCP_BATCHED_SPI
+typedef tNMEA2000_mcp_batched tNMEA2000_mcp_ctrl;
+#else
+typedef tNMEA2000_mcp tNMEA2000_mcp_ctrl;
+#endif
 
+/// @brief Constructs the MCP controllers of mcp_devices in place, (spi_handle, CS_PIN, mcp_clk_freq, INT_PIN, _rx_frame_buf_size)
+template<size_t... I> static std::array<tNMEA2000_mcp_ctrl, sizeof...(I)> mcp_make_controllers(std::index_sequence<I...>)
+{
+    return {tNMEA2000_mcp_ctrl(&mcp_spi[I], mcp_devices[I].cs_pin, MCP_8MHZ, mcp_devices[I].int_pin, 50)...};
+}
+std::array<tNMEA2000_mcp_ctrl, NUM_MCP_CONTROLLERS> mcp_controllers = mcp_make_controllers(std::make_index_sequence<NUM_MCP_CONTROLLERS>()); //!< Controllers 1 and up -> MCP
+
+//----------------------------------------------------------------------------------------------------------------------------
+// Controller Definitions
+//----------------------------------------------------------------------------------------------------------------------------
+// Every bus is one entry in controller_devices, its index is its controller number. The backend follows from the type 
+// of the device, so the tasks, queues and counters of each controller are generated from this one list and per message 
+// code indexes arrays instead of testing controller numbers.
+
+/// @brief Backend of a controller
+enum CONTROLLER_BACKEND {
+    BACKEND_TWAI,   //!< The ESP32 TWAI controller, read explicitly by its receive task
+    BACKEND_MCP     //!< A MCP2515 on the SPI bus, the first one initializes the bus
+};
+
+/// @brief Backend of a device type
+template<typename DEVICE> struct controller_backend;
+template<> struct controller_backend<tNMEA2000_esp32c6> { static constexpr CONTROLLER_BACKEND value = BACKEND_TWAI; };
+template<> struct controller_backend<tNMEA2000_mcp_ctrl> { static constexpr CONTROLLER_BACKEND value = BACKEND_MCP; };
+
+static const auto controller_devices = std::tuple_cat(std::tie(C0), std::apply(
+    [](auto&... mcp) { return std::tie(mcp...); }, mcp_controllers)); //!< Every controller, in controller number order
+static_assert(std::tuple_size<decltype(controller_devices)>::value == NUM_CONTROLLERS, "NUM_CONTROLLERS does not match controller_devices");
+
+/// @brief Type of the device of controller NUM
+template<int NUM> using controller_device_t = std::remove_reference_t<std::tuple_element_t<NUM, std::remove_const_t<decltype(controller_devices)>>>;
+
+/// @brief Backend of controller NUM
+template<int NUM> constexpr CONTROLLER_BACKEND controller_backend_v = controller_backend<controller_device_t<NUM>>::value;
+
+/// @brief The device of controller NUM, with its own type
+template<int NUM> static inline controller_device_t<NUM>& controller_device()
+{
+    return std::get<NUM>(controller_devices);
+}
+
+/// @brief Number of the first controller with BACKEND, -1 if there is none
+template<CONTROLLER_BACKEND BACKEND, int NUM = 0> constexpr int controller_first()
+{
+    if constexpr (NUM == NUM_CONTROLLERS) {
+        return -1;
+    } else if constexpr (controller_backend_v<NUM> == BACKEND) {
+        return NUM;
+    } else {
+        return controller_first<BACKEND, NUM + 1>();
+    }
+}
+
+/// @brief Number of the first MCP controller, -1 if there is none
+constexpr int controller_first_mcp()
+{
+    return controller_first<BACKEND_MCP>();
+}
+
+/// @brief Number of the TWAI controller, the bus the benchmarks, the load test and the replay use
+static constexpr int C0_NUM = controller_first<BACKEND_TWAI>();
+static_assert(C0_NUM >= 0, "controller_devices has no TWAI controller");
+
+/// @brief Calls f(std::integral_constant<int, NUM>()) for every MCP controller NUM, in order
+template<int NUM = 0, typename F> static inline void for_each_mcp(F &&f)
+{
+    if constexpr (NUM < NUM_CONTROLLERS) {
+        if constexpr (controller_backend_v<NUM> == BACKEND_MCP) {
+            f(std::integral_constant<int, NUM>());
+        }
+        for_each_mcp<NUM + 1>(f);
+    }
+}
 
+/// @brief The library object of each controller, for sending by controller number
+static const std::array<tNMEA2000*, NUM_CONTROLLERS> controllers = std::apply(
+    [](auto&... device) { return std::array<tNMEA2000*, NUM_CONTROLLERS>{&device...}; }, controller_devices);
+
+/// @brief Backend of each controller, for code that gets the controller number at runtime
+static const std::array<CONTROLLER_BACKEND, NUM_CONTROLLERS> controller_backends = std::apply(
+    [](auto&... device) { return std::array<CONTROLLER_BACKEND, NUM_CONTROLLERS>{
+        controller_backend<std::remove_reference_t<decltype(device)>>::value...}; }, controller_devices);
+
+/// @brief Log tag of each controller
+static const std::array<const char*, NUM_CONTROLLERS> controller_tags = std::apply(
+    [](const auto&... mcp) { return std::array<const char*, NUM_CONTROLLERS>{TAG_TWAI, mcp.tag...}; }, 
+    std::to_array(mcp_devices));
+
+/// @brief INT pin of each MCP controller, MCP_NO_INT for TWAI
+static const std::array<int, NUM_CONTROLLERS> controller_int_pins = std::apply(
+    [](const auto&... mcp) { return std::array<int, NUM_CONTROLLERS>{MCP_NO_INT, mcp.int_pin...}; }, 
+    std::to_array(mcp_devices));
 
 // Task Handles
-static TaskHandle_t C0_send_task_handle = NULL;
-static TaskHandle_t C0_receive_task_handle = NULL;
-static TaskHandle_t C1_send_task_handle = NULL;
-static TaskHandle_t C1_receive_task_handle = NULL;
-static TaskHandle_t C2_send_task_handle = NULL;
-static TaskHandle_t C2_receive_task_handle = NULL;
+static TaskHandle_t controller_send_task_handle[NUM_CONTROLLERS] = {NULL};
+static TaskHandle_t controller_receive_task_handle[NUM_CONTROLLERS] = {NULL};
+static TaskHandle_t mcp_bus_task_handle = NULL;
 static TaskHandle_t stats_task_handle = NULL;
 static TaskHandle_t modes_task_handle = NULL;
+static TaskHandle_t actisense_task_handle = NULL;
+static TaskHandle_t benchmark_task_handle = NULL;
+static TaskHandle_t topology_sweep_task_handle = NULL;
+static TaskHandle_t memory_budget_task_handle = NULL;
+static TaskHandle_t load_test_task_handle = NULL;
+static TaskHandle_t log_task_handle = NULL;
+static TaskHandle_t command_task_handle = NULL;
+static TaskHandle_t wasm_pthread_handle = NULL; //!< FreeRTOS task running the WASM pthread, set by the pthread
+static TaskHandle_t wasm_loader_handle = NULL; //!< FreeRTOS task running the WASM loader pthread, set by the pthread
 
-QueueHandle_t C0_tx_queue; //!< Queue that stores messages to be sent out on controller 0
-QueueHandle_t C1_tx_queue; //!< Queue that stores messages to be sent out on controller 1
-QueueHandle_t C2_tx_queue; //!< Queue that stores messages to be sent out on controller 2
+QueueHandle_t tx_queues[NUM_CONTROLLERS]; //!< Queues that store messages to be sent out, per controller
 QueueHandle_t rx_queue; //!< Queue that stores all messages received on all controllers
 static QueueHandle_t gpio_evt_queue = NULL; //!< Queue that stores GPIO events from ISR for changing t connector mode
 
-SemaphoreHandle_t x_sem_mcp1; //!< Semaphore handle for MCP1
-SemaphoreHandle_t x_sem_mcp2; //!< Semaphore handle for MCP2
-
-static unsigned long C0_MsgSentCount=0;
-static unsigned long C0_MsgFailCount=0;
-static unsigned long C1_MsgSentCount=0;
-static unsigned long C1_MsgFailCount=0;
-static unsigned long C2_MsgSentCount=0;
-static unsigned long C2_MsgFailCount=0;
-
-/// @brief enum to store identifiers for each controller
-enum CONTROLLER {
-    C0_NUM = 0,
-    C1_NUM = 1,
-    C2_NUM = 2
+SemaphoreHandle_t controller_locks[NUM_CONTROLLERS]; //!< Keep the send and receive task of a MCP controller off the device at the same time, NULL for TWAI
+
+// Static storage for the queues and semaphores, nothing in the message path is allocated from the heap
+static uint8_t tx_queue_storage[NUM_CONTROLLERS][TX_QUEUE_SIZE * sizeof(NMEA_msg)];
+static uint8_t rx_queue_storage[RX_QUEUE_SIZE * sizeof(NMEA_msg)];
+static uint8_t gpio_evt_queue_storage[GPIO_EVT_QUEUE_SIZE * sizeof(uint32_t)];
+static StaticQueue_t tx_queue_buffers[NUM_CONTROLLERS];
+static StaticQueue_t rx_queue_buffer;
+static StaticQueue_t gpio_evt_queue_buffer;
+static StaticSemaphore_t controller_lock_buffers[NUM_CONTROLLERS];
+
+#ifdef WASM_HEAP_POOL
+static uint8_t *wasm_heap_pool = NULL; //!< WAMR runtime pool, reserved once at boot and never freed
+#endif
+static int heap_init_allocated_blocks = -1; //!< Heap blocks in use when the gateway finished initializing, -1 before that
+
+#if defined(TELEMETRY) && TELEMETRY_SINK == TELEMETRY_SINK_RING
+// A no-split item takes the frame plus an 8 byte header
+static uint8_t telemetry_ring_storage[TELEMETRY_RING_FRAMES * (sizeof(telemetry_frame<NUM_CONTROLLERS>) + 8)];
+static StaticRingbuffer_t telemetry_ring_buffer;
+RingbufHandle_t telemetry_ring = NULL; //!< Latest telemetry frames, for a task forwarding them off the board
+#endif
+
+#ifdef MEMORY_BUDGET
+// Highest fill level seen per queue, only an estimate since updates are not atomic
+static volatile UBaseType_t rx_queue_peak = 0;
+static volatile UBaseType_t tx_queue_peak[NUM_CONTROLLERS] = {0};
+static volatile uint32_t wasm_stack_peak = 0; //!< Highest WASM stack use of any app, bytes
+static volatile uint32_t wasm_heap_peak = 0;  //!< Highest app heap use of any app, bytes
+#endif
+
+static unsigned long tx_sent_count[NUM_CONTROLLERS] = {0}; //!< Messages sent, per controller
+static unsigned long tx_fail_count[NUM_CONTROLLERS] = {0}; //!< Failed send attempts, per controller
+
+/// @brief Boot stages, in the order they are expected to complete
+enum BOOT_STAGE {
+    BOOT_APP_MAIN = 0,      //!< app_main entered
+    BOOT_SPI_READY,         //!< MCP SPI bus initialized
+    BOOT_C0_READY,          //!< Controller 0 open, followed by the stage of every other controller
+    BOOT_WASM_READY = BOOT_C0_READY + NUM_CONTROLLERS, //!< WASM app instantiated and buffers linked
+    BOOT_FIRST_RX,          //!< First message received on any controller
+    BOOT_FIRST_FORWARD,     //!< First message sent by any controller
+    BOOT_STAGE_COUNT
 };
 
+static_assert(BOOT_STAGE_COUNT <= 24, "boot_events holds 24 stages");
+
+// Readiness barriers in boot_events, one bit per stage
+#define BOOT_BIT(stage)             (1 << (stage))
+#define BOOT_CONTROLLER_READY(num)  static_cast<BOOT_STAGE>(BOOT_C0_READY + (num)) // stage of controller num
+#define BOOT_CONTROLLERS_READY      (BOOT_BIT(BOOT_WASM_READY) - BOOT_BIT(BOOT_C0_READY))
+#define BOOT_ALL_READY              (BOOT_CONTROLLERS_READY | BOOT_BIT(BOOT_WASM_READY))
+
+static StaticEventGroup_t boot_events_buffer;
+static EventGroupHandle_t boot_events = NULL; //!< Readiness barriers between the boot stages
+static int64_t boot_stage_us[BOOT_STAGE_COUNT] = {0}; //!< Time each boot stage completed, 0 if not yet
+static const char* boot_stage_names[BOOT_STAGE_COUNT - NUM_CONTROLLERS] = {
+    "app_main", "spi_ready", "wasm_ready", "first_rx", "first_forward"
+}; //!< Stages other than BOOT_CONTROLLER_READY, those are named c<n>_ready
+
 //----------------------------------------------------------------------------------------------------------------------------
 // Forward Declarations
 //----------------------------------------------------------------------------------------------------------------------------
-void HandleNMEA2000Msg(const tN2kMsg &N2kMsg);
+void HandleNMEA2000Msg(const tN2kMsg &N2kMsg, uint8_t controller_number);
+template<int NUM> void HandleControllerMsg(const tN2kMsg &N2kMsg);
+template<int NUM> static void controller_setup();
+static void NotifyMcpBus();
+static int heap_allocated_blocks();
+static void queue_peak_update(QueueHandle_t queue);
+static bool rx_queue_receive(NMEA_msg &msg, TickType_t wait);
+static void boot_mark(BOOT_STAGE stage);
+static void boot_wait(EventBits_t bits);
+static void print_boot_timeline(const char* TAG);
 std::string nmea_to_string(NMEA_msg& msg);
+size_t nmea_to_chars(const NMEA_msg& msg, char *buf, size_t buf_size);
+void nmea_to_n2k(const NMEA_msg &msg, tN2kMsg &N2kMsg);
 void uintArrToCharrArray(uint8_t (&data_uint8_arr)[MAX_DATA_LENGTH_BTYES], unsigned char (&data_char_arr)[MAX_DATA_LENGTH_BTYES]);
 //----------------------------------------------------------------------------------------------------------------------------
 // Variables
 //-----------------------------------------------------------------------------------------------------------------------------
 char * wasm_buffer = NULL;  //!< buffer allocated for wasm app, used to hold received messages so app can access them
 char * wasm_mode_buffer = NULL;  //!< buffer allocated for wasm app, used to hold current t connector mode set by Raspberry Pi
+
+/// @brief A loaded and instantiated WASM app with its linked buffers
+struct wasm_app {
+    uint8_t *image;                 //!< Module bytes, WAMR keeps pointers into them until the module is unloaded
+    uint32_t image_size;
+    bool image_owned;               //!< image is in the heap and freed with the app
+    wasm_module_t module;
+    wasm_module_inst_t module_inst;
+    wasm_exec_env_t exec_env;       //!< Used to call the link functions
+    uint32_t msg_buffer_offset;     //!< Buffer addresses in the app's memory, 0 if not allocated
+    uint32_t mode_buffer_offset;
+    uint32_t state_table_offset;
+    char *msg_buffer;
+    char *mode_buffer;
+    state_table *table;             //!< NULL if the app does not link a state table
+};
+static wasm_app wasm_apps[WASM_POOL_APPS]; //!< The running app and, with WASM_HOT_SWAP, the one loaded to replace it
+static wasm_app *wasm_app_live = NULL; //!< App run by the WASM pthread, only changed by the WASM pthread
+#ifdef WASM_HOT_SWAP
+/// @brief Module for the loader, image NULL to load the wasm_app partition
+struct wasm_load_request {
+    uint8_t *image;                 //!< In the heap, owned by the loader
+    uint32_t size;
+    bool persist;                   //!< Write the module to the wasm_app partition once it runs
+};
+static wasm_load_request wasm_request; //!< Written by command_task while wasm_loader_busy is clear
+static std::atomic<bool> wasm_loader_busy(false); //!< Set from a request until its app is swapped in or has failed
+static std::atomic<wasm_app*> wasm_app_pending(nullptr); //!< App instantiated by the loader, waiting to be swapped in
+static wasm_app *wasm_app_retired = NULL; //!< App swapped out, freed by the loader
+static SemaphoreHandle_t wasm_swap_done = NULL; //!< Given by the WASM pthread after a swap
+static StaticSemaphore_t wasm_swap_done_buffer;
+static unsigned long wasm_swap_count = 0;
+static unsigned long wasm_load_failed_count = 0;
+static uint32_t wasm_load_ms = 0; //!< Time the loader took to read and instantiate the last app
+static uint32_t wasm_swap_us = 0; //!< Time the WASM pthread spent on the last swap
+#endif
 int read_msg_count = 0; //!< Used to track messages read
 int send_msg_count = 0; //!< Used to track messages sent
-std::string tc_mode = "1"; //!< Contains the T Connector mode-> 0 - OFF, 1 - PASSIVE, 2 - GPS_ATTACK, 3 - TBD
+std::atomic<int> tc_mode(1); //!< Contains the T Connector mode-> 0 - OFF, 1 - PASSIVE, 2 - GPS_ATTACK, 3 - TBD. Set by the mode pins and the command channel
 uint32_t alerts_to_enable = TWAI_ALERT_RX_DATA | TWAI_ALERT_TX_FAILED | TWAI_ALERT_RX_QUEUE_FULL; //!< Sets which alerts to enable for TWAI controller
 
 // Task Counters - temporary, for debugging
-int C0_rx_task_count = 0;
-int C0_tx_task_count = 0;
-int C1_rx_task_count = 0;
-int C1_tx_task_count = 0;
-int C2_rx_task_count = 0;
-int C2_tx_task_count = 0;
+int rx_task_count[NUM_CONTROLLERS] = {0};
+int tx_task_count[NUM_CONTROLLERS] = {0};
+int mcp_bus_task_count = 0;
+unsigned long twai_rx_read_count = 0; //!< Frames the TWAI receive task read from the driver rx queue
 int wasm_pthread_count = 0;
+int wasm_msg_count = 0;
 int stats_task_count = 0;
+int actisense_msg_count = 0;
+int actisense_error_count = 0;
 double wasm_main_duration;
+static tLatencyHistogram wasm_latency; //!< Time from taking a message out of rx_queue until the WASM app returns, in us
+static int64_t wasm_msg_timestamp_us = 0; //!< Receive time of the message the WASM app is processing, given to the messages it sends
+#ifdef WASM_BUDGET
+/// @brief Who owns the run of the WASM app on the current message, see app_instance_main_budgeted()
+enum wasm_budget_state : uint32_t {
+    WASM_BUDGET_IDLE,       //!< No message is being processed
+    WASM_BUDGET_RUNNING,    //!< The app is running, the budget timer is armed
+    WASM_BUDGET_STOPPING,   //!< The budget timer expired and is terminating the app
+    WASM_BUDGET_STOPPED,    //!< The app was terminated, the WASM pthread applies WASM_OVERRUN_POLICY
+};
+#define WASM_BUDGET_STATE_BITS      2
+#define WASM_BUDGET_STATE_MASK      ((1u << WASM_BUDGET_STATE_BITS) - 1)
+#define WASM_BUDGET_PACK(generation, state) (((generation) << WASM_BUDGET_STATE_BITS) | (state))
+#define WASM_TERMINATED_EXCEPTION   "terminated by user" // exception wasm_runtime_terminate() ends the app with
+
+/// @brief How a run of the WASM app on a message ended
+enum wasm_run_result {
+    WASM_RUN_DONE,          //!< Returned within WASM_BUDGET_US
+    WASM_RUN_LATE,          //!< Ran past WASM_BUDGET_US but returned before the termination stopped it
+    WASM_RUN_TERMINATED     //!< Stopped by the termination, WASM_OVERRUN_POLICY applies
+};
+static esp_timer_handle_t wasm_budget_timer = NULL;
+static std::atomic<uint32_t> wasm_budget_state(WASM_BUDGET_IDLE); //!< Generation of the run and its wasm_budget_state
+static uint32_t wasm_budget_armed_generation = 0; //!< Run the timer is armed for, read by the timer callback
+static std::atomic<uint32_t> wasm_budget_callbacks(0); //!< Timer callbacks that have finished
+static wasm_module_inst_t wasm_budget_inst = NULL; //!< Instance run under the budget, set before WASM_BUDGET_RUNNING
+static const NMEA_msg *wasm_budget_msg = NULL; //!< Message the app is running on, NULL between messages
+static uint64_t wasm_sent_to = 0; //!< Controllers the app queued any message to while running on wasm_budget_msg, one bit each
+static_assert(NUM_CONTROLLERS <= 64, "wasm_sent_to has a bit per controller");
+static unsigned long wasm_overrun_count = 0; //!< Messages the WASM app was terminated on
+static unsigned long wasm_late_count = 0; //!< Messages the WASM app ran past its budget on and returned from
+static uint32_t wasm_overrun_pgn = 0; //!< PGN of the last message the WASM app was terminated on
+static unsigned long wasm_overrun_forward_dropped_count = 0; //!< Forwarded copies that did not fit a send queue
+#endif
+
+// Receive Timestamps
+static int64_t rx_frame_time_us[NUM_CONTROLLERS] = {0}; //!< Time each controller was last read, in us
+static portMUX_TYPE rx_frame_time_lock = portMUX_INITIALIZER_UNLOCKED; //!< 64 bit values are not written atomically
+
+// Forward Latency
+static tLatencyHistogram forward_latency[NUM_CONTROLLERS]; //!< Time from receipt until sent, per sending controller, in us
+static unsigned long tx_stale_count[NUM_CONTROLLERS] = {0}; //!< Messages dropped because they were older than TX_STALE_US
+
+// RX Queue Overflow - exact counts, updated from all receive tasks
+static std::atomic<uint32_t> rx_drop_newest_count(0); //!< Messages discarded because they did not fit
+static std::atomic<uint32_t> rx_drop_oldest_count(0); //!< Queued or parked messages discarded to make room for newer ones
+static std::atomic<uint32_t> rx_conflated_count(0);   //!< Parked messages replaced by a newer one from the same stream
+
+#ifdef RX_CONFLATING_QUEUE
+static tStreamConflator rx_streams; //!< Pending messages of the periodic streams in rx_queue
+static_assert(NUM_CONTROLLERS <= CONFLATE_MAX_CONTROLLERS, "controller numbers would alias in the stream key");
+static portMUX_TYPE rx_streams_lock = portMUX_INITIALIZER_UNLOCKED;
+static const uint32_t rx_conflate_pgns[] = {
+    127250, // Vessel heading
+    127251, // Rate of turn
+    127257, // Attitude
+    128259, // Speed, water referenced
+    128267, // Water depth
+    129025, // Position, rapid update
+    129026, // COG & SOG, rapid update
+    129029  // GNSS position data
+}; //!< Periodic state PGNs without an instance field, every other PGN stays FIFO
+#endif
+
+#if RX_OVERFLOW_POLICY == RX_OVERFLOW_CONFLATE
+/// @brief Message parked while the rx queue is full
+struct rx_conflate_slot {
+    bool used;
+    NMEA_msg msg;
+};
+static rx_conflate_slot rx_conflate_slots[RX_CONFLATE_SLOTS];
+static std::atomic<int> rx_conflate_used(0);
+static portMUX_TYPE rx_conflate_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+// TX Retry
+static tTxRetryQueue tx_retry[NUM_CONTROLLERS]; //!< Messages that failed to send, per controller. Only used by the controller's send task
+
+// State Table
+static std::atomic<state_table*> wasm_state_table(nullptr); //!< Latest value table in the WASM app's memory, NULL until linked
+static portMUX_TYPE state_table_lock = portMUX_INITIALIZER_UNLOCKED; //!< Serializes the receive tasks writing the table
+static const uint32_t state_table_pgns[] = {
+    127250, // Vessel heading
+    127251, // Rate of turn
+    127257, // Attitude
+    127258, // Magnetic variation
+    128259, // Speed, water referenced
+    128267, // Water depth
+    129025, // Position, rapid update
+    129026, // COG & SOG, rapid update
+    129029, // GNSS position data
+    130306  // Wind data
+}; //!< PGNs kept in the state table
+
+// TX Rate Limits
+static tRateLimiter tx_rate_limiter; //!< Applied in SendMsg, only used by the WASM pthread
+static_assert(NUM_CONTROLLERS < RATE_LIMIT_RULES, "a default rate limit rule per controller leaves no room for the app");
+
+// Echo Suppression
+static tEchoFilter echo_filter; //!< Messages sent by any controller, to recognize them when they are received again
+static portMUX_TYPE echo_filter_lock = portMUX_INITIALIZER_UNLOCKED; //!< Recorded by the send side, checked by the receive side
+static unsigned long echo_suppressed_count[NUM_CONTROLLERS] = {0}; //!< Echoes dropped, per receiving controller
+
+// Bus Load
+static tBusLoadEstimator bus_load[NUM_CONTROLLERS]; //!< Received bus load per controller
+static portMUX_TYPE bus_load_lock[NUM_CONTROLLERS]; //!< Written by the receive handler, read by the stats task, set up in app_main
+static tLoadShedder load_shedder[NUM_CONTROLLERS]; //!< Admission to the WASM app per controller
+static const uint32_t wasm_critical_pgns[] = {
+    127250, // Vessel heading
+    129025, // Position, rapid update
+    129026, // COG & SOG, rapid update
+    129029  // GNSS position data
+}; //!< PGNs the WASM app depends on, never shed
+static const load_shedder_config shedder_config = {
+    SHED_OVERLOAD_PERCENT,
+    SHED_QUEUE_HIGH_WATER,
+    SHED_LOW_PRIORITY,
+    SHED_SAMPLE_RATE,
+    wasm_critical_pgns,
+    sizeof(wasm_critical_pgns) / sizeof(wasm_critical_pgns[0])
+};
+
+#ifdef COMMAND_CHANNEL
+// Command Channel
+static command_config command_staged; //!< Transaction being received, only used by command_task
+static std::atomic<uint32_t> command_generation(0); //!< Committed transactions
+// Committed transactions the WASM pthread has not applied yet, merged: rules add up, the last mode and PGN list win
+static rate_limit_rule command_rate_pending[RATE_LIMIT_RULES];
+static size_t command_rate_pending_count = 0;
+static int command_mode_pending = -1;
+static bool command_critical_pending_set = false;
+static uint32_t command_critical_pending[CMD_MAX_CRITICAL_PGNS];
+static size_t command_critical_pending_count = 0;
+static portMUX_TYPE command_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t command_critical_pgns[2][CMD_MAX_CRITICAL_PGNS]; //!< Alternating, receive tasks may still read the last list
+static load_shedder_config command_shedder_config[2];
+static int command_shedder_slot = 0;
+static unsigned long command_injected_count = 0;
+static unsigned long command_inject_dropped_count = 0;
+#ifdef WASM_HOT_SWAP
+static command_module command_module_staged; //!< Module being received, only used by command_task
+#endif
+#endif
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// Deferred Logging
+//-------------------------------------------------------------------------------------------------------------------------------
+// DLOGE/W/I/D/V replace ESP_LOGx on the per message paths. Levels above DEFERRED_LOG_LEVEL are removed at compile time,
+// the runtime level of the tag is applied when log_task writes the message. Arguments must be integers of at most 32
+// bits (no strings, floats or 64 bit values), at most DEFERRED_LOG_ARGS of them.
+#ifdef DEFERRED_LOG
+static tDeferredLogRing deferred_log_rings[portNUM_PROCESSORS]; //!< Messages recorded on each core, emptied by log_task
+
+/**
+ * @brief Records a message in the ring of the calling core, use the DLOG* macros
+*/
+template <typename... Args>
+static inline void deferred_log(esp_log_level_t level, const char *tag, const char *format, Args... args)
+{
+    static_assert(sizeof...(Args) <= DEFERRED_LOG_ARGS, "too many arguments for a deferred log message");
+    static_assert(((std::is_integral<Args>::value && sizeof(Args) <= sizeof(long)) && ...),
+        "deferred log arguments must be integers of at most 32 bits");
+    const uint32_t values[DEFERRED_LOG_ARGS + 1] = {static_cast<uint32_t>(args)...};
+    deferred_log_rings[esp_cpu_get_core_id()].Record(level, tag, format, esp_log_timestamp(), values, sizeof...(Args));
+}
+
+/**
+ * @brief Messages lost because a deferred log ring was full, over all cores
+*/
+static uint32_t deferred_log_overflow()
+{
+    uint32_t overflow = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        overflow += deferred_log_rings[core].OverflowCount.load();
+    }
+    return overflow;
+}
+
+#define DLOG(level, tag, format, ...) \
+    do { if constexpr ((level) <= DEFERRED_LOG_LEVEL) { deferred_log(level, tag, format, ##__VA_ARGS__); } } while (0)
+#else
+#define DLOG(level, tag, format, ...) \
+    do { if constexpr ((level) <= DEFERRED_LOG_LEVEL) { ESP_LOG_LEVEL_LOCAL(level, tag, format, ##__VA_ARGS__); } } while (0)
+#endif
+#define DLOGE(tag, format, ...) DLOG(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) DLOG(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) DLOG(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...) DLOG(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define DLOGV(tag, format, ...) DLOG(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
 //-------------------------------------------------------------------------------------------------------------------------------
 // Native Functions to Export to WASM App
 //-----------------------------------------------------------------------------------------------------------------------------
@@ -196,6 +752,57 @@ void PrintInt32(wasm_exec_env_t exec_env,int32_t number,int32_t hex){
     return;
 }
 
+/**
+ * @brief Returns the receive time of the message the WASM app is processing
+ * 
+ * Native function to be exported to WASM app.
+ * 
+ * @param exec_env
+ * \return esp_timer time in us at which the message was read from its controller, 0 if unknown
+*/
+int64_t GetMsgTimestamp(wasm_exec_env_t exec_env){
+    return wasm_msg_timestamp_us;
+}
+
+/**
+ * @brief Returns the current time
+ * 
+ * Native function to be exported to WASM app. Together with GetMsgTimestamp the app can tell how old a message is.
+ * 
+ * @param exec_env
+ * \return esp_timer time in us
+*/
+int64_t GetTimeUs(wasm_exec_env_t exec_env){
+    return esp_timer_get_time();
+}
+
+/**
+ * @brief Sets the rate limit for messages the WASM app sends
+ * 
+ * Native function to be exported to WASM app. Adds a rule or replaces the rule with the same controller, PGN and 
+ * source. The most specific matching rule applies to a message, see rate_limit.h.
+ * 
+ * @param exec_env
+ * @param[in] controller_number controller, or -1 for all
+ * @param[in] PGN PGN, or -1 for all
+ * @param[in] source source address, or -1 for all
+ * @param[in] rate_per_s sustained messages per second
+ * @param[in] burst messages that can be sent back to back, 0 removes the rule
+ * 
+ * \return 1 if the rule was set, 0 if the rule table is full
+*/
+int32_t SetTxRate(wasm_exec_env_t exec_env, int32_t controller_number, int32_t PGN, int32_t source, int32_t rate_per_s, int32_t burst){
+    if (rate_per_s < 0 || burst < 0){
+        return 0;
+    }
+    rate_limit_rule rule = {controller_number, PGN, source, static_cast<uint32_t>(rate_per_s), static_cast<uint32_t>(burst)};
+    if (!tx_rate_limiter.SetRule(rule, esp_timer_get_time())){
+        ESP_LOGW(TAG_WASM, "Rate limit table full, rule for PGN %" PRIi32 " not set", PGN);
+        return 0;
+    }
+    return 1;
+}
+
 /****************************************************************************
  * \brief Puts a message in a controller send queue
  * 
@@ -210,16 +817,22 @@ void PrintInt32(wasm_exec_env_t exec_env,int32_t number,int32_t hex){
  * @param[in] data
  * @param[in] data_length_bytes 
  * 
- * \return 1 if message converted successfully, 0 if not.
+ * \return 1 if message converted successfully, 0 if not or if it is over its rate limit (see SetTxRate).
 */
 int32_t SendMsg(wasm_exec_env_t exec_env, int32_t controller_number, int32_t priority, int32_t PGN, int32_t source, uint8_t* data, int32_t data_length_bytes ){
-    ESP_LOGD(TAG_WASM, "SendMsg called \n");
+    DLOGD(TAG_WASM, "SendMsg called");
     NMEA_msg msg;
     msg.controller_number = controller_number;
     msg.priority = priority;
     msg.PGN = PGN;
     msg.source = source;
     msg.data_length_bytes = data_length_bytes;
+    msg.timestamp_us = wasm_msg_timestamp_us; // a message sent by the app is as old as the message that caused it
+
+    if (!tx_rate_limiter.Admit(controller_number, msg.PGN, source, esp_timer_get_time())){
+        DLOGV(TAG_WASM, "rate limited msg with PGN %u on controller %" PRIi32, msg.PGN, controller_number);
+        return 0;
+    }
 
     // Copy the data bytes
     for (size_t i = 0; i < data_length_bytes; ++i) {
@@ -228,32 +841,23 @@ int32_t SendMsg(wasm_exec_env_t exec_env, int32_t controller_number, int32_t pri
     }
 
     
-    if (controller_number == C0_NUM){
-        // Add to controller 0 queue
-        ESP_LOGD(TAG_WASM,"Added a msg to ctrl0_q with PGN %u \n", msg.PGN);
-        if (xQueueSendToBack(C0_tx_queue, &msg, pdMS_TO_TICKS(10))){
-            return 1;
-        }
+    if (controller_number < 0 || controller_number >= NUM_CONTROLLERS){
+        DLOGE(TAG_WASM, "Invalid controller number: %" PRIi32, controller_number);
+        return 0;
     }
-    else if(controller_number == C1_NUM)
-    {
-        // Add to controller 1 queue
-        ESP_LOGD(TAG_WASM,"Added a msg to ctrl1_q with PGN %u \n", msg.PGN);
-        if (xQueueSendToBack(C1_tx_queue, &msg, pdMS_TO_TICKS(10))){
-            return 1;
+
+    DLOGD(TAG_WASM, "Added a msg to ctrl%" PRIi32 "_q with PGN %u", controller_number, msg.PGN);
+    if (xQueueSendToBack(tx_queues[controller_number], &msg, pdMS_TO_TICKS(10))){
+        queue_peak_update(tx_queues[controller_number]);
+        if (controller_backends[controller_number] == BACKEND_MCP){
+            NotifyMcpBus();
         }
-    }
-    else if(controller_number == C2_NUM)
-    {
-        // Add to controller 2 queue
-        ESP_LOGD(TAG_WASM,"Added a msg to ctrl2_q with PGN %u \n", msg.PGN);
-        if (xQueueSendToBack(C2_tx_queue, &msg, pdMS_TO_TICKS(10))){
-            return 1;
+#ifdef WASM_BUDGET
+        if (wasm_budget_msg != NULL){
+            wasm_sent_to |= 1ull << controller_number; // the app handled this controller, the overrun fallback skips it
         }
-    }
-    else{
-        ESP_LOGE(TAG_WASM, "Invalid controller number: %" PRIu32 "", controller_number);
-        return 0;
+#endif
+        return 1;
     }
 
     return 0;
@@ -265,25 +869,48 @@ int32_t SendMsg(wasm_exec_env_t exec_env, int32_t controller_number, int32_t pri
 
 /**
  * \brief converts a NMEA_msg to a string
- * @todo make sure that if pgn is only 4 digits in hex it still takes 5
  * @param[in] msg reference to a NMEA_msg object
  * \return std::string representing the message
 */
 std::string nmea_to_string(NMEA_msg& msg){
-    std::stringstream ss;
-    ss << std::hex << std::setw(1) << std::setfill('0') << static_cast<int>(msg.controller_number);
-    ss << std::hex << std::setw(1) << std::setfill('0') << static_cast<int>(msg.priority);
-    ss << std::hex << std::setw(5) << std::setfill('0') << msg.PGN;
-    ss << std::hex << std::setw(1) << std::setfill('0') << static_cast<int>(msg.source);
-    ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(msg.data_length_bytes);
-    for (uint8_t d : msg.data){
-        char hex_num[3];
-        sprintf(hex_num, "%X", d);
-        ss << std::setw(2) << hex_num;
-    }
-    const std::string s = ss.str();
-    return s;
-    
+    char buf[MSG_STRING_SIZE];
+    nmea_to_chars(msg, buf, sizeof(buf));
+    return std::string(buf);
+}
+
+/**
+ * \brief converts a NMEA_msg to the text format read by the WASM app without allocating
+ * 
+ * Controller, priority, PGN (at least 5 digits), source and length (at least 2 digits) in lower case hex, followed by 
+ * all MAX_DATA_LENGTH_BTYES data bytes as 2 upper case hex digits each.
+ * 
+ * @todo make sure that if pgn is only 4 digits in hex it still takes 5
+ * @param[in] msg reference to a NMEA_msg object
+ * @param[out] buf buffer for the string, MSG_STRING_SIZE bytes are always enough
+ * @param[in] buf_size size of buf
+ * \return length of the string, it is truncated and null terminated if buf is too small
+*/
+size_t nmea_to_chars(const NMEA_msg& msg, char *buf, size_t buf_size){
+    static const char hex_digits[] = "0123456789ABCDEF";
+    if (buf_size == 0){
+        return 0;
+    }
+    int header = snprintf(buf, buf_size, "%x%x%05" PRIx32 "%x%02x", msg.controller_number, msg.priority, 
+        static_cast<uint32_t>(msg.PGN), msg.source, msg.data_length_bytes);
+    if (header < 0){
+        buf[0] = 0;
+        return 0;
+    }
+    size_t len = static_cast<size_t>(header);
+    if (len >= buf_size){
+        return buf_size - 1;
+    }
+    for (size_t i = 0; i < MAX_DATA_LENGTH_BTYES && len + 2 < buf_size; i++){
+        buf[len++] = hex_digits[msg.data[i] >> 4];
+        buf[len++] = hex_digits[msg.data[i] & 0x0f];
+    }
+    buf[len] = 0;
+    return len;
 }
 
 /**
@@ -299,6 +926,24 @@ void uint8ArrayToCharrArray(uint8_t (&data_uint8_arr)[MAX_DATA_LENGTH_BTYES], un
     }
 }
 
+/**
+ * @brief Converts a NMEA_msg to the N2kMsg the message handler receives from a controller
+ * 
+ * Used to inject generated messages as if they had been received.
+ * 
+ * @param[in] msg
+ * @param[out] N2kMsg
+*/
+void nmea_to_n2k(const NMEA_msg &msg, tN2kMsg &N2kMsg){
+    N2kMsg.Priority = msg.priority;
+    N2kMsg.PGN = msg.PGN;
+    N2kMsg.Source = msg.source;
+    N2kMsg.Destination = 0xff;
+    N2kMsg.DataLen = msg.data_length_bytes;
+    memcpy(N2kMsg.Data, msg.data, MAX_DATA_LENGTH_BTYES);
+    N2kMsg.MsgTime = 0;
+}
+
 //---------------------------------------------------------------------------------------------------------------------------------------------
 /**
  * @brief Interrupt Handler for gpio that determine T Connector modes
@@ -330,7 +975,7 @@ void configTConnectorModes()
     gpio_config(&io_conf);
 
     //create a queue to handle gpio event from isr
-    gpio_evt_queue = xQueueCreate(10, sizeof(uint32_t));
+    gpio_evt_queue = xQueueCreateStatic(GPIO_EVT_QUEUE_SIZE, sizeof(uint32_t), gpio_evt_queue_storage, &gpio_evt_queue_buffer);
 
     //install gpio isr service
     gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
@@ -359,7 +1004,7 @@ void get_mode_task(void *pvParameters)
             int msb = gpio_get_level(GPIO_NUM_19);
             int lsb = gpio_get_level(GPIO_NUM_18);
             int mode = (msb << 1) | lsb;
-            tc_mode = std::to_string(mode);
+            tc_mode = mode;
             ESP_LOGD("MODE: ", "%i",mode); 
         }
     }
@@ -367,11 +1012,13 @@ void get_mode_task(void *pvParameters)
 /**
  * \brief Sends a message
  * 
- * Converts NMEA-msg to the NMEA2000 Library N2kMsg format and sends the message
+ * Converts NMEA-msg to the NMEA2000 Library N2kMsg format and sends the message. MsgTime is taken from the receive 
+ * timestamp of the message. The time from receipt until the controller accepted the message is added to the forward 
+ * latency of the controller.
  * 
- * @todo update time to take time from message
  * @todo update for multiple controllers
  * 
+ * \return true if the controller accepted the message
 */
 bool SendN2kMsg(NMEA_msg msg, int controller_num) {
   tN2kMsg N2kMsg;
@@ -384,40 +1031,118 @@ bool SendN2kMsg(NMEA_msg msg, int controller_num) {
 
   uint8ArrayToCharrArray(msg.data, N2kMsg.Data);
 
-  N2kMsg.MsgTime = N2kMillis64();//TODO 
+  N2kMsg.MsgTime = (msg.timestamp_us != 0) ? static_cast<unsigned long>(msg.timestamp_us / 1000) : N2kMillis64();
+  bool sent = false;
 
-  if(controller_num == C0_NUM){
-    if ( C0.SendMsg(N2kMsg) ) {
-      ESP_LOGD(TAG_TWAI, "sent a message \n");
-      C0_MsgSentCount++;
-      send_msg_count++;
-    } else {
-      ESP_LOGW(TAG_TWAI, "failed to send a message \n");
-      C0_MsgFailCount++;
-    }
+  if (controller_num < 0 || controller_num >= NUM_CONTROLLERS) {
+    return false;
   }
-  else if(controller_num == C1_NUM){
-    if ( C1.SendMsg(N2kMsg) ) {
-      ESP_LOGD(TAG_MCP1, "sent a message \n");
-      C1_MsgSentCount++;
-      send_msg_count++;
-    } else {
-      ESP_LOGW(TAG_MCP1, "failed to send a message \n");
-      C1_MsgFailCount++;
-    }
+  sent = controllers[controller_num]->SendMsg(N2kMsg);
+  if ( sent ) {
+    DLOGD(controller_tags[controller_num], "sent a message");
+    tx_sent_count[controller_num]++;
+    send_msg_count++;
+  } else {
+    DLOGW(controller_tags[controller_num], "failed to send a message");
+    tx_fail_count[controller_num]++;
   }
-  else if(controller_num == C2_NUM){
-    if ( C2.SendMsg(N2kMsg) ) {
-      ESP_LOGD(TAG_MCP2, "sent a message \n");
-      C2_MsgSentCount++;
-      send_msg_count++;
-    } else {
-      //ESP_LOGW(TAG_MCP2, "failed to send a message \n");
-      C2_MsgFailCount++;
-    }
+
+  if (sent) {
+    uint32_t can_id = tEchoFilter::CanId(msg.priority, msg.PGN, msg.source);
+    uint32_t payload_hash = tEchoFilter::PayloadHash(msg.data, msg.data_length_bytes);
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&echo_filter_lock);
+    echo_filter.Record(controller_num, can_id, payload_hash, now);
+    portEXIT_CRITICAL(&echo_filter_lock);
+  }
+  if (sent && msg.timestamp_us != 0) {
+    forward_latency[controller_num].Add(static_cast<uint32_t>(esp_timer_get_time() - msg.timestamp_us));
   }
+  if (sent && boot_stage_us[BOOT_FIRST_FORWARD] == 0) {
+    boot_mark(BOOT_FIRST_FORWARD);
+  }
+  return sent;
+}
 
-    return true;
+/**
+ * \brief Checks if a message was received too long ago to be worth sending
+ * 
+ * Stale messages are counted per controller.
+ * 
+ * @param[in] msg
+ * @param[in] controller_num
+ * \return true if the message should be dropped
+*/
+static bool TxStale(const NMEA_msg &msg, int controller_num) {
+  if (TX_STALE_US == 0 || msg.timestamp_us == 0 || esp_timer_get_time() - msg.timestamp_us <= TX_STALE_US) {
+    return false;
+  }
+  tx_stale_count[controller_num]++;
+  return true;
+}
+
+/**
+ * \brief Sends a message, and puts it in the controller's retry queue if the controller can't take it
+ * 
+ * Messages older than TX_STALE_US are dropped.
+ * 
+ * @param[in] msg
+ * @param[in] controller_num
+*/
+static void SendOrRetry(const NMEA_msg &msg, int controller_num) {
+  if (TxStale(msg, controller_num)) {
+    return;
+  }
+  if (!SendN2kMsg(msg, controller_num)) {
+    tx_retry[controller_num].Add(msg, esp_timer_get_time());
+  }
+}
+
+/**
+ * \brief Retries one failed message of a controller if one is due
+ * 
+ * Only one message is retried per call so that retries never hold up new messages for long.
+ * 
+ * @param[in] controller_num
+*/
+static void ServiceTxRetries(int controller_num) {
+  tTxRetryQueue &retry = tx_retry[controller_num];
+  int64_t now = esp_timer_get_time();
+  int index = retry.NextDue(now);
+  if (index < 0) {
+    return;
+  }
+  if (TxStale(retry.Msg(index), controller_num)) {
+    retry.Remove(index);
+    return;
+  }
+  if (SendN2kMsg(retry.Msg(index), controller_num)) {
+    retry.Succeeded(index);
+  } else {
+    retry.Failed(index, esp_timer_get_time());
+  }
+}
+
+/**
+ * \brief Returns how long a send task can wait for a new message before a retry is due
+ * 
+ * @param[in] controller_num
+*/
+static TickType_t TxWaitTicks(int controller_num) {
+  const TickType_t max_wait = 100 / portTICK_PERIOD_MS;
+  int64_t due = tx_retry[controller_num].NextDueTime();
+  if (due < 0) {
+    return max_wait;
+  }
+  int64_t wait_us = due - esp_timer_get_time();
+  if (wait_us <= 0) {
+    return 0;
+  }
+  TickType_t ticks = pdMS_TO_TICKS((wait_us + 999) / 1000);
+  if (ticks == 0) {
+    ticks = 1;
+  }
+  return (ticks < max_wait) ? ticks : max_wait;
 }
 
 /**
@@ -441,46 +1166,25 @@ bool SendN2kMsg(NMEA_msg msg, int controller_num) {
 */
 static esp_err_t print_real_time_stats(TickType_t xTicksToWait)
 {
-    TaskStatus_t *start_array = NULL, *end_array = NULL;
+    // Static so printing stats does not allocate after init
+    static TaskStatus_t start_array[STATS_MAX_TASKS], end_array[STATS_MAX_TASKS];
     UBaseType_t start_array_size, end_array_size;
     uint32_t start_run_time, end_run_time;
     esp_err_t ret;
 
-    //Allocate array to store current task states
-    start_array_size = uxTaskGetNumberOfTasks() + ARRAY_SIZE_OFFSET;
-    start_array = reinterpret_cast<TaskStatus_t*>(std::malloc(sizeof(TaskStatus_t) * start_array_size));
-    if (start_array == NULL) {
-        ret = ESP_ERR_NO_MEM;
-        free(start_array);
-        free(end_array);
-        return ret;
-    }
     //Get current task states
-    start_array_size = uxTaskGetSystemState(start_array, start_array_size, &start_run_time);
+    start_array_size = uxTaskGetSystemState(start_array, STATS_MAX_TASKS, &start_run_time);
     if (start_array_size == 0) {
         ret = ESP_ERR_INVALID_SIZE;
-        free(start_array);
-        free(end_array);
         return ret;
     }
 
     vTaskDelay(xTicksToWait);
 
-    //Allocate array to store tasks states post delay
-    end_array_size = uxTaskGetNumberOfTasks() + ARRAY_SIZE_OFFSET;
-    end_array = reinterpret_cast<TaskStatus_t*>(std::malloc(sizeof(TaskStatus_t) * end_array_size));
-    if (end_array == NULL) {
-        ret = ESP_ERR_NO_MEM;
-        free(start_array);
-        free(end_array);
-        return ret;
-    }
     //Get post delay task states
-    end_array_size = uxTaskGetSystemState(end_array, end_array_size, &end_run_time);
+    end_array_size = uxTaskGetSystemState(end_array, STATS_MAX_TASKS, &end_run_time);
     if (end_array_size == 0) {
         ret = ESP_ERR_INVALID_SIZE;
-        free(start_array);
-        free(end_array);
         return ret;
     }
 
@@ -488,8 +1192,6 @@ static esp_err_t print_real_time_stats(TickType_t xTicksToWait)
     uint32_t total_elapsed_time = (end_run_time - start_run_time);
     if (total_elapsed_time == 0) {
         ret = ESP_ERR_INVALID_STATE;
-        free(start_array);
-        free(end_array);
         return ret;
     }
 
@@ -526,13 +1228,26 @@ static esp_err_t print_real_time_stats(TickType_t xTicksToWait)
         }
     }
     ret = ESP_OK;
-    free(start_array);
-    free(end_array);
     return ret;
 
 }
 
 
+/**
+ * @brief Reads the bus load of a controller, under the lock of its estimator
+ * @param[in] controller_number
+ * @param[in] now time in us
+ * @param[out] bits_per_s
+ * @param[out] frames_per_s
+*/
+static void bus_load_read(int controller_number, int64_t now, uint32_t &bits_per_s, uint32_t &frames_per_s)
+{
+    portENTER_CRITICAL(&bus_load_lock[controller_number]);
+    bits_per_s = bus_load[controller_number].BitsPerSecond(now);
+    frames_per_s = bus_load[controller_number].FramesPerSecond(now);
+    portEXIT_CRITICAL(&bus_load_lock[controller_number]);
+}
+
 /**
  * @brief Retrieves twai status and alerts
  * 
@@ -541,52 +1256,282 @@ static esp_err_t print_real_time_stats(TickType_t xTicksToWait)
  * @param[in] TAG
 */
 void GetStatus(const char* TAG){
-    uint32_t alerts = 0;
-    C0.ReadAlerts(alerts, pdMS_TO_TICKS(1));
-    if (alerts & TWAI_ALERT_RX_QUEUE_FULL){
-        ESP_LOGW(TAG, "TWAI rx queue full");
-    } 
     twai_status_info_t status;
     C0.GetTwaiStatus(status);
     ESP_LOGI(TAG, "TWAI Msgs queued for transmission: %" PRIu32 " Unread messages in rx queue: %" PRIu32, status.msgs_to_tx, status.msgs_to_rx);
     ESP_LOGI(TAG, "Msgs lost due to TWAI RX FIFO overrun: %" PRIu32 "", status.rx_overrun_count);
     ESP_LOGI(TAG, "Msgs lost due to full TWAI RX queue: %" PRIu32 "", status.rx_missed_count);
+    ESP_LOGI(TAG, "TWAI frames read: %lu in %d receive task wakeups", twai_rx_read_count, rx_task_count[C0_NUM]);
     ESP_LOGI(TAG, "Messages Read: %d, Messages Sent %d", read_msg_count, send_msg_count);
     UBaseType_t msgs_in_rx_q = uxQueueMessagesWaiting(rx_queue);
     ESP_LOGI(TAG, "Received Messages queue size: %d \n", msgs_in_rx_q);
-    UBaseType_t msgs_in_q0 = uxQueueMessagesWaiting(C0_tx_queue);
-    UBaseType_t msgs_in_q1 = uxQueueMessagesWaiting(C1_tx_queue);
-    UBaseType_t msgs_in_q2 = uxQueueMessagesWaiting(C2_tx_queue);
-    ESP_LOGI(TAG, "Controller 0 send queue size: %d \n", msgs_in_q0);
-    ESP_LOGI(TAG, "Controller 1 send queue size: %d \n", msgs_in_q1);
-    ESP_LOGI(TAG, "Controller 2 send queue size: %d \n", msgs_in_q2);
+    ESP_LOGI(TAG, "RX queue overflow - dropped newest: %" PRIu32 ", dropped oldest: %" PRIu32 ", conflated: %" PRIu32, 
+        rx_drop_newest_count.load(), rx_drop_oldest_count.load(), rx_conflated_count.load());
+#ifdef RX_CONFLATING_QUEUE
+    ESP_LOGI(TAG, "RX queue streams pending: %d, msgs replaced in queue: %lu, not conflated (table full): %lu",
+        rx_streams.Count(), rx_streams.ReplacedCount, rx_streams.FullCount);
+#endif
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        ESP_LOGI(TAG, "Controller %d send queue size: %d \n", i, uxQueueMessagesWaiting(tx_queues[i]));
+    }
 
     // Task Counters
-    ESP_LOGI(TAG, "RX task count: %d", C0_rx_task_count);
-    ESP_LOGI(TAG, "TX task count: %d", C0_tx_task_count);
-    ESP_LOGI(TAG, "MCP1 RX task count: %d", C1_rx_task_count);
-    ESP_LOGI(TAG, "MCP1 TX task count: %d", C1_tx_task_count);
-    ESP_LOGI(TAG, "MCP2 RX task count: %d", C2_rx_task_count);
-    ESP_LOGI(TAG, "MCP2 TX task count: %d", C2_tx_task_count);
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        ESP_LOGI(TAG, "%s RX task count: %d, TX task count: %d", controller_tags[i], rx_task_count[i], tx_task_count[i]);
+    }
+    ESP_LOGI(TAG, "MCP bus task count: %d", mcp_bus_task_count);
     ESP_LOGI(TAG, "Wasm pthread count: %d", wasm_pthread_count);
     ESP_LOGI(TAG, "Stats task count: %d", stats_task_count);
+#ifdef DEFERRED_LOG
+    ESP_LOGI(TAG, "Deferred log msgs lost: %" PRIu32, deferred_log_overflow());
+#endif
+#ifdef COMMAND_CHANNEL
+    ESP_LOGI(TAG, "Command config commits: %" PRIu32 ", msgs injected: %lu, dropped: %lu", command_generation.load(),
+        command_injected_count, command_inject_dropped_count);
+#endif
+#ifdef ACTISENSE_REPLAY
+    ESP_LOGI(TAG, "Actisense msgs replayed: %d, parse errors: %d", actisense_msg_count, actisense_error_count);
+#endif
 
-    //Duration of the app_instance_main for the wasm pthread
-    ESP_LOGI(TAG, "Duration of wasm task (ms): %f",wasm_main_duration/1000000);
-}
+    // TX Retry
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        ESP_LOGI(TAG, "Controller %d msgs sent: %lu, failed attempts: %lu", i, tx_sent_count[i], tx_fail_count[i]);
+    }
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        ESP_LOGI(TAG, "Controller %d retried OK: %lu, expired: %lu, dropped: %lu, waiting: %d", i,
+            tx_retry[i].RetriedOkCount, tx_retry[i].ExpiredCount, tx_retry[i].DroppedCount, tx_retry[i].Count());
+    }
 
-/**
- * @brief Optional FreeRTOS task for printing status messages for debugging 
- * 
- * @param pvParameters
- * 
-*/
-static void stats_task(void *arg)
-{
-    //Print real time stats periodically
-    while (1) {
-        printf("\n\nGetting real time stats over %" PRIu32 " ticks\n", STATS_TICKS);
-        if (print_real_time_stats(STATS_TICKS) == ESP_OK) {
+    // TX Rate Limits
+    ESP_LOGI(TAG, "WASM msgs rate limited: %lu", tx_rate_limiter.LimitedCount);
+    for (size_t i = 0; i < tRateLimiter::Slots(); i++){
+        const rate_limit_bucket &bucket = tx_rate_limiter.Bucket(i);
+        if (bucket.used){
+            ESP_LOGI(TAG, "Rate limit C%d PGN %" PRIi32 " source %d: %" PRIu32 "/s burst %" PRIu32 ", passed: %lu, limited: %lu",
+                bucket.rule.controller_number, bucket.rule.PGN, bucket.rule.source, bucket.rule.rate_per_s, bucket.rule.burst,
+                bucket.passed, bucket.limited);
+        }
+    }
+
+    // Echo Suppression
+    ESP_LOGI(TAG, "Echo filter recorded: %lu, evicted: %lu", echo_filter.RecordedCount, echo_filter.EvictedCount);
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        ESP_LOGI(TAG, "Controller %d echoes suppressed: %lu", i, echo_suppressed_count[i]);
+    }
+
+    // Forward Latency
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        ESP_LOGI(TAG, "Controller %d forwarded: %" PRIu32 ", p50: %" PRIu32 " us, p99: %" PRIu32 " us, max: %" PRIu32 " us, stale: %lu", i,
+            forward_latency[i].Count(), forward_latency[i].Percentile(500), forward_latency[i].Percentile(990),
+            forward_latency[i].MaxValue(), tx_stale_count[i]);
+    }
+
+#ifdef MCP_BATCHED_SPI
+    // SPI
+    static unsigned long prev_mcp_frames = 0;
+    static int64_t prev_mcp_time = 0;
+    unsigned long mcp_frames = 0;
+    for_each_mcp([&](auto num){
+        auto &mcp = controller_device<num>();
+        ESP_LOGI(TAG, "%s SPI transactions: %lu, frames rx: %lu tx: %lu, transactions per frame x100: %lu", controller_tags[num],
+            mcp.SpiTransactionCount, mcp.RxFrameCountTotal, mcp.TxFrameCountTotal, mcp.TransactionsPerFrameX100());
+        mcp_frames += mcp.RxFrameCountTotal + mcp.TxFrameCountTotal;
+    });
+    int64_t mcp_time = esp_timer_get_time();
+    if (prev_mcp_time != 0 && mcp_time > prev_mcp_time) {
+        ESP_LOGI(TAG, "MCP frames/s: %llu", ((unsigned long long)(mcp_frames - prev_mcp_frames) * 1000000) / (mcp_time - prev_mcp_time));
+    }
+    prev_mcp_frames = mcp_frames;
+    prev_mcp_time = mcp_time;
+#endif
+
+    // Bus Load
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        uint32_t bits_per_s, frames_per_s;
+        bus_load_read(i, now, bits_per_s, frames_per_s);
+        ESP_LOGI(TAG, "Controller %d load: %" PRIu32 " bit/s, %" PRIu32 " frames/s, %" PRIu32 "%% utilization", i,
+            bits_per_s, frames_per_s, tBusLoadEstimator::Utilization(bits_per_s));
+        ESP_LOGI(TAG, "Controller %d msgs shed: %lu, sampled out: %lu", i, load_shedder[i].ShedCount, load_shedder[i].SampledOutCount);
+    }
+
+    print_boot_timeline(TAG);
+
+    // Heap
+    int heap_blocks = heap_allocated_blocks();
+    if (heap_init_allocated_blocks >= 0 && heap_blocks > heap_init_allocated_blocks){
+        ESP_LOGW(TAG, "Heap blocks allocated since init: %d", heap_blocks - heap_init_allocated_blocks);
+    }
+    else{
+        ESP_LOGI(TAG, "Heap blocks allocated: %d, free heap: %u bytes", heap_blocks, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    }
+
+    //Duration of the app_instance_main for the wasm pthread
+    ESP_LOGI(TAG, "Duration of wasm task (ms): %f",wasm_main_duration/1000000);
+    ESP_LOGI(TAG, "WASM msgs processed: %d, p50: %" PRIu32 " us, p99: %" PRIu32 " us, max: %" PRIu32 " us", wasm_msg_count,
+        wasm_latency.Percentile(500), wasm_latency.Percentile(990), wasm_latency.MaxValue());
+#ifdef WASM_BUDGET
+    ESP_LOGI(TAG, "WASM budget overruns: %lu, last on PGN %" PRIu32 ", forwarded copies not queued: %lu, late returns: %lu",
+        wasm_overrun_count, wasm_overrun_pgn, wasm_overrun_forward_dropped_count, wasm_late_count);
+#endif
+#ifdef WASM_HOT_SWAP
+    ESP_LOGI(TAG, "WASM apps swapped in: %lu, failed loads: %lu, last load: %" PRIu32 " ms, last swap-over: %" PRIu32 " us",
+        wasm_swap_count, wasm_load_failed_count, wasm_load_ms, wasm_swap_us);
+#endif
+}
+
+#ifdef TELEMETRY
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Telemetry
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief Fills in the CPU share of each task since the previous call
+ * 
+ * Unlike print_real_time_stats this does not wait, the interval between frames is the measurement period. The first
+ * frame after boot reports 0 for every task.
+ * 
+ * @param[out] frame
+*/
+static void telemetry_task_cpu(telemetry_frame<NUM_CONTROLLERS> &frame)
+{
+    // Static so filling a frame does not allocate after init
+    static TaskStatus_t prev_array[STATS_MAX_TASKS], array[STATS_MAX_TASKS];
+    static UBaseType_t prev_array_size = 0;
+    static uint32_t prev_run_time = 0;
+    uint32_t run_time;
+
+    UBaseType_t array_size = uxTaskGetSystemState(array, STATS_MAX_TASKS, &run_time);
+    uint32_t total_elapsed_time = (run_time - prev_run_time) * portNUM_PROCESSORS;
+    frame.task_count = 0;
+    for (UBaseType_t i = 0; i < array_size && frame.task_count < TELEMETRY_MAX_TASKS; i++) {
+        telemetry_task &task = frame.tasks[frame.task_count++];
+        strncpy(task.name, array[i].pcTaskName, TELEMETRY_TASK_NAME);
+        task.cpu_permille = 0;
+        task.reserved = 0;
+        task.stack_free_bytes = array[i].usStackHighWaterMark; // ESP-IDF stacks are counted in bytes
+        for (UBaseType_t j = 0; j < prev_array_size; j++) {
+            if (prev_array[j].xHandle == array[i].xHandle) {
+                uint32_t task_elapsed_time = array[i].ulRunTimeCounter - prev_array[j].ulRunTimeCounter;
+                if (total_elapsed_time > 0) {
+                    task.cpu_permille = static_cast<uint16_t>(((uint64_t)task_elapsed_time * 1000) / total_elapsed_time);
+                }
+                break;
+            }
+        }
+    }
+    memcpy(prev_array, array, array_size * sizeof(TaskStatus_t));
+    prev_array_size = array_size;
+    prev_run_time = run_time;
+}
+
+/**
+ * @brief Collects what GetStatus prints into a frame, without the header
+ * @param[out] frame
+*/
+static void telemetry_fill(telemetry_frame<NUM_CONTROLLERS> &frame)
+{
+    memset(&frame, 0, sizeof(frame));
+    int64_t now = esp_timer_get_time();
+    frame.uptime_us = now;
+
+    frame.rx_msgs = read_msg_count;
+    frame.tx_msgs = send_msg_count;
+    frame.wasm_msgs = wasm_msg_count;
+    frame.rx_queue_depth = uxQueueMessagesWaiting(rx_queue);
+    frame.rx_drop_newest = rx_drop_newest_count.load();
+    frame.rx_drop_oldest = rx_drop_oldest_count.load();
+    frame.rx_conflated = rx_conflated_count.load();
+    frame.rate_limited = tx_rate_limiter.LimitedCount;
+    frame.echo_recorded = echo_filter.RecordedCount;
+    frame.echo_evicted = echo_filter.EvictedCount;
+    frame.wasm_p50_us = wasm_latency.Percentile(500);
+    frame.wasm_p99_us = wasm_latency.Percentile(990);
+    frame.wasm_max_us = wasm_latency.MaxValue();
+    frame.heap_free_bytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    frame.heap_blocks = heap_allocated_blocks();
+
+    twai_status_info_t status;
+    C0.GetTwaiStatus(status);
+    frame.twai_state = status.state;
+    frame.twai_msgs_to_tx = status.msgs_to_tx;
+    frame.twai_msgs_to_rx = status.msgs_to_rx;
+    frame.twai_rx_overrun = status.rx_overrun_count;
+    frame.twai_rx_missed = status.rx_missed_count;
+    frame.twai_tx_failed = status.tx_failed_count;
+    frame.twai_bus_errors = status.bus_error_count;
+
+    for (int i = 0; i < NUM_CONTROLLERS; i++) {
+        telemetry_controller &controller = frame.controllers[i];
+        controller.sent = tx_sent_count[i];
+        controller.send_failed = tx_fail_count[i];
+        controller.retried_ok = tx_retry[i].RetriedOkCount;
+        controller.retry_expired = tx_retry[i].ExpiredCount;
+        controller.retry_dropped = tx_retry[i].DroppedCount;
+        controller.stale = tx_stale_count[i];
+        controller.echo_suppressed = echo_suppressed_count[i];
+        controller.shed = load_shedder[i].ShedCount;
+        controller.sampled_out = load_shedder[i].SampledOutCount;
+        controller.tx_queue_depth = uxQueueMessagesWaiting(tx_queues[i]);
+        uint32_t bits_per_s, frames_per_s;
+        bus_load_read(i, now, bits_per_s, frames_per_s);
+        controller.bits_per_s = bits_per_s;
+        controller.frames_per_s = frames_per_s;
+        controller.utilization_percent = tBusLoadEstimator::Utilization(bits_per_s);
+        controller.forwarded = forward_latency[i].Count();
+        controller.forward_p50_us = forward_latency[i].Percentile(500);
+        controller.forward_p99_us = forward_latency[i].Percentile(990);
+    }
+
+    telemetry_task_cpu(frame);
+}
+
+/**
+ * @brief Hands a sealed frame to TELEMETRY_SINK
+ * @param[in] frame
+*/
+static void telemetry_send(const telemetry_frame<NUM_CONTROLLERS> &frame)
+{
+#if TELEMETRY_SINK == TELEMETRY_SINK_RING
+    // Keep the newest frames, a reader that fell behind loses the oldest
+    while (xRingbufferSend(telemetry_ring, &frame, sizeof(frame), 0) != pdTRUE) {
+        size_t size;
+        void *oldest = xRingbufferReceive(telemetry_ring, &size, 0);
+        if (oldest == NULL) {
+            return;
+        }
+        vRingbufferReturnItem(telemetry_ring, oldest);
+    }
+#else
+    // One fwrite holds the stdout lock, so log lines of other tasks cannot end up inside the frame
+    fwrite(&frame, 1, sizeof(frame), stdout);
+    fflush(stdout);
+#endif
+}
+#endif
+
+/**
+ * @brief Optional FreeRTOS task for printing status messages for debugging, or sending telemetry frames if TELEMETRY is defined
+ * 
+ * @param pvParameters
+ * 
+*/
+static void stats_task(void *arg)
+{
+#ifdef TELEMETRY
+    static telemetry_frame<NUM_CONTROLLERS> frame; // too large for the task stack
+    uint32_t seq = 0;
+    while (1) {
+        telemetry_fill(frame);
+        telemetry_seal(frame, seq++);
+        telemetry_send(frame);
+        stats_task_count++;
+        vTaskDelay(pdMS_TO_TICKS(TELEMETRY_INTERVAL_MS));
+    }
+#else
+    //Print real time stats periodically
+    while (1) {
+        printf("\n\nGetting real time stats over %" PRIu32 " ticks\n", STATS_TICKS);
+        if (print_real_time_stats(STATS_TICKS) == ESP_OK) {
             printf("Real time stats obtained\n");
         } else {
             printf("Error getting real time stats\n");
@@ -595,269 +1540,1866 @@ static void stats_task(void *arg)
         stats_task_count++;
         vTaskDelay(pdMS_TO_TICKS(1000));
     }
+#endif
+}
+
+#ifdef DEFERRED_LOG
+/**
+ * @brief FreeRTOS task that formats and writes the messages recorded by the DLOG* macros
+ * 
+ * Messages of one core come out in order, messages of different cores can be interleaved out of order, the 
+ * timestamp is the time they were recorded. Lost messages are reported in one warning per round.
+ * 
+ * @param pvParameters
+*/
+void log_task(void *pvParameters)
+{
+    static const char level_letters[] = "NEWIDV";
+    deferred_log_entry entry;
+    char text[DEFERRED_LOG_TEXT_SIZE];
+    uint32_t reported_overflow = 0;
+    while (1) {
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            while (deferred_log_rings[core].Take(entry)) {
+                snprintf(text, sizeof(text), entry.format, entry.args[0], entry.args[1], entry.args[2], entry.args[3]);
+                esp_log_level_t level = static_cast<esp_log_level_t>(entry.level);
+                esp_log_write(level, entry.tag, "%c (%" PRIu32 ") %s: %s\n", level_letters[entry.level], entry.timestamp_ms,
+                    entry.tag, text);
+            }
+        }
+        uint32_t overflow = deferred_log_overflow();
+        if (overflow != reported_overflow) {
+            ESP_LOGW(TAG_STATUS, "%" PRIu32 " deferred log messages lost", overflow - reported_overflow);
+            reported_overflow = overflow;
+        }
+        vTaskDelay(DEFERRED_LOG_IDLE_TICKS); // also lets the idle task run at priority 0
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+#endif
+
+#if defined(RUN_BENCHMARKS) || defined(LOAD_TEST)
+/// @brief The batched MCP driver with its frame functions exposed, on a simulated SPI bus
+class tBenchMcp : public tNMEA2000_mcp_batched
+{
+public:
+    tBenchMcp() : tNMEA2000_mcp_batched(&bench_mcp_spi, 0, MCP_8MHZ, MCP_NO_INT, 50) {}
+    using tNMEA2000_mcp_batched::CANGetFrame;
+    using tNMEA2000_mcp_batched::CANSendFrame;
+
+private:
+    static spi_device_handle_t bench_mcp_spi; // never used, every transaction goes to the model
+};
+spi_device_handle_t tBenchMcp::bench_mcp_spi = NULL;
+#endif
+
+#ifdef RUN_BENCHMARKS
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Benchmarks
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+static NMEA_msg bench_msgs[BENCH_BATCH_SIZE];
+static tN2kMsg bench_n2k_msgs[BENCH_BATCH_SIZE];
+static unsigned char bench_char_data[MAX_DATA_LENGTH_BTYES];
+static char bench_chars[MSG_STRING_SIZE];
+static volatile size_t bench_sink = 0; // keeps results of benchmarked calls alive
+
+/**
+ * @brief Empties a queue without timing it
+*/
+static void bench_drain_queue(QueueHandle_t queue)
+{
+    NMEA_msg msg;
+    if (queue == rx_queue) {
+        while (rx_queue_receive(msg, 0)) {} // also ends pending streams
+        return;
+    }
+    while (xQueueReceive(queue, &msg, 0) == pdTRUE) {}
+}
+
+/**
+ * @brief Measures the MCP receive path for 1 to BENCH_MCP_MAX controllers on one SPI host
+ * 
+ * Every controller is a tMcp2515Sim. Each round, the busy controllers receive two frames and the controllers are 
+ * serviced like mcp_bus_task does: controllers on a low INT pin first, with a status read per controller if the 
+ * pin is shared by all of them, then every controller is read until it has no frame. The result per frame is the 
+ * CPU time plus the time the transactions would hold a MCP_SIM_SPI_HZ bus, so the cost of each additional bus shows 
+ * up in both. Stages are mcp_rx_<controllers>_<dedicated|shared>, with _1busy when only one controller has traffic.
+*/
+static void bench_mcp_receive()
+{
+    static tMcp2515Sim sims[BENCH_MCP_MAX];
+    static tBenchMcp mcps[BENCH_MCP_MAX];
+    for (int i = 0; i < BENCH_MCP_MAX; i++) {
+        mcps[i].AttachSim(&sims[i]);
+    }
+    bench_fill_mix(bench_msgs, BENCH_BATCH_SIZE, BENCH_MIX_SINGLE_FRAME, controller_first_mcp(), 1);
+
+    for (int busy_all = 1; busy_all >= 0; busy_all--) {
+        for (int shared = 0; shared < 2; shared++) {
+            for (int n = 1; n <= BENCH_MCP_MAX; n++) {
+                uint64_t cycles = 0;
+                uint32_t frames = 0;
+                int next_msg = 0;
+                for (int i = 0; i < n; i++) {
+                    sims[i].ResetCounters();
+                }
+
+                for (int round = 0; round < BENCH_ROUNDS * BENCH_BATCH_SIZE / 2; round++) {
+                    for (int i = 0; i < (busy_all ? n : 1); i++) {
+                        for (int f = 0; f < 2; f++) {
+                            const NMEA_msg &msg = bench_msgs[next_msg++ % BENCH_BATCH_SIZE];
+                            unsigned long id = (static_cast<unsigned long>(msg.priority) << 26) | (msg.PGN << 8) | msg.source;
+                            sims[i].Receive(id, 8, msg.data);
+                        }
+                    }
+
+                    unsigned long id;
+                    unsigned char len;
+                    unsigned char buf[8];
+                    bool interrupted[BENCH_MCP_MAX];
+                    uint32_t start = esp_cpu_get_cycle_count();
+                    bool line_low = false; // the shared INT pin
+                    for (int i = 0; i < n && shared; i++) {
+                        line_low = line_low || sims[i].IntAsserted();
+                    }
+                    for (int i = 0; i < n; i++) {
+                        interrupted[i] = shared ? (line_low && mcps[i].RxPending()) : sims[i].IntAsserted();
+                        while (interrupted[i] && mcps[i].CANGetFrame(id, len, buf)) {
+                            frames++;
+                        }
+                    }
+                    for (int i = 0; i < n; i++) {
+                        while (!interrupted[i] && mcps[i].CANGetFrame(id, len, buf)) {
+                            frames++;
+                        }
+                    }
+                    cycles += esp_cpu_get_cycle_count() - start;
+                }
+
+                uint64_t bus_ns = 0;
+                for (int i = 0; i < n; i++) {
+                    bus_ns += sims[i].BusTimeNs();
+                }
+                char stage[32];
+                snprintf(stage, sizeof(stage), "mcp_rx_%d_%s%s", n, shared ? "shared" : "dedicated", busy_all ? "" : "_1busy");
+                bench_report(stage, BENCH_MIX_SINGLE_FRAME, frames, cycles + (bus_ns * BENCH_CPU_FREQ_MHZ) / 1000, BENCH_CPU_FREQ_MHZ);
+            }
+        }
+    }
+}
+
+/**
+ * @brief FreeRTOS task that measures the cost per message of every conversion and queue hop
+ * 
+ * Each stage is run BENCH_ROUNDS times over a batch of BENCH_BATCH_SIZE messages for every message mix. Only the calls 
+ * under test are inside the cycle counter window, queues are drained between batches. Results are printed as 
+ * BENCH lines, see benchmark.h.
+ * 
+ * Controller 0 is opened so SendN2kMsg goes through the TWAI driver, it should be connected to a bus.
+ * 
+ * @param pvParameters
+*/
+void benchmark_task(void *pvParameters)
+{
+    controller_setup<C0_NUM>();
+    C0.Open();
+    // Matched by every SendMsg call but never limiting, so the SendMsg stage includes the rule lookup
+    rate_limit_rule bench_rate = {C0_NUM, RATE_LIMIT_ANY, RATE_LIMIT_ANY, 1000000, 1000000};
+    tx_rate_limiter.SetRule(bench_rate, esp_timer_get_time());
+
+    printf("BENCH,stage,mix,messages,cycles_per_msg,ns_per_msg\n");
+    for (int m = 0; m < BENCH_MIX_COUNT; m++) {
+        BENCH_MIX mix = static_cast<BENCH_MIX>(m);
+        uint64_t cycles_convert = 0, cycles_to_string = 0, cycles_to_chars = 0, cycles_handler = 0, cycles_send_msg = 0;
+        uint64_t cycles_send_n2k = 0, cycles_queue_send = 0, cycles_queue_receive = 0;
+        uint32_t start;
+
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            bench_fill_mix(bench_msgs, BENCH_BATCH_SIZE, mix, C0_NUM, round + 1);
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                nmea_to_n2k(bench_msgs[i], bench_n2k_msgs[i]);
+            }
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                uint8ArrayToCharrArray(bench_msgs[i].data, bench_char_data);
+            }
+            cycles_convert += esp_cpu_get_cycle_count() - start;
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                bench_sink += nmea_to_string(bench_msgs[i]).size();
+            }
+            cycles_to_string += esp_cpu_get_cycle_count() - start;
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                bench_sink += nmea_to_chars(bench_msgs[i], bench_chars, sizeof(bench_chars));
+            }
+            cycles_to_chars += esp_cpu_get_cycle_count() - start;
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                HandleNMEA2000Msg(bench_n2k_msgs[i], C0_NUM);
+            }
+            cycles_handler += esp_cpu_get_cycle_count() - start;
+            bench_drain_queue(rx_queue);
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                NMEA_msg &msg = bench_msgs[i];
+                bench_sink += SendMsg(NULL, C0_NUM, msg.priority, msg.PGN, msg.source, msg.data, msg.data_length_bytes);
+            }
+            cycles_send_msg += esp_cpu_get_cycle_count() - start;
+            bench_drain_queue(tx_queues[C0_NUM]);
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                SendN2kMsg(bench_msgs[i], C0_NUM);
+            }
+            cycles_send_n2k += esp_cpu_get_cycle_count() - start;
+            vTaskDelay(pdMS_TO_TICKS(100)); // let the TWAI driver empty its tx queue
+
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                xQueueSendToBack(rx_queue, &bench_msgs[i], 0);
+            }
+            cycles_queue_send += esp_cpu_get_cycle_count() - start;
+
+            NMEA_msg msg;
+            start = esp_cpu_get_cycle_count();
+            for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+                xQueueReceive(rx_queue, &msg, 0);
+            }
+            cycles_queue_receive += esp_cpu_get_cycle_count() - start;
+        }
+
+        const uint32_t n = BENCH_BATCH_SIZE * BENCH_ROUNDS;
+        bench_report("uint8ArrayToCharrArray", mix, n, cycles_convert, BENCH_CPU_FREQ_MHZ);
+        bench_report("nmea_to_string", mix, n, cycles_to_string, BENCH_CPU_FREQ_MHZ);
+        bench_report("nmea_to_chars", mix, n, cycles_to_chars, BENCH_CPU_FREQ_MHZ);
+        bench_report("HandleNMEA2000Msg", mix, n, cycles_handler, BENCH_CPU_FREQ_MHZ);
+        bench_report("SendMsg", mix, n, cycles_send_msg, BENCH_CPU_FREQ_MHZ);
+        bench_report("SendN2kMsg", mix, n, cycles_send_n2k, BENCH_CPU_FREQ_MHZ);
+        bench_report("xQueueSendToBack", mix, n, cycles_queue_send, BENCH_CPU_FREQ_MHZ);
+        bench_report("xQueueReceive", mix, n, cycles_queue_receive, BENCH_CPU_FREQ_MHZ);
+    }
+    bench_mcp_receive();
+    printf("BENCH,done\n");
+    vTaskDelete(NULL);
+}
+#endif
+
+#ifdef LOAD_TEST
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Load Test
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/// @brief Where the load test injects messages, targets below LOAD_TARGET_RX are the send queue of that controller
+enum LOAD_TARGET {
+    LOAD_TARGET_C0 = 0,     //!< Controller 0 send queue
+    LOAD_TARGET_RX = NUM_CONTROLLERS, //!< Receive handler, as if received on controller 0, delivered to the WASM app
+    LOAD_TARGET_COUNT
+};
+
+/// @brief Queue a target injects into
+static QueueHandle_t load_target_queue(LOAD_TARGET target)
+{
+    return (target == LOAD_TARGET_RX) ? rx_queue : tx_queues[target];
+}
+
+/**
+ * @brief Messages that came out at the far end of a target so far
+*/
+static uint32_t load_test_delivered(LOAD_TARGET target)
+{
+    if (target == LOAD_TARGET_RX) {
+        return wasm_msg_count;
+    }
+    return tx_sent_count[target];
+}
+
+/**
+ * @brief Messages lost on the way through a target so far, not counting rejects when injecting
+*/
+static uint32_t load_test_dropped(LOAD_TARGET target)
+{
+    if (target == LOAD_TARGET_RX) {
+        return rx_drop_newest_count + rx_drop_oldest_count + load_shedder[C0_NUM].ShedCount + load_shedder[C0_NUM].SampledOutCount;
+    }
+    const tTxRetryQueue &retry = tx_retry[target];
+    return retry.ExpiredCount + retry.DroppedCount + tx_stale_count[target];
+}
+
+/**
+ * @brief Injects one message into a target
+ * @return false if the target could not take it
+*/
+static bool load_test_inject(LOAD_TARGET target, const NMEA_msg &msg)
+{
+    if (target == LOAD_TARGET_RX) {
+        static tN2kMsg N2kMsg;
+        nmea_to_n2k(msg, N2kMsg);
+        HandleNMEA2000Msg(N2kMsg, C0_NUM); // overflow is counted by the handler, see load_test_dropped
+        return true;
+    }
+    QueueHandle_t queue = load_target_queue(target);
+    if (xQueueSendToBack(queue, &msg, 0) != pdTRUE) {
+        return false;
+    }
+    queue_peak_update(queue);
+    if (controller_backends[target] == BACKEND_MCP) {
+        NotifyMcpBus();
+    }
+    return true;
+}
+
+/// @brief A message on its way through the simulated MCP controller
+struct load_sim_msg {
+    unsigned long id;
+    uint8_t len;        //!< Data bytes of each frame
+    uint8_t frames;     //!< Frames still to send, or to read
+    bool intact;        //!< No frame of the message was lost
+};
+
+/**
+ * @brief Ramps LOAD_TEST_MIX traffic through tNMEA2000_mcp_batched on a tMcp2515Sim, the MCP ceiling without hardware
+ * 
+ * Time is simulated. Every LOAD_TEST_SIM_TICK_US the due messages arrive: as frames on the CAN side of the model for 
+ * mcp_sim_rx, in a send queue of TX_QUEUE_SIZE messages for mcp_sim_tx. The driver then works for one tick, every 
+ * CANGetFrame or CANSendFrame costs the CPU time it took plus the time its transactions hold a MCP_SIM_SPI_HZ bus, 
+ * and work past the end of the tick is carried into the next one. Frames refused by the full FIFO of the model and 
+ * messages refused by the full send queue are dropped, as is what is left after LOAD_TEST_DRAIN_MS. 
+ * 
+ * Messages are split into frames like on the bus, the payload is not framed as it does not change the transactions. 
+ * There is no CAN bus, so the result is the ceiling of the driver and the SPI bus, and the ramp goes up to 
+ * LOAD_TEST_SIM_MAX_RATE. Other tasks that preempt the load test task are counted as driver time.
+ * 
+ * @param transmit true for mcp_sim_tx, false for mcp_sim_rx
+*/
+static void load_test_mcp_sim(bool transmit)
+{
+    static tMcp2515Sim sim;
+    static tBenchMcp mcp;
+    static NMEA_msg msg;
+    static load_sim_msg pending[TX_QUEUE_SIZE];
+    static_assert(MCP_SIM_RX_FIFO + MCP_RX_BUFFERS <= TX_QUEUE_SIZE, "pending holds every message in the model");
+    const size_t capacity = transmit ? TX_QUEUE_SIZE : MCP_SIM_RX_FIFO + MCP_RX_BUFFERS;
+    const char *target_name = transmit ? "mcp_sim_tx" : "mcp_sim_rx";
+    const int64_t tick_ns = LOAD_TEST_SIM_TICK_US * 1000LL;
+    mcp.AttachSim(&sim);
+
+    tTrafficGenerator generator(LOAD_TEST_MIX, static_cast<uint8_t>(std::max(controller_first_mcp(), 0)), 
+        LOAD_TARGET_COUNT + (transmit ? 2 : 1));
+    tLoadRamp ramp(LOAD_TEST_START_RATE, LOAD_TEST_STEP_RATE, LOAD_TEST_SIM_MAX_RATE, LOAD_TEST_DROP_PER_MILLE);
+    int64_t now = 0;
+    while (!ramp.Done()) {
+        uint32_t offered = 0;
+        uint32_t delivered = 0;
+        uint32_t dropped = 0;
+        size_t head = 0;
+        size_t count = 0;
+        int64_t carried_ns = 0;
+        const int64_t start = now;
+        generator.SetRate(ramp.CurrentRate(), start);
+
+        for (uint32_t tick = 1; now - start < (LOAD_TEST_STEP_MS + LOAD_TEST_DRAIN_MS) * 1000LL; tick++) {
+            now += LOAD_TEST_SIM_TICK_US;
+            bool arriving = now - start <= LOAD_TEST_STEP_MS * 1000LL;
+            if (!arriving && count == 0) {
+                break;
+            }
+            size_t due = arriving ? generator.Due(now) : 0;
+            for (size_t i = 0; i < due; i++) {
+                generator.Next(msg);
+                offered++;
+                load_sim_msg arrival;
+                arrival.id = (static_cast<unsigned long>(msg.priority) << 26) | (msg.PGN << 8) | msg.source;
+                arrival.len = static_cast<uint8_t>(std::min(msg.data_length_bytes, 8));
+                arrival.frames = static_cast<uint8_t>(tBusLoadEstimator::FramesForMessage(msg.data_length_bytes));
+                arrival.intact = true;
+                if (!transmit) {
+                    uint8_t accepted = 0;
+                    for (uint8_t f = 0; f < arrival.frames; f++) {
+                        if (sim.Receive(arrival.id, arrival.len, msg.data)) {
+                            accepted++;
+                        } else {
+                            arrival.intact = false;
+                        }
+                    }
+                    arrival.frames = accepted;
+                }
+                if (arrival.frames == 0 || count == capacity) {
+                    dropped++;
+                    continue;
+                }
+                pending[(head + count++) % capacity] = arrival;
+            }
+
+            // The driver works until the tick is used up
+            int64_t spent_ns = carried_ns;
+            const uint64_t bus_start_ns = sim.BusTimeNs();
+            const uint32_t cycles_start = esp_cpu_get_cycle_count();
+            while (count > 0 && spent_ns < tick_ns) {
+                load_sim_msg &current = pending[head];
+                bool done;
+                if (transmit) {
+                    done = mcp.CANSendFrame(current.id, current.len, msg.data);
+                } else {
+                    unsigned long id;
+                    unsigned char len;
+                    unsigned char buf[8];
+                    done = mcp.CANGetFrame(id, len, buf);
+                }
+                if (done && --current.frames == 0) {
+                    if (current.intact) {
+                        delivered++;
+                    } else {
+                        dropped++;
+                    }
+                    head = (head + 1) % capacity;
+                    count--;
+                }
+                spent_ns = carried_ns + (esp_cpu_get_cycle_count() - cycles_start) * 1000LL / BENCH_CPU_FREQ_MHZ 
+                    + static_cast<int64_t>(sim.BusTimeNs() - bus_start_ns);
+                if (!done) {
+                    break;
+                }
+            }
+            carried_ns = std::max(spent_ns - tick_ns, static_cast<int64_t>(0));
+
+            if (tick % LOAD_TEST_SIM_YIELD_TICKS == 0) {
+                vTaskDelay(1);
+            }
+        }
+
+        // Whatever is left did not make it through the drain
+        dropped += count;
+        unsigned long id;
+        unsigned char len;
+        unsigned char buf[8];
+        while (!transmit && mcp.CANGetFrame(id, len, buf)) {}
+        sim.ResetCounters();
+
+        const int64_t elapsed = LOAD_TEST_STEP_MS * 1000LL;
+        load_test_report(target_name, LOAD_TEST_MIX, ramp.CurrentRate(),
+            static_cast<uint32_t>((offered * 1000000LL) / elapsed), static_cast<uint32_t>((delivered * 1000000LL) / elapsed), dropped);
+        ramp.StepDone(offered, delivered, dropped, elapsed);
+    }
+    load_test_report_sustained(target_name, LOAD_TEST_MIX, ramp.SustainedRate());
+}
+
+/**
+ * @brief FreeRTOS task that finds the sustained throughput of every controller and of the receive path
+ * 
+ * For each target, LOAD_TEST_MIX traffic is injected at a rate that starts at LOAD_TEST_START_RATE and grows by 
+ * LOAD_TEST_STEP_RATE every LOAD_TEST_STEP_MS, until a step drops more than LOAD_TEST_DROP_PER_MILLE of its messages 
+ * or LOAD_TEST_MAX_RATE is reached. After each step the queue is given LOAD_TEST_DRAIN_MS to empty before the 
+ * counters are read. Results are printed as LOADTEST lines, see load_gen.h.
+ * 
+ * Controllers need a bus with at least one other node that acknowledges frames. The simulated MCP targets run last, 
+ * see load_test_mcp_sim.
+ * 
+ * @param pvParameters
+*/
+void load_test_task(void *pvParameters)
+{
+    boot_wait(BOOT_ALL_READY);
+    printf("LOADTEST,target,mix,rate,offered_per_s,delivered_per_s,dropped\n");
+    static NMEA_msg msg;
+    for (int t = 0; t < LOAD_TARGET_COUNT; t++) {
+        LOAD_TARGET target = static_cast<LOAD_TARGET>(t);
+        QueueHandle_t queue = load_target_queue(target);
+        char target_name[12];
+        if (target == LOAD_TARGET_RX) {
+            snprintf(target_name, sizeof(target_name), "rx");
+        } else {
+            snprintf(target_name, sizeof(target_name), "c%d_tx", t);
+        }
+        uint8_t controller_number = (target == LOAD_TARGET_RX) ? C0_NUM : static_cast<uint8_t>(target);
+        tTrafficGenerator generator(LOAD_TEST_MIX, controller_number, t + 1);
+        tLoadRamp ramp(LOAD_TEST_START_RATE, LOAD_TEST_STEP_RATE, LOAD_TEST_MAX_RATE, LOAD_TEST_DROP_PER_MILLE);
+
+        while (!ramp.Done()) {
+            uint32_t delivered_start = load_test_delivered(target);
+            uint32_t dropped_start = load_test_dropped(target);
+            uint32_t offered = 0;
+            uint32_t rejected = 0;
+            int64_t start = esp_timer_get_time();
+            generator.SetRate(ramp.CurrentRate(), start);
+
+            int64_t now = start;
+            while (now - start < LOAD_TEST_STEP_MS * 1000LL) {
+                size_t due = generator.Due(now);
+                for (size_t i = 0; i < due; i++) {
+                    generator.Next(msg);
+                    msg.timestamp_us = now;
+                    if (!load_test_inject(target, msg)) {
+                        rejected++;
+                    }
+                    offered++;
+                }
+                vTaskDelay(1);
+                now = esp_timer_get_time();
+            }
+            int64_t elapsed = now - start;
+
+            for (int waited = 0; uxQueueMessagesWaiting(queue) > 0 && waited < LOAD_TEST_DRAIN_MS; waited += 10) {
+                vTaskDelay(pdMS_TO_TICKS(10));
+            }
+            uint32_t delivered = load_test_delivered(target) - delivered_start;
+            uint32_t dropped = rejected + load_test_dropped(target) - dropped_start;
+            load_test_report(target_name, LOAD_TEST_MIX, ramp.CurrentRate(),
+                static_cast<uint32_t>((offered * 1000000LL) / elapsed), static_cast<uint32_t>((delivered * 1000000LL) / elapsed), dropped);
+            ramp.StepDone(offered, delivered, dropped, elapsed);
+        }
+        load_test_report_sustained(target_name, LOAD_TEST_MIX, ramp.SustainedRate());
+    }
+    load_test_mcp_sim(false);
+    load_test_mcp_sim(true);
+    printf("LOADTEST,done\n");
+    load_test_task_handle = NULL; // the memory budget report skips it from now on
+    vTaskDelete(NULL);
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Receive Timestamps
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief Records that a controller is about to be read
+ * 
+ * Called right before the frames of a controller are parsed, the messages completed by them get this time.
+ * 
+ * @param[in] controller_num
+*/
+static inline void rx_stamp(int controller_num)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&rx_frame_time_lock);
+    rx_frame_time_us[controller_num] = now;
+    portEXIT_CRITICAL(&rx_frame_time_lock);
+}
+
+/// @brief rx_stamp() for the MCP interrupt handler
+static inline void IRAM_ATTR rx_stamp_from_isr(int controller_num)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&rx_frame_time_lock);
+    rx_frame_time_us[controller_num] = now;
+    portEXIT_CRITICAL_ISR(&rx_frame_time_lock);
+}
+
+/**
+ * @brief Time a controller was last read
+ * 
+ * @param[in] controller_num
+ * @return esp_timer time in us, 0 if the controller was never stamped
+*/
+static int64_t rx_stamp_get(int controller_num)
+{
+    portENTER_CRITICAL(&rx_frame_time_lock);
+    int64_t time_us = rx_frame_time_us[controller_num];
+    portEXIT_CRITICAL(&rx_frame_time_lock);
+    return time_us;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Controllers
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief Sets up the NMEA2000 library object of controller NUM, before it is opened
+*/
+template<int NUM> static void controller_setup()
+{
+    auto &device = controller_device<NUM>();
+    esp_log_level_set(controller_tags[NUM], MY_ESP_LOG_LEVEL);
+    device.SetN2kCANMsgBufSize(8);
+    device.SetN2kCANReceiveFrameBufSize(250);
+    device.EnableForward(false);
+    device.SetMsgHandler(HandleControllerMsg<NUM>);
+    device.SetMode(tNMEA2000::N2km_ListenAndSend);
+}
+
+/**
+ * @brief Opens controller NUM and marks its boot stage
+ * 
+ * The first MCP controller initializes the SPI bus, the others wait for it before adding their device to the bus.
+*/
+template<int NUM> static void controller_open()
+{
+    auto &device = controller_device<NUM>();
+    if constexpr (controller_backend_v<NUM> == BACKEND_MCP) {
+        if constexpr (NUM == controller_first_mcp()) {
+            device.CANinit(); // Initialize SPI bus, call before Open() and only call once for all the MCP controllers
+            boot_mark(BOOT_SPI_READY);
+        } else {
+            boot_wait(BOOT_BIT(BOOT_SPI_READY));
+        }
+    }
+    device.Open();
+    if constexpr (controller_backend_v<NUM> == BACKEND_TWAI) {
+        device.ConfigureAlerts(alerts_to_enable);
+    }
+    boot_mark(BOOT_CONTROLLER_READY(NUM));
+}
+
+/**
+ * @brief FreeRTOS task for receiving messages from controller NUM
+ * 
+ * @param pvParameters
+ * 
+ * NMEA2000 Library is designed so that message receiving and sending is handled within the same task. 
+ * In the NMEA2000_ESP32 library, this is made possible by letting the twai rx interrupt handle receiving CAN frames. 
+ * In this library, the receiving is separated from the processing and sending of messages. This is done because 
+ * I was unable to trigger recieving a CAN frame from the twai rx interrupt, so CAN_read_frame() must be called explicitly 
+ * for the TWAI controller. The task blocks on the TWAI alerts (TWAI_ALERT_RX_DATA) and reads every frame in the driver 
+ * rx queue per wakeup, so it uses no CPU on an idle bus. This task is the only reader of the TWAI alerts. A MCP 
+ * controller is polled, its lock keeps the send task off the device meanwhile.
+*/
+template<int NUM> void controller_receive_task(void *pvParameters)
+{
+    controller_setup<NUM>();
+    controller_open<NUM>();
+    auto &device = controller_device<NUM>();
+
+    // Task Loop
+    while(1)
+    {
+        if constexpr (controller_backend_v<NUM> == BACKEND_TWAI) {
+#ifdef TWAI_RX_POLLING
+            device.CAN_read_frame(); // retrieves available messages - for TWAI controller only
+            rx_stamp(NUM);
+            device.ParseMessages(); // Calls message handle whenever a message is available
+#else
+            uint32_t alerts = 0;
+            device.ReadAlerts(alerts, pdMS_TO_TICKS(TWAI_RX_IDLE_MS)); // returns early on TWAI_ALERT_RX_DATA
+            if (alerts & TWAI_ALERT_RX_QUEUE_FULL){
+                DLOGW(controller_tags[NUM], "TWAI rx queue full");
+            }
+            // An alert raised while draining wakes the next wait at once, no frame is left behind
+            twai_status_info_t status;
+            bool read = false;
+            for (device.GetTwaiStatus(status); status.msgs_to_rx > 0; device.GetTwaiStatus(status)){
+                device.CAN_read_frame(); // retrieves available messages - for TWAI controller only
+                rx_stamp(NUM);
+                device.ParseMessages(); // Calls message handle whenever a message is available
+                twai_rx_read_count++;
+                read = true;
+            }
+            if (!read){
+                device.ParseMessages(); // keeps the library's own timers running on an idle bus
+            }
+#endif
+        } else {
+            if( xSemaphoreTake( controller_locks[NUM], (100 / portTICK_PERIOD_MS) ) == pdTRUE )
+            {
+                rx_stamp(NUM);
+                device.ParseMessages(); // Calls message handle whenever a message is available
+                xSemaphoreGive( controller_locks[NUM] );
+                vTaskDelay(10 / portTICK_PERIOD_MS);
+            }
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+        rx_task_count[NUM]++;
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+
+/**
+ * @brief FreeRTOS task for processing and sending messages on controller NUM with NMEA2000 library
+ * 
+ * Tries to receive a message from the controller's tx queue, and sends it if available. 
+ * Messages that fail to send are retried from the controller's retry queue after new messages have been sent.
+ * On a MCP controller the lock is held while sending so send and receive tasks don't access the device at the same time.
+ * 
+ * @todo frame buffer should be 32 - see if this works
+ * @param pvParameters
+*/
+template<int NUM> void controller_send_task(void *pvParameters)
+{
+    esp_log_level_set(controller_tags[NUM], MY_ESP_LOG_LEVEL);
+    ESP_LOGI(controller_tags[NUM], "Starting send task of controller %d", NUM);
+    NMEA_msg msg;
+    boot_wait(BOOT_BIT(BOOT_CONTROLLER_READY(NUM)));
+
+    // Task Loop
+    for (;;)
+    {
+        bool received = xQueueReceive( tx_queues[NUM], &msg, TxWaitTicks(NUM) );
+        if constexpr (controller_backend_v<NUM> == BACKEND_TWAI) {
+            if (received) {
+                SendOrRetry(msg, NUM);
+            }
+            ServiceTxRetries(NUM);
+        } else if( received || tx_retry[NUM].Count() > 0 ) {
+            if( xSemaphoreTake( controller_locks[NUM], portMAX_DELAY ) == pdTRUE )
+            {
+                if (received) {
+                    DLOGD(controller_tags[NUM], "About to send message with PGN: %i", msg.PGN);
+                    SendOrRetry(msg, NUM);
+                }
+                ServiceTxRetries(NUM);
+                xSemaphoreGive( controller_locks[NUM] );
+            }
+        }
+        DLOGV(controller_tags[NUM], "Send task called");
+
+        tx_task_count[NUM]++;
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// MCP Bus Owner
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief Wakes the MCP bus owner task, called after a message is added to a MCP send queue
+*/
+static void NotifyMcpBus()
+{
+#ifdef MCP_BUS_OWNER_TASK
+    if (mcp_bus_task_handle != NULL) {
+        xTaskNotifyGive(mcp_bus_task_handle);
+    }
+#endif
+}
+
+#ifdef MCP_BUS_OWNER_TASK
+#ifdef MCP_BATCHED_SPI
+/**
+ * @brief Interrupt handler for the MCP INT pins, stamps the receive time of the controllers on the pin and wakes the 
+ * bus owner task
+ * 
+ * @param arg number of a controller on the pin
+*/
+static void IRAM_ATTR mcp_int_isr_handler(void* arg)
+{
+    int pin = controller_int_pins[reinterpret_cast<intptr_t>(arg)];
+    for (int i = 0; i < NUM_CONTROLLERS; i++) {
+        if (controller_int_pins[i] == pin) {
+            rx_stamp_from_isr(i); // a controller without a frame is stamped again before it is parsed
+        }
+    }
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(mcp_bus_task_handle, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+#endif
+
+/**
+ * @brief Sends up to MCP_BUS_TX_BURST queued messages and one due retry on a MCP controller
+ * 
+ * @param[in] controller_num
+ * @return true if anything was sent
+*/
+static bool McpBusServiceTx(int controller_num)
+{
+    NMEA_msg msg;
+    bool busy = false;
+    for (int i = 0; i < MCP_BUS_TX_BURST && xQueueReceive(tx_queues[controller_num], &msg, 0) == pdTRUE; i++) {
+        SendOrRetry(msg, controller_num);
+        busy = true;
+    }
+    ServiceTxRetries(controller_num);
+    return busy;
+}
+
+/**
+ * @brief FreeRTOS task that owns the SPI bus and services every MCP controller
+ * 
+ * Replaces the send and receive tasks of the MCP controllers and their locks. Each round, controllers with their 
+ * INT pin asserted are parsed first, then the others are parsed for library housekeeping, then up to 
+ * MCP_BUS_TX_BURST messages are sent per controller. The controller served first rotates every round so none 
+ * can starve the others. When a round finds no work the task sleeps until an INT pin interrupt (MCP_BATCHED_SPI only), 
+ * a new message in a MCP send queue, or MCP_BUS_IDLE_TICKS.
+ * 
+ * A low INT pin shared by several controllers only says that one of them has a frame. With MCP_BATCHED_SPI the 
+ * status of each controller on it is read to find out which, otherwise all of them count as interrupted.
+ * 
+ * @param pvParameters
+*/
+void mcp_bus_task(void *pvParameters)
+{
+    int mcp_nums[NUM_CONTROLLERS]; // controller numbers of the MCP controllers
+    int mcp_count = 0;
+    for_each_mcp([&](auto num){
+        controller_setup<num>();
+        mcp_nums[mcp_count++] = num;
+    });
+    for_each_mcp([](auto num){ controller_open<num>(); });
+
+#ifdef MCP_BATCHED_SPI
+    bool int_shared[NUM_CONTROLLERS] = {false}; // INT pin wire-ORed with another controller
+    for (int i = 0; i < mcp_count; i++) {
+        for (int j = 0; j < mcp_count; j++) {
+            int pin = controller_int_pins[mcp_nums[i]];
+            if (i != j && pin != MCP_NO_INT && pin == controller_int_pins[mcp_nums[j]]) {
+                int_shared[mcp_nums[i]] = true;
+            }
+        }
+    }
+
+    gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT); // may already be installed by get_mode_task
+    for (int i = 0; i < mcp_count; i++) {
+        int pin = controller_int_pins[mcp_nums[i]];
+        bool first_on_pin = pin != MCP_NO_INT;
+        for (int j = 0; j < i && first_on_pin; j++) {
+            first_on_pin = controller_int_pins[mcp_nums[j]] != pin;
+        }
+        if (first_on_pin) {
+            gpio_set_intr_type(static_cast<gpio_num_t>(pin), GPIO_INTR_NEGEDGE);
+            gpio_isr_handler_add(static_cast<gpio_num_t>(pin), mcp_int_isr_handler, reinterpret_cast<void*>(static_cast<intptr_t>(mcp_nums[i])));
+        }
+    }
+#endif
+
+    int first = 0; // index into mcp_nums of the controller that sends first this round
+    // Task Loop
+    for (;;)
+    {
+        bool interrupted[NUM_CONTROLLERS] = {false};
+        bool busy = false;
+
+        // Receive, interrupt flagged controllers first. With MCP_BATCHED_SPI those were stamped by the interrupt
+        for_each_mcp([&](auto num){
+            int pin = controller_int_pins[num];
+            interrupted[num] = pin != MCP_NO_INT && gpio_get_level(static_cast<gpio_num_t>(pin)) == 0;
+#ifdef MCP_BATCHED_SPI
+            if (interrupted[num] && int_shared[num]) {
+                interrupted[num] = controller_device<num>().RxPending(); // kept for ParseMessages, no second read
+            }
+#endif
+            if (interrupted[num]) {
+#ifndef MCP_BATCHED_SPI
+                rx_stamp(num);
+#endif
+                controller_device<num>().ParseMessages();
+                busy = true;
+            }
+        });
+        for_each_mcp([&](auto num){
+            if (!interrupted[num]) {
+                rx_stamp(num);
+                controller_device<num>().ParseMessages();
+            }
+        });
+
+        // Transmit, rotating which controller goes first
+        for (int i = 0; i < mcp_count; i++) {
+            busy |= McpBusServiceTx(mcp_nums[(first + i) % mcp_count]);
+        }
+        first = (first + 1) % mcp_count;
+
+        TickType_t wait = MCP_BUS_IDLE_TICKS;
+        for (int i = 0; i < mcp_count && !busy; i++) {
+            busy = uxQueueMessagesWaiting(tx_queues[mcp_nums[i]]) != 0;
+            if (TxWaitTicks(mcp_nums[i]) < wait) {
+                wait = TxWaitTicks(mcp_nums[i]);
+            }
+        }
+        if (!busy) {
+            ulTaskNotifyTake(pdTRUE, wait);
+        }
+        mcp_bus_task_count++;
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+#endif
+
+#ifdef ACTISENSE_REPLAY
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Actisense Replay
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief FreeRTOS task for injecting an Actisense stream into the gateway
+ * 
+ * Reads the UART in chunks of ACTISENSE_CHUNK_SIZE bytes, parses each chunk with tActisenseBlockReader and pushes the 
+ * parsed messages to ACTISENSE_TARGET_QUEUE in batches. The task waits for space in the queue rather than dropping, 
+ * so a log streamed from the host at full baud rate is replayed completely.
+ * 
+ * @param pvParameters
+*/
+void actisense_replay_task(void *pvParameters)
+{
+    static uint8_t chunk[ACTISENSE_CHUNK_SIZE];
+    static NMEA_msg batch[ACTISENSE_BATCH_SIZE];
+    tActisenseBlockReader reader;
+    reader.SetControllerNumber(ACTISENSE_CONTROLLER);
+
+    uart_config_t uart_config = {};
+    uart_config.baud_rate = ACTISENSE_UART_BAUD;
+    uart_config.data_bits = UART_DATA_8_BITS;
+    uart_config.parity = UART_PARITY_DISABLE;
+    uart_config.stop_bits = UART_STOP_BITS_1;
+    uart_config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    uart_config.source_clk = UART_SCLK_DEFAULT;
+    ESP_ERROR_CHECK(uart_driver_install(ACTISENSE_UART_NUM, ACTISENSE_UART_BUF_SIZE, 0, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_param_config(ACTISENSE_UART_NUM, &uart_config));
+    ESP_ERROR_CHECK(uart_set_pin(ACTISENSE_UART_NUM, ACTISENSE_UART_TX_PIN, ACTISENSE_UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+
+    // Task Loop
+    for (;;)
+    {
+        int len = uart_read_bytes(ACTISENSE_UART_NUM, chunk, sizeof(chunk), pdMS_TO_TICKS(20));
+        size_t offset = 0;
+        while (len > 0 && offset < (size_t)len)
+        {
+            size_t consumed = 0;
+            size_t n = reader.Parse(&chunk[offset], len - offset, batch, ACTISENSE_BATCH_SIZE, consumed);
+            offset += consumed;
+            int64_t now = esp_timer_get_time();
+            for (size_t i = 0; i < n; i++) {
+                batch[i].timestamp_us = now;
+                xQueueSendToBack(ACTISENSE_TARGET_QUEUE, &batch[i], portMAX_DELAY);
+            }
+            queue_peak_update(ACTISENSE_TARGET_QUEUE);
+            actisense_msg_count += n;
+        }
+        actisense_error_count = reader.GetErrorCount();
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Command Channel
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+#ifdef COMMAND_CHANNEL
+/**
+ * @brief Applies committed transactions, called by the WASM pthread between messages
+ * 
+ * Every part of a transaction is taken in one handoff and applied before the next message, so no message sees the 
+ * new mode with the old rate rules or the other way round. tx_rate_limiter is only used by the WASM pthread, which 
+ * is why the transaction is handed over instead of being applied by command_task.
+*/
+static void command_apply()
+{
+    static uint32_t applied_generation = 0;
+    if (command_generation.load() == applied_generation){
+        return;
+    }
+    rate_limit_rule rules[RATE_LIMIT_RULES];
+    uint32_t critical_pgns[CMD_MAX_CRITICAL_PGNS];
+    portENTER_CRITICAL(&command_pending_lock);
+    size_t rule_count = command_rate_pending_count;
+    memcpy(rules, command_rate_pending, rule_count * sizeof(rate_limit_rule));
+    command_rate_pending_count = 0;
+    bool critical_set = command_critical_pending_set;
+    size_t critical_count = command_critical_pending_count;
+    memcpy(critical_pgns, command_critical_pending, critical_count * sizeof(uint32_t));
+    command_critical_pending_set = false;
+    int mode = command_mode_pending;
+    command_mode_pending = -1;
+    uint32_t generation = command_generation.load(); // command_commit counts a transaction under the lock
+    portEXIT_CRITICAL(&command_pending_lock);
+
+    int64_t now = esp_timer_get_time();
+    for (size_t i = 0; i < rule_count; i++){
+        if (!tx_rate_limiter.SetRule(rules[i], now)){
+            ESP_LOGW(TAG_WASM, "Rate limit table full, rule for PGN %" PRIi32 " not set", rules[i].PGN);
+        }
+    }
+    if (critical_set){
+        // Fill the list not in use, a receive task may be in the middle of checking the current one
+        command_shedder_slot ^= 1;
+        uint32_t *pgns = command_critical_pgns[command_shedder_slot];
+        memcpy(pgns, critical_pgns, critical_count * sizeof(uint32_t));
+        load_shedder_config &shedder = command_shedder_config[command_shedder_slot];
+        shedder = shedder_config;
+        shedder.critical_pgns = pgns;
+        shedder.critical_pgn_count = critical_count;
+        for (int i = 0; i < NUM_CONTROLLERS; i++){
+            load_shedder[i].SetConfig(&shedder);
+        }
+    }
+    if (mode >= 0){
+        tc_mode = mode; // the mode pins override it again on their next edge
+    }
+    applied_generation = generation;
+}
+
+/**
+ * @brief Commits a staged transaction, the WASM pthread applies it before its next message, see command_apply
+ * @return CMD_STATUS_CODE, nothing is committed if it is not CMD_OK
+*/
+static uint8_t command_commit(command_config &config)
+{
+    if (!config.open){
+        return CMD_ERR_NO_CONFIG;
+    }
+    config.open = false;
+
+    portENTER_CRITICAL(&command_pending_lock);
+    bool rules_fit = command_rate_pending_count + config.rate_rule_count <= RATE_LIMIT_RULES;
+    if (rules_fit){
+        memcpy(&command_rate_pending[command_rate_pending_count], config.rate_rules, config.rate_rule_count * sizeof(rate_limit_rule));
+        command_rate_pending_count += config.rate_rule_count;
+        if (config.critical_set){
+            memcpy(command_critical_pending, config.critical_pgns, config.critical_pgn_count * sizeof(uint32_t));
+            command_critical_pending_count = config.critical_pgn_count;
+            command_critical_pending_set = true;
+        }
+        if (config.mode >= 0){
+            command_mode_pending = config.mode;
+        }
+        command_generation++;
+    }
+    portEXIT_CRITICAL(&command_pending_lock);
+    return rules_fit ? CMD_OK : CMD_ERR_FULL; // CMD_ERR_FULL: the WASM pthread has not caught up with earlier commits
+}
+
+/**
+ * @brief Adds the messages of a CMD_INJECT frame to the send queues without waiting
+ * @return false if the frame is malformed, the messages before the error are sent
+*/
+static bool command_inject(const command_frame &frame)
+{
+    static NMEA_msg msg; // static, a message is too large for the task stack
+    size_t offset = 0;
+    bool mcp = false;
+    int64_t now = esp_timer_get_time();
+    while (command_next_inject(frame, offset, msg, NUM_CONTROLLERS)){
+        msg.timestamp_us = now;
+        if (xQueueSendToBack(tx_queues[msg.controller_number], &msg, 0)){
+            queue_peak_update(tx_queues[msg.controller_number]);
+            mcp = mcp || controller_backends[msg.controller_number] == BACKEND_MCP;
+            command_injected_count++;
+        }
+        else{
+            command_inject_dropped_count++;
+        }
+    }
+    if (mcp){
+        NotifyMcpBus();
+    }
+    return offset == frame.length;
+}
+
+#ifdef WASM_HOT_SWAP
+/**
+ * @brief Hands a module to the WASM loader
+ * @param[in] image module in the heap, owned by the loader if CMD_OK is returned. NULL to load the wasm_app partition
+ * @param[in] size
+ * @param[in] persist also write the module to the wasm_app partition
+ * @return CMD_STATUS_CODE, CMD_ERR_BUSY until the last module has been swapped in
+*/
+static uint8_t command_module_load(uint8_t *image, uint32_t size, bool persist)
+{
+    if (wasm_loader_handle == NULL || wasm_loader_busy.exchange(true)){
+        return CMD_ERR_BUSY;
+    }
+    wasm_request.image = image;
+    wasm_request.size = size;
+    wasm_request.persist = persist;
+    xTaskNotifyGive(wasm_loader_handle);
+    return CMD_OK;
+}
+
+/**
+ * @brief Starts receiving a module and allocates its buffer, a module that was not committed is discarded
+ * @return CMD_STATUS_CODE
+*/
+static uint8_t command_module_start(const command_frame &frame)
+{
+    heap_caps_free(command_module_staged.buffer);
+    uint8_t status = command_module_begin(command_module_staged, frame, WASM_IMAGE_MAX_SIZE);
+    if (status != CMD_OK){
+        return status;
+    }
+    command_module_staged.buffer = reinterpret_cast<uint8_t*>(heap_caps_malloc(command_module_staged.size, MALLOC_CAP_8BIT));
+    if (command_module_staged.buffer == NULL){
+        command_module_staged.open = false;
+        return CMD_ERR_FULL;
+    }
+    return CMD_OK;
+}
+
+/**
+ * @brief Checks the received module and hands it to the WASM loader
+ * @return CMD_STATUS_CODE, the module is discarded if it is not CMD_OK
+*/
+static uint8_t command_module_commit()
+{
+    uint8_t status = command_module_finish(command_module_staged);
+    if (status == CMD_OK){
+        status = command_module_load(command_module_staged.buffer, command_module_staged.size,
+            (command_module_staged.flags & CMD_MODULE_PERSIST) != 0);
+    }
+    if (status != CMD_OK){
+        heap_caps_free(command_module_staged.buffer);
+    }
+    command_module_staged.buffer = NULL;
+    return status;
+}
+#endif
+
+/**
+ * @brief Sends a response to the Pi
+ * @param[in] request frame being answered
+ * @param[in] status CMD_STATUS_CODE, first byte of the payload
+ * @param[in] data rest of the payload
+ * @param[in] data_length
+*/
+static void command_respond(const command_frame &request, uint8_t status, const uint8_t *data, size_t data_length)
+{
+    static uint8_t payload[CMD_MAX_PAYLOAD];
+    static uint8_t frame[CMD_MAX_FRAME];
+    payload[0] = status;
+    if (data_length > 0){
+        memcpy(&payload[1], data, data_length);
+    }
+    size_t size = command_encode(request.type | CMD_RESPONSE, request.seq, payload, 1 + data_length, frame, sizeof(frame));
+    uart_write_bytes(COMMAND_UART_NUM, frame, size);
+}
+
+/**
+ * @brief FreeRTOS task that reads command frames from the Pi and executes them
+ * 
+ * See command_channel.h for the protocol. Frames with a bad CRC are dropped without a response, the Pi resends 
+ * requests that are not answered.
+ * 
+ * @param pvParameters
+*/
+void command_task(void *pvParameters)
+{
+    static uint8_t chunk[COMMAND_CHUNK_SIZE];
+    static tCommandParser parser;
+
+    uart_config_t uart_config = {};
+    uart_config.baud_rate = COMMAND_UART_BAUD;
+    uart_config.data_bits = UART_DATA_8_BITS;
+    uart_config.parity = UART_PARITY_DISABLE;
+    uart_config.stop_bits = UART_STOP_BITS_1;
+    uart_config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    uart_config.source_clk = UART_SCLK_DEFAULT;
+    ESP_ERROR_CHECK(uart_driver_install(COMMAND_UART_NUM, COMMAND_UART_BUF_SIZE, 0, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_param_config(COMMAND_UART_NUM, &uart_config));
+    ESP_ERROR_CHECK(uart_set_pin(COMMAND_UART_NUM, COMMAND_UART_TX_PIN, COMMAND_UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    boot_wait(BOOT_CONTROLLERS_READY); // injected messages need open controllers
+
+    // Task Loop
+    for (;;)
+    {
+        int len = uart_read_bytes(COMMAND_UART_NUM, chunk, sizeof(chunk), pdMS_TO_TICKS(20));
+        size_t offset = 0;
+        while (len > 0 && offset < (size_t)len)
+        {
+            size_t consumed = 0;
+            bool complete = parser.Feed(&chunk[offset], len - offset, consumed);
+            offset += consumed;
+            if (!complete){
+                continue;
+            }
+            const command_frame &frame = parser.GetFrame();
+            switch (frame.type){
+            case CMD_INJECT:
+                if (!command_inject(frame)){
+                    command_respond(frame, CMD_ERR_LENGTH, NULL, 0); // only malformed injections are answered
+                }
+                break;
+            case CMD_PING:
+                command_respond(frame, CMD_OK, NULL, 0);
+                break;
+            case CMD_STATUS: {
+                command_status status;
+                status.config_generation = command_generation.load();
+                status.frames = parser.FrameCount;
+                status.crc_errors = parser.CrcErrorCount;
+                status.length_errors = parser.LengthErrorCount;
+                status.injected = command_injected_count;
+                status.inject_dropped = command_inject_dropped_count;
+                status.mode = tc_mode.load();
+#ifdef WASM_HOT_SWAP
+                status.module_swaps = wasm_swap_count;
+                status.module_swap_us = wasm_swap_us;
+#else
+                status.module_swaps = 0;
+                status.module_swap_us = 0;
+#endif
+                uint8_t data[40];
+                command_respond(frame, CMD_OK, data, command_status_encode(status, data));
+                break;
+            }
+            case CMD_CONFIG_BEGIN:
+                command_config_begin(command_staged);
+                command_respond(frame, CMD_OK, NULL, 0);
+                break;
+            case CMD_CONFIG_COMMIT:
+                command_respond(frame, command_commit(command_staged), NULL, 0);
+                break;
+#ifdef WASM_HOT_SWAP
+            case CMD_MODULE_BEGIN:
+                command_respond(frame, command_module_start(frame), NULL, 0);
+                break;
+            case CMD_MODULE_DATA:
+                command_respond(frame, command_module_write(command_module_staged, frame), NULL, 0);
+                break;
+            case CMD_MODULE_COMMIT:
+                command_respond(frame, command_module_commit(), NULL, 0);
+                break;
+            case CMD_MODULE_LOAD:
+                command_respond(frame, command_module_load(NULL, 0, false), NULL, 0);
+                break;
+#endif
+            default:
+                command_respond(frame, command_config_stage(command_staged, frame), NULL, 0);
+                break;
+            }
+        }
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Received Messages Queue
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+#if RX_OVERFLOW_POLICY == RX_OVERFLOW_CONFLATE
+/**
+ * @brief Parks a message that did not fit in the rx queue
+ * 
+ * If a message from the same controller, PGN and source is already parked it is replaced, so only the latest value 
+ * of each stream waits for space in the queue.
+ * 
+ * @param[in] msg
+ * @return false if there was no free slot
+*/
+static bool rx_conflate_park(const NMEA_msg &msg)
+{
+    int free_slot = -1;
+    bool parked = false;
+    portENTER_CRITICAL(&rx_conflate_lock);
+    for (int i = 0; i < RX_CONFLATE_SLOTS; i++) {
+        rx_conflate_slot &slot = rx_conflate_slots[i];
+        if (!slot.used) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+        } else if (slot.msg.controller_number == msg.controller_number && slot.msg.PGN == msg.PGN && slot.msg.source == msg.source) {
+            slot.msg = msg;
+            rx_conflated_count++;
+            parked = true;
+            break;
+        }
+    }
+    if (!parked && free_slot >= 0) {
+        rx_conflate_slots[free_slot].msg = msg;
+        rx_conflate_slots[free_slot].used = true;
+        rx_conflate_used++;
+        parked = true;
+    }
+    portEXIT_CRITICAL(&rx_conflate_lock);
+    return parked;
+}
+#endif
+
+#ifdef RX_CONFLATING_QUEUE
+/**
+ * @brief Checks if a PGN is conflated in the rx queue
+ * 
+ * @param[in] PGN
+*/
+static bool rx_conflatable(uint32_t PGN)
+{
+    for (uint32_t conflate_pgn : rx_conflate_pgns) {
+        if (conflate_pgn == PGN) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+/**
+ * @brief Ends the pending state of the stream of a message that was dropped instead of queued
+ * 
+ * Otherwise newer messages of the stream would keep replacing a message that is never processed.
+ * 
+ * @param[in] msg
+*/
+static void rx_stream_dropped(const NMEA_msg &msg)
+{
+#ifdef RX_CONFLATING_QUEUE
+    if (rx_conflatable(msg.PGN)) {
+        NMEA_msg pending = msg;
+        portENTER_CRITICAL(&rx_streams_lock);
+        rx_streams.Take(pending);
+        portEXIT_CRITICAL(&rx_streams_lock);
+    }
+#endif
+}
+
+/**
+ * @brief Takes the next message out of the rx queue
+ * 
+ * With RX_CONFLATING_QUEUE, a message of a periodic stream is replaced by the latest message of its stream that 
+ * arrived while it was queued. Everything that takes messages out of rx_queue must use this.
+ * 
+ * @param[out] msg
+ * @param[in] wait ticks to wait for a message
+ * @return true if a message was taken
+*/
+static bool rx_queue_receive(NMEA_msg &msg, TickType_t wait)
+{
+    if (xQueueReceive(rx_queue, &msg, wait) != pdTRUE) {
+        return false;
+    }
+#ifdef RX_CONFLATING_QUEUE
+    if (rx_conflatable(msg.PGN)) {
+        portENTER_CRITICAL(&rx_streams_lock);
+        rx_streams.Take(msg);
+        portEXIT_CRITICAL(&rx_streams_lock);
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief Moves parked messages into the rx queue while it has space
+ * 
+ * Called by the receive handler before queueing a new message and by the WASM pthread after taking one out.
+*/
+static void rx_flush_conflated()
+{
+#if RX_OVERFLOW_POLICY == RX_OVERFLOW_CONFLATE
+    if (rx_conflate_used == 0) {
+        return;
+    }
+    NMEA_msg msg;
+    for (int i = 0; i < RX_CONFLATE_SLOTS && uxQueueSpacesAvailable(rx_queue) > 0; i++) {
+        bool found = false;
+        portENTER_CRITICAL(&rx_conflate_lock);
+        if (rx_conflate_slots[i].used) {
+            msg = rx_conflate_slots[i].msg;
+            rx_conflate_slots[i].used = false;
+            rx_conflate_used--;
+            found = true;
+        }
+        portEXIT_CRITICAL(&rx_conflate_lock);
+        if (found && xQueueSendToBack(rx_queue, &msg, 0) != pdTRUE) {
+            // Another receive task took the space, park it again
+            if (!rx_conflate_park(msg)) {
+                rx_stream_dropped(msg);
+                rx_drop_oldest_count++; // it was accepted earlier, newer messages took its place
+            }
+            break;
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Adds a received message to the rx queue without blocking
+ * 
+ * The receive tasks must never wait for the WASM app, otherwise the controller buffers overflow behind them. When the 
+ * queue is full RX_OVERFLOW_POLICY decides which message is lost, and the matching drop counter is incremented.
+ * 
+ * @param[in] msg
+ * @return true if the message was queued or parked, false if it was discarded
+*/
+static bool rx_queue_add(const NMEA_msg &msg)
+{
+#ifdef RX_CONFLATING_QUEUE
+    if (rx_conflatable(msg.PGN)) {
+        portENTER_CRITICAL(&rx_streams_lock);
+        bool replaced = rx_streams.Offer(msg);
+        portEXIT_CRITICAL(&rx_streams_lock);
+        if (replaced) {
+            return true; // the queued message of this stream will be processed with this value
+        }
+    }
+#endif
+    rx_flush_conflated();
+    if (xQueueSendToBack(rx_queue, &msg, 0) == pdTRUE) {
+        return true;
+    }
+#if RX_OVERFLOW_POLICY == RX_OVERFLOW_DROP_OLDEST
+    NMEA_msg oldest;
+    if (rx_queue_receive(oldest, 0)) {
+        rx_drop_oldest_count++;
+    }
+    if (xQueueSendToBack(rx_queue, &msg, 0) == pdTRUE) {
+        return true;
+    }
+#elif RX_OVERFLOW_POLICY == RX_OVERFLOW_CONFLATE
+    if (rx_conflate_park(msg)) {
+        return true;
+    }
+#endif
+    rx_stream_dropped(msg);
+    rx_drop_newest_count++;
+    return false;
+}
+
+/**
+ * @brief Stores a received message in the WASM app's state table if its PGN is kept there
+ * 
+ * @param[in] N2kMsg
+ * @param[in] controller_number
+ * @param[in] rx_time receive time in us
+*/
+static void state_table_store(const tN2kMsg &N2kMsg, uint8_t controller_number, int64_t rx_time)
+{
+    state_table *table = wasm_state_table.load(std::memory_order_acquire);
+    if (table == NULL) {
+        return;
+    }
+    for (uint32_t pgn : state_table_pgns) {
+        if (pgn == N2kMsg.PGN) {
+            portENTER_CRITICAL(&state_table_lock);
+            table = wasm_state_table.load(std::memory_order_acquire); // reloaded, a swap may have replaced it
+            if (table != NULL) {
+                state_table_update(table, N2kMsg.PGN, N2kMsg.Source, controller_number, rx_time, N2kMsg.Data, N2kMsg.DataLen);
+            }
+            portEXIT_CRITICAL(&state_table_lock);
+            return;
+        }
+    }
+}
+
+/**
+ * \brief Creates a NMEA_msg object and adds it to.data the received messages queue
+ * 
+ * Every message is added to the bus load estimate of the controller it was received on. Messages the gateway sent 
+ * itself on the same controller within ECHO_FILTER_WINDOW_US are dropped so forwarded traffic can't loop between the buses. If LOAD_SHEDDING is defined,
+ * the message is only queued for the WASM app if the load shedder of that controller admits it.
+ * 
+ * @todo handle out of range data
+ * \param N2kMsg Reference to the N2KMs being handled
+ * \param controller_number controller the message was received on
+ * \return void
+ */
+void HandleNMEA2000Msg(const tN2kMsg &N2kMsg, uint8_t controller_number) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&bus_load_lock[controller_number]);
+  bus_load[controller_number].AddMessage(N2kMsg.DataLen, now);
+  portEXIT_CRITICAL(&bus_load_lock[controller_number]);
+  if (boot_stage_us[BOOT_FIRST_RX] == 0) {
+    boot_mark(BOOT_FIRST_RX);
+  }
+
+  uint32_t can_id = tEchoFilter::CanId(N2kMsg.Priority, N2kMsg.PGN, N2kMsg.Source);
+  uint32_t payload_hash = tEchoFilter::PayloadHash(N2kMsg.Data, N2kMsg.DataLen);
+  portENTER_CRITICAL(&echo_filter_lock);
+  bool echo = echo_filter.IsEcho(controller_number, can_id, payload_hash, now);
+  portEXIT_CRITICAL(&echo_filter_lock);
+  if (echo){
+    DLOGD(TAG_TWAI, "echo of a msg sent on controller %d", controller_number);
+    echo_suppressed_count[controller_number]++;
+    return;
+  }
+  DLOGV(TAG_TWAI, "Message Handler called");
+
+  int64_t rx_time = rx_stamp_get(controller_number);
+  if (rx_time == 0 || rx_time > now) {
+    rx_time = now; // not read through a stamped path, e.g. the benchmark
+  }
+  state_table_store(N2kMsg, controller_number, rx_time); // before load shedding, so the table stays current under overload
+
+#ifdef LOAD_SHEDDING
+  uint32_t queue_fill_percent = (uxQueueMessagesWaiting(rx_queue) * 100) / RX_QUEUE_SIZE;
+  portENTER_CRITICAL(&bus_load_lock[controller_number]);
+  uint32_t bus_utilization_percent = bus_load[controller_number].UtilizationPercent(now);
+  portEXIT_CRITICAL(&bus_load_lock[controller_number]);
+  if (!load_shedder[controller_number].Admit(N2kMsg.PGN, N2kMsg.Priority, bus_utilization_percent, queue_fill_percent)){
+    DLOGV(TAG_TWAI, "shed msg with PGN %lu", N2kMsg.PGN);
+    return;
+  }
+#endif
+
+  NMEA_msg msg;
+  msg.controller_number = controller_number;
+  msg.priority = N2kMsg.Priority;
+  
+  msg.PGN = N2kMsg.PGN;
+  DLOGD(TAG_TWAI, "PGN %u", msg.PGN);
+  msg.source = N2kMsg.Source;
+  msg.data_length_bytes = N2kMsg.DataLen;
+  msg.timestamp_us = rx_time;
+  size_t size = sizeof(N2kMsg.Data) / sizeof(N2kMsg.Data[0]);
+  // Perform the conversion with range checking
+  for (size_t i = 0; i < size; i++) {
+      if (N2kMsg.Data[i] <= static_cast<unsigned char>(CHAR_MAX)) {
+          msg.data[i] = static_cast<signed char>(N2kMsg.Data[i]);
+      } else {
+          // Handle out-of-range value
+          //msg.data[i] = /* Your desired behavior for out-of-range values */;
+          DLOGE("Message Handle", "data out of range for signed array");
+      }
+  }
+
+  if(!rx_queue_add(msg)){
+    DLOGW(TAG_TWAI, "Could not add received message to RX queue");
+  }
+  else{
+    queue_peak_update(rx_queue);
+    DLOGV(TAG_TWAI, " added msg to received queue");
+  }
+  read_msg_count++;
+  
 }
 
+/// @brief Message handler for controller NUM
+template<int NUM> void HandleControllerMsg(const tN2kMsg &N2kMsg) {
+  HandleNMEA2000Msg(N2kMsg, NUM);
+}
+
+
+
 //--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-// Controller 0 (TWAI)
+// WASM App
 //--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 /**
- * @brief FreeRTOS task for receiving messages from CAN controller
- * 
- * @param pvParameters
- * 
- * NMEA2000 Library is designed so that message receiving and sending is handled within the same task. 
- * In the NMEA2000_ESP32 library, this is made possible by letting the twai rx interrupt handle receiving CAN frames. 
- * In this library, the receiving is separated from the processing and sending of messages. This is done because 
- * I was unable to trigger recieving a CAN frame from the twai rx interrupt, so CAN_read_frame() must be called explicitly here. 
-*/
-void C0_receive_task(void *pvParameters){
-    esp_log_level_set(TAG_TWAI, MY_ESP_LOG_LEVEL);
-    C0.SetN2kCANMsgBufSize(8);
-    C0.SetN2kCANReceiveFrameBufSize(250);
-    C0.EnableForward(false);               
-    C0.SetMsgHandler(HandleNMEA2000Msg);
-    C0.SetMode(tNMEA2000::N2km_ListenAndSend);    
-    C0.Open();
-    C0.ConfigureAlerts(alerts_to_enable);
-
-    // Task Loop
-    while(1)
-    {
-        C0.CAN_read_frame(); // retrieves available messages - for TWAI controller only
-        C0.ParseMessages(); // Calls message handle whenever a message is available
-        C0_rx_task_count++;        
+ * @brief Calls a link function of the app with the address and size of a buffer in its memory
+ * @return false if the function is not found or raised an exception
+*/
+static bool wasm_app_link(wasm_app &app, const char *name, uint32_t offset, uint32_t size)
+{
+    wasm_function_inst_t func = wasm_runtime_lookup_function(app.module_inst, name, NULL);
+    if (!func) {
+        ESP_LOGW(TAG_WASM, "The wasm function %s is not found.", name);
+        return false;
     }
-    vTaskDelete(NULL); // should never get here...
+    uint32 argv[2];
+    argv[0] = offset;   /* the buffer address in WASM space */
+    argv[1] = size;     /* the size of the buffer */
+    if (!wasm_runtime_call_wasm(app.exec_env, func, 2, argv)) {
+        ESP_LOGW(TAG_WASM, "call wasm function %s failed. error: %s", name, wasm_runtime_get_exception(app.module_inst));
+        return false;
+    }
+    ESP_LOGI(TAG_WASM, "Native finished calling wasm function: %s", name);
+    return true;
 }
 
 /**
- * @brief FreeRTOS task for processing and sending messages from CAN controller with NMEA2000 library
+ * @brief Loads and instantiates a module and links the message, mode and state table buffers
  * 
- * Tries to receive a message from the controller 0 tx queue, and sends it if available
+ * The app is not used by the WASM pthread until it is passed to wasm_app_activate(). Apps can be created while
+ * another one runs, WAMR serializes the pool allocations.
  * 
- * @todo frame buffer should be 32 - see if this works
- * @param pvParameters
+ * @param[out] app
+ * @param[in] image module bytes, must stay valid until the app is destroyed
+ * @param[in] size
+ * @param[in] owned image is in the heap and is freed by wasm_app_destroy()
+ * @return false on failure, call wasm_app_destroy() either way
 */
-void C0_send_task(void *pvParameters)
-{   
-    esp_log_level_set(TAG_TWAI, MY_ESP_LOG_LEVEL);
-    ESP_LOGI(TAG_TWAI, "Starting C0_send_task");
-    NMEA_msg msg;
+static bool wasm_app_create(wasm_app &app, uint8_t *image, uint32_t size, bool owned)
+{
+    char error_buf[128];
+    memset(&app, 0, sizeof(app));
+    app.image = image;
+    app.image_size = size;
+    app.image_owned = owned;
 
-    // Task Loop
-    for (;;)
-    {
-        if( xQueueReceive( C0_tx_queue, &msg, (100 / portTICK_PERIOD_MS) ))
-        {
+    /* load WASM module */
+    if (!(app.module = wasm_runtime_load(image, size, error_buf, sizeof(error_buf)))) {
+        ESP_LOGE(TAG_WASM, "Error in wasm_runtime_load: %s", error_buf);
+        return false;
+    }
 
-            SendN2kMsg(msg, C0_NUM);
-  
-        }
-        ESP_LOGV(TAG_TWAI, "Send task called");
+    ESP_LOGI(TAG_WASM, "Instantiate WASM runtime");
+    if (!(app.module_inst =
+              wasm_runtime_instantiate(app.module, NATIVE_STACK_SIZE, // stack size
+                                       NATIVE_HEAP_SIZE,              // heap size
+                                       error_buf, sizeof(error_buf)))) {
+        ESP_LOGE(TAG_WASM, "Error while instantiating: %s", error_buf);
+        return false;
+    }
 
-        C0_tx_task_count++;        
+    app.exec_env = wasm_runtime_create_exec_env(app.module_inst, NATIVE_STACK_SIZE);//stack size
+    if (!app.exec_env) {
+        ESP_LOGW(TAG_WASM,"Create wasm execution environment failed.\n");
+        return false;
     }
-    vTaskDelete(NULL); // should never get here...
+
+    /* it is runtime embedder's responsibility to release the memory,
+       unless the WASM app will free the passed pointer in its code */
+    // Link buffer for Messages
+    app.msg_buffer_offset = wasm_runtime_module_malloc(app.module_inst, MSG_STRING_SIZE, (void **)&app.msg_buffer);
+    if (app.msg_buffer_offset == 0) {
+        ESP_LOGW(TAG_WASM, "Malloc for the message buffer failed");
+        return false;
+    }
+    memset(app.msg_buffer, 0, MSG_STRING_SIZE);
+    if (!wasm_app_link(app, "link_msg_buffer", app.msg_buffer_offset, MSG_BUFFER_SIZE)) {
+        return false;
+    }
+
+    // Link buffer for mode
+    app.mode_buffer_offset = wasm_runtime_module_malloc(app.module_inst, MODE_BUFFER_SIZE + 1, (void **)&app.mode_buffer);
+    if (app.mode_buffer_offset == 0) {
+        ESP_LOGW(TAG_WASM, "Malloc for the mode buffer failed");
+        return false;
+    }
+    memset(app.mode_buffer, 0, MODE_BUFFER_SIZE + 1);
+    if (!wasm_app_link(app, "link_mode_buffer", app.mode_buffer_offset, MODE_BUFFER_SIZE)) {
+        return false;
+    }
+
+    // Link the state table, optional for the app
+    if (!wasm_runtime_lookup_function(app.module_inst, "link_state_table", NULL)) {
+        ESP_LOGI(TAG_WASM, "The wasm function link_state_table is not found, running without the state table");
+        return true;
+    }
+    state_table *table = NULL;
+    app.state_table_offset = wasm_runtime_module_malloc(app.module_inst, sizeof(state_table), (void **)&table);
+    if (app.state_table_offset == 0) {
+        ESP_LOGW(TAG_WASM, "Malloc for the state table failed, running without it");
+        return true;
+    }
+    state_table_init(table);
+    if (!wasm_app_link(app, "link_state_table", app.state_table_offset, sizeof(state_table))) {
+        return false;
+    }
+    app.table = table;
+    ESP_LOGI(TAG_WASM, "State table linked, %u bytes", sizeof(state_table));
+    return true;
 }
 
-//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-// Controller 1 (MCP)
-//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 /**
- * @brief FreeRTOS task for receiving messages from MCP CAN controller 1
- * 
- * Sets up a NMEA2000 Object with the MCP class. Initializes the SPI bus and adds a device to the bus. 
- * Semaphore is used so that send and receive tasks don't access the same device at the same time. 
+ * @brief Frees everything an app holds, also one that failed in wasm_app_create()
  * 
- * @param pvParameters
+ * The app must not be active, see wasm_app_activate().
  * 
+ * @param[in,out] app zeroed afterwards
 */
-void C1_receive_task(void *pvParameters){
-    esp_log_level_set(TAG_MCP1, MY_ESP_LOG_LEVEL);
-    C1.SetN2kCANMsgBufSize(8);
-    C1.SetN2kCANReceiveFrameBufSize(250);
-    C1.EnableForward(false);              
-    C1.SetMsgHandler(HandleNMEA2000Msg);
-    C1.SetMode(tNMEA2000::N2km_ListenAndSend);
-    C1.CANinit(); // Initialize SPI bus, call before C1.Open() and only call once for all the MCP tasks
-    C1.Open(); 
-
-    // Task Loop
-    while(1)
-    {
-        if( xSemaphoreTake( x_sem_mcp1, (100 / portTICK_PERIOD_MS) ) == pdTRUE )
-        {
-            // We were able to obtain the semaphore and can now access the shared resource.
-            C1.ParseMessages(); // Calls message handle whenever a message is available    
-            // We have finished accessing the shared resource.  Release the semaphore.
-            xSemaphoreGive( x_sem_mcp1 );
-            vTaskDelay(10 / portTICK_PERIOD_MS);   
-        }
-        C1_rx_task_count++;
-        vTaskDelay(10 / portTICK_PERIOD_MS);        
-    
+static void wasm_app_destroy(wasm_app &app)
+{
+    if (app.exec_env)
+        wasm_runtime_destroy_exec_env(app.exec_env);
+    if (app.module_inst) {
+        if (app.msg_buffer_offset)
+            wasm_runtime_module_free(app.module_inst, app.msg_buffer_offset);
+        if (app.mode_buffer_offset)
+            wasm_runtime_module_free(app.module_inst, app.mode_buffer_offset);
+        if (app.state_table_offset)
+            wasm_runtime_module_free(app.module_inst, app.state_table_offset);
+        /* destroy the module instance */
+        ESP_LOGI(TAG_WASM, "Deinstantiate WASM runtime");
+        wasm_runtime_deinstantiate(app.module_inst);
     }
-    vTaskDelete(NULL); // should never get here...
+    if (app.module){
+        /* unload the module */
+        ESP_LOGI(TAG_WASM, "Unload WASM module");
+        wasm_runtime_unload(app.module);
+    }
+    if (app.image_owned){
+        heap_caps_free(app.image);
+    }
+    memset(&app, 0, sizeof(app));
 }
 
 /**
- * @brief FreeRTOS task for processing and sending messages from MCP CAN controller 1 with NMEA2000 library
+ * @brief Points the WASM pthread's buffers and the receive tasks' state table at an app
  * 
- * Tries to receive a message from the controller 1 tx queue, and sends it if available
- * Semaphore is used so that send and receive tasks don't access the same device at the same time. 
+ * The new state table starts as a copy of the previous one, so the app sees the latest values at once. Copy and 
+ * switch happen under state_table_lock, no receive task writes the previous table afterwards.
  * 
- * @param pvParameters
+ * @param[in] app
+ * @param[in] previous app running until now, NULL if there is none
 */
-void C1_send_task(void *pvParameters)
-{   
-    esp_log_level_set(TAG_MCP1, MY_ESP_LOG_LEVEL);
-    ESP_LOGI(TAG_TWAI, "Starting C1_send_task");
-    NMEA_msg msg;
-
-    // Task Loop
-    for (;;)
-    {
-        if( xQueueReceive( C1_tx_queue, &msg, (100 / portTICK_PERIOD_MS) ))
-        {
-            if( xSemaphoreTake( x_sem_mcp1, portMAX_DELAY ) == pdTRUE )
-            {
-                // We were able to obtain the semaphore and can now access the shared resource.
-                ESP_LOGD(TAG_MCP1, "About to send message with PGN: %i", msg.PGN);
-
-                SendN2kMsg(msg, C1_NUM);
-                
-                // We have finished accessing the shared resource.  Release the semaphore.
-                xSemaphoreGive( x_sem_mcp1 );
-            }        
-            
-        }
-        ESP_LOGD(TAG_TWAI, "Send task called");
-
-        C1_tx_task_count++;        
+static void wasm_app_activate(wasm_app &app, const wasm_app *previous)
+{
+    wasm_buffer = app.msg_buffer;
+    wasm_mode_buffer = app.mode_buffer;
+    portENTER_CRITICAL(&state_table_lock);
+    if (previous != NULL && previous->table != NULL && app.table != NULL){
+        memcpy(app.table, previous->table, sizeof(state_table));
     }
-    vTaskDelete(NULL); // should never get here...
+    wasm_state_table.store(app.table, std::memory_order_release);
+    portEXIT_CRITICAL(&state_table_lock);
 }
 
-//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-// Controller 2 (MCP)
-//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 /**
- * @brief FreeRTOS task for receiving messages from MCP CAN controller 2
+ * @brief Records the WASM stack and app heap use of an app, for the memory budget report
  * 
- * Sets up a NMEA2000 Object with the MCP class. Adds a device to the bus. It does not need to initialize the SPI bus because the MCP1 recieve task has already done that.
- * Semaphore is used so that send and receive tasks don't access the same device at the same time. 
- * 
- * @param pvParameters
+ * Only the WASM pthread calls this, between messages, so the app is not running or being destroyed.
  * 
+ * @param[in] app
 */
-void C2_receive_task(void *pvParameters){
-    esp_log_level_set(TAG_MCP2, MY_ESP_LOG_LEVEL);
-
-    C2.SetN2kCANMsgBufSize(8);
-    C2.SetN2kCANReceiveFrameBufSize(250);
-    C2.EnableForward(false);              
-    C2.SetMsgHandler(HandleNMEA2000Msg);
-    C2.SetMode(tNMEA2000::N2km_ListenAndSend);
+static void wasm_peak_update(const wasm_app &app)
+{
+#ifdef MEMORY_BUDGET
+    uint32_t stack_used = ((WASMExecEnv *)app.exec_env)->max_wasm_stack_used;
+    if (stack_used > wasm_stack_peak){
+        wasm_stack_peak = stack_used;
+    }
+    WASMModuleInstance *module_inst = (WASMModuleInstance *)app.module_inst;
+    mem_alloc_info_t heap_info;
+    if (module_inst->memory_count > 0 && module_inst->memories[0]->heap_handle != NULL &&
+        mem_allocator_get_alloc_info(module_inst->memories[0]->heap_handle, &heap_info) &&
+        heap_info.highmark_size > wasm_heap_peak){
+        wasm_heap_peak = heap_info.highmark_size;
+    }
+#endif
+}
 
-    C2.Open();
-    // Task Loop
-    while(1)
-    {
-        if( xSemaphoreTake( x_sem_mcp2, (100 / portTICK_PERIOD_MS) ) == pdTRUE )
-        {
-            // We were able to obtain the semaphore and can now access the shared resource.
-            C2.ParseMessages(); // Calls message handle whenever a message is available     
+#ifdef WASM_HOT_SWAP
+/// @brief The wasm_app partition, NULL if the partition table has none
+static const esp_partition_t* wasm_partition()
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, WASM_PARTITION_LABEL);
+}
 
-            xSemaphoreGive( x_sem_mcp2 ); // We have finished accessing the shared resource.  Release the semaphore.
-            vTaskDelay(100 / portTICK_PERIOD_MS);   
-        }
-        C2_rx_task_count++;
-        vTaskDelay(10 / portTICK_PERIOD_MS);           
-    
+/**
+ * @brief Reads the module stored in the wasm_app partition into the heap
+ * @param[out] size module bytes
+ * @return the module, NULL if there is no partition or no valid module in it
+*/
+static uint8_t* wasm_partition_read(uint32_t &size)
+{
+    const esp_partition_t *partition = wasm_partition();
+    if (partition == NULL){
+        ESP_LOGW(TAG_WASM, "No %s partition in the partition table", WASM_PARTITION_LABEL);
+        return NULL;
     }
-    vTaskDelete(NULL); // should never get here...
+    wasm_image_header header;
+    if (esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK || !wasm_image_header_valid(header, partition->size)){
+        ESP_LOGI(TAG_WASM, "No module in the %s partition", WASM_PARTITION_LABEL);
+        return NULL;
+    }
+    uint8_t *image = reinterpret_cast<uint8_t*>(heap_caps_malloc(header.size, MALLOC_CAP_8BIT));
+    if (image == NULL){
+        ESP_LOGE(TAG_WASM, "No memory for the %" PRIu32 " byte module in the %s partition", header.size, WASM_PARTITION_LABEL);
+        return NULL;
+    }
+    if (esp_partition_read(partition, header.header_size, image, header.size) != ESP_OK || !wasm_image_check(image, header.size, header.crc)){
+        ESP_LOGW(TAG_WASM, "The module in the %s partition is corrupt", WASM_PARTITION_LABEL);
+        heap_caps_free(image);
+        return NULL;
+    }
+    size = header.size;
+    return image;
 }
 
 /**
- * @brief FreeRTOS task for processing and sending messages from MCP CAN controller 2 with NMEA2000 library
+ * @brief Stores the bytes of a module in the wasm_app partition, without a header it is not loaded at boot
  * 
- * Tries to receive a message from the controller 2 tx queue, and sends it if available
- * Semaphore is used so that send and receive tasks don't access the same device at the same time. 
+ * Flash erases and writes stall code running from flash on both cores. They are done in WASM_PERSIST_CHUNK steps with
+ * a tick in between, so the receive tasks get to empty the controller buffers between two steps. The erase also 
+ * removes the header of the module stored before.
  * 
- * @param pvParameters
+ * @return false if there is no partition, it is too small or the flash operation failed
 */
-void C2_send_task(void *pvParameters)
-{   
-    esp_log_level_set(TAG_MCP2, MY_ESP_LOG_LEVEL);
-    ESP_LOGI(TAG_TWAI, "Starting C2_send_task");
-    NMEA_msg msg;
-    
-    // Task Loop
-    for (;;)
-    {
-        if( xQueueReceive( C2_tx_queue, &msg, (100 / portTICK_PERIOD_MS) ))
-        {
-            if( xSemaphoreTake( x_sem_mcp2, portMAX_DELAY ) == pdTRUE )
-            {
-                // We were able to obtain the semaphore and can now access the shared resource.
-                ESP_LOGD(TAG_MCP2, "About to send message with PGN: %i", msg.PGN);
-
-                SendN2kMsg(msg, C2_NUM);            
-                xSemaphoreGive( x_sem_mcp2 ); // We have finished accessing the shared resource.  Release the semaphore.
-            }        
-            
+static bool wasm_partition_write_data(const uint8_t *image, uint32_t size)
+{
+    const esp_partition_t *partition = wasm_partition();
+    if (partition == NULL || size > partition->size - sizeof(wasm_image_header)){
+        return false;
+    }
+    uint32_t end = sizeof(wasm_image_header) + size;
+    for (uint32_t offset = 0; offset < end; offset += WASM_PERSIST_CHUNK){
+        if (esp_partition_erase_range(partition, offset, WASM_PERSIST_CHUNK) != ESP_OK){
+            return false;
+        }
+        vTaskDelay(1);
+    }
+    for (uint32_t offset = 0; offset < size; offset += WASM_PERSIST_CHUNK){
+        uint32_t length = std::min<uint32_t>(WASM_PERSIST_CHUNK, size - offset);
+        if (esp_partition_write(partition, sizeof(wasm_image_header) + offset, &image[offset], length) != ESP_OK){
+            return false;
         }
-        ESP_LOGD(TAG_TWAI, "Send task called");
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+/**
+ * @brief Makes the module written by wasm_partition_write_data() the one loaded at boot
+ * @param[in] header built from the module bytes as they were written
+*/
+static bool wasm_partition_write_header(const wasm_image_header &header)
+{
+    const esp_partition_t *partition = wasm_partition();
+    return partition != NULL && esp_partition_write(partition, 0, &header, sizeof(header)) == ESP_OK;
+}
 
-        C2_tx_task_count++;        
+/**
+ * @brief Swaps in an app instantiated by the loader, called by the WASM pthread between messages
+ * 
+ * Only pointers change hands here, plus the copy of the state table. The app swapped out is freed by the loader.
+*/
+static void wasm_app_swap()
+{
+    wasm_app *next = wasm_app_pending.exchange(nullptr, std::memory_order_acquire);
+    if (next == NULL){
+        return;
     }
-    vTaskDelete(NULL); // should never get here...
+    int64_t start = esp_timer_get_time();
+    wasm_app_activate(*next, wasm_app_live);
+    wasm_app_retired = wasm_app_live;
+    wasm_app_live = next;
+    wasm_swap_us = static_cast<uint32_t>(esp_timer_get_time() - start);
+    wasm_swap_count++;
+    xSemaphoreGive(wasm_swap_done);
 }
 
 /**
- * \brief Creates a NMEA_msg object and adds it to.data the received messages queue
+ * @brief WASM loader pthread, instantiates new apps next to the running one
  * 
- * @todo handle out of range data
- * \param N2kMsg Reference to the N2KMs being handled
- * \return void
- */
-void HandleNMEA2000Msg(const tN2kMsg &N2kMsg) {
-  if (N2kMsg.Source == 14){
-    ESP_LOGD(TAG_TWAI, "source is 14");
-    return;
-  }
-  ESP_LOGV(TAG_TWAI, "Message Handler called");
-  NMEA_msg msg;
-  msg.controller_number = 0;
-  msg.priority = N2kMsg.Priority;
-  
-  msg.PGN = N2kMsg.PGN;
-  ESP_LOGD(TAG_TWAI, "PGN %u", msg.PGN);
-  msg.source = N2kMsg.Source;
-  msg.data_length_bytes = N2kMsg.DataLen;
-  size_t size = sizeof(N2kMsg.Data) / sizeof(N2kMsg.Data[0]);
-  // Perform the conversion with range checking
-  for (size_t i = 0; i < size; i++) {
-      if (N2kMsg.Data[i] <= static_cast<unsigned char>(CHAR_MAX)) {
-          msg.data[i] = static_cast<signed char>(N2kMsg.Data[i]);
-      } else {
-          // Handle out-of-range value
-          //msg.data[i] = /* Your desired behavior for out-of-range values */;
-          ESP_LOGE("Message Handle", "data out of range for signed array");
-      }
-  }
+ * Waits for a module from command_task (or the request to load the wasm_app partition), creates the app in the free
+ * slot of wasm_apps and hands it to the WASM pthread, which swaps it in between two messages. Forwarding only pauses
+ * for the swap itself. The app swapped out is freed here.
+ * 
+ * A module to be stored is written to the partition before it is loaded, WAMR may patch the bytes it loads from (the 
+ * interpreter rewrites opcodes in place). Its header, with the CRC of the unpatched bytes, is written once the app 
+ * has been swapped in, so a module that fails to load is never loaded at boot.
+ * 
+ * @param arg unused
+*/
+void * wasm_loader_main(void *arg)
+{
+    (void)arg; /* unused */
+    wasm_loader_handle = xTaskGetCurrentTaskHandle();
+    boot_wait(BOOT_BIT(BOOT_WASM_READY)); // the WASM pthread initializes the runtime
+    wasm_runtime_init_thread_env(); // the link functions run WASM code on this thread
 
-  if(xQueueSendToBack(rx_queue, &msg, pdMS_TO_TICKS(10)) == 0){
-    ESP_LOGW(TAG_TWAI, "Could not add received message to RX queue");    
-  }
-  else{
-    ESP_LOGV(TAG_TWAI, " added msg to received queue");
-  }
-  read_msg_count++;
-  
-}
+    // Task Loop
+    for (;;){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        wasm_load_request request = wasm_request;
+        int64_t start = esp_timer_get_time();
+        if (request.image == NULL){
+            request.image = wasm_partition_read(request.size);
+        }
+        wasm_image_header header;
+        bool persist = false;
+        if (request.persist && request.image != NULL){
+            wasm_image_header_init(header, request.image, request.size);
+            persist = wasm_partition_write_data(request.image, request.size);
+            if (!persist){
+                ESP_LOGW(TAG_WASM, "Could not store the WASM app in the %s partition", WASM_PARTITION_LABEL);
+            }
+        }
+        wasm_app &next = (wasm_app_live == &wasm_apps[0]) ? wasm_apps[1] : wasm_apps[0];
+        if (request.image == NULL || !wasm_app_create(next, request.image, request.size, true)){
+            wasm_app_destroy(next);
+            wasm_load_failed_count++;
+            ESP_LOGW(TAG_WASM, "New WASM app not loaded, the running app stays");
+            wasm_loader_busy = false;
+            continue;
+        }
+        wasm_load_ms = static_cast<uint32_t>((esp_timer_get_time() - start) / 1000);
 
+        wasm_app_pending.store(&next, std::memory_order_release);
+        xSemaphoreTake(wasm_swap_done, portMAX_DELAY);
+        wasm_app_destroy(*wasm_app_retired);
+        ESP_LOGI(TAG_WASM, "Swapped in a %" PRIu32 " byte WASM app, loaded in %" PRIu32 " ms, swap-over took %" PRIu32 " us",
+            request.size, wasm_load_ms, wasm_swap_us);
 
+        if (persist){
+            if (wasm_partition_write_header(header)){
+                ESP_LOGI(TAG_WASM, "WASM app stored in the %s partition", WASM_PARTITION_LABEL);
+            }
+            else{
+                ESP_LOGW(TAG_WASM, "Could not store the WASM app in the %s partition", WASM_PARTITION_LABEL);
+            }
+        }
+        wasm_loader_busy = false;
+    }
+    return NULL;
+}
+#endif
 
 /**
  * @brief executes main function in wasm app
@@ -874,6 +3416,104 @@ static void * app_instance_main(wasm_module_inst_t module_inst)
     return NULL;
 }
 
+#ifdef WASM_BUDGET
+/**
+ * @brief Budget timer callback, terminates the WASM app if it is still running the message it was armed for
+ * 
+ * Runs on the esp_timer task. The state decides the race with the WASM pthread stopping the timer: only one of them
+ * moves the state of a run on from WASM_BUDGET_RUNNING. The generation in the state makes a callback of an earlier
+ * run fail its compare, so it can never terminate the message after it.
+ * 
+ * @param arg unused, esp_timer fixes the argument when the timer is created
+*/
+static void wasm_budget_expired(void *arg)
+{
+    (void)arg; /* unused */
+    uint32_t generation = wasm_budget_armed_generation;
+    uint32_t expected = WASM_BUDGET_PACK(generation, WASM_BUDGET_RUNNING);
+    if (wasm_budget_state.compare_exchange_strong(expected, WASM_BUDGET_PACK(generation, WASM_BUDGET_STOPPING),
+        std::memory_order_acquire)){
+        wasm_runtime_terminate(wasm_budget_inst);
+        wasm_budget_state.store(WASM_BUDGET_PACK(generation, WASM_BUDGET_STOPPED), std::memory_order_release);
+    } // else the app returned in time
+    wasm_budget_callbacks.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * @brief Executes main function in wasm app, terminated after WASM_BUDGET_US
+ * 
+ * The thread manager makes the interpreter check for the termination in loops and calls, WASM_BUDGET does not build 
+ * without it.
+ * 
+ * @param module_inst wasm module instance
+ * @return how the run ended, WASM_RUN_TERMINATED only if the interpreter stopped on the termination exception
+*/
+static wasm_run_result app_instance_main_budgeted(wasm_module_inst_t module_inst)
+{
+    static uint32_t expired_runs = 0; // runs whose timer expired, each gets exactly one callback
+    uint32_t generation = (wasm_budget_armed_generation + 1) & (UINT32_MAX >> WASM_BUDGET_STATE_BITS);
+    wasm_budget_armed_generation = generation;
+    wasm_budget_inst = module_inst;
+    wasm_budget_state.store(WASM_BUDGET_PACK(generation, WASM_BUDGET_RUNNING), std::memory_order_release);
+    esp_timer_start_once(wasm_budget_timer, WASM_BUDGET_US);
+    bool returned = wasm_application_execute_main(module_inst, 0, NULL);
+    const char *exception = wasm_runtime_get_exception(module_inst);
+    bool terminated = !returned && exception != NULL && strstr(exception, WASM_TERMINATED_EXCEPTION) != NULL;
+    // Once the timer has expired it is off the list and stopping it fails, its callback may not have run yet
+    bool expired = esp_timer_stop(wasm_budget_timer) != ESP_OK;
+
+    uint32_t expected = WASM_BUDGET_PACK(generation, WASM_BUDGET_RUNNING);
+    bool in_time = wasm_budget_state.compare_exchange_strong(expected, WASM_BUDGET_PACK(generation, WASM_BUDGET_IDLE),
+        std::memory_order_acq_rel);
+    if (expired){
+        expired_runs++;
+        while (wasm_budget_callbacks.load(std::memory_order_acquire) != expired_runs){
+            vTaskDelay(1); // the callback of this run must be done before the timer is armed for the next one
+        }
+    }
+    if (in_time){
+        if (exception)
+            ESP_LOGW(TAG_WASM,"%s\n", exception);
+        return WASM_RUN_DONE;
+    }
+    wasm_runtime_clear_exception(module_inst); // also set if the app returned just before it was terminated
+    wasm_budget_state.store(WASM_BUDGET_PACK(generation, WASM_BUDGET_IDLE), std::memory_order_relaxed);
+    return terminated ? WASM_RUN_TERMINATED : WASM_RUN_LATE;
+}
+
+/**
+ * @brief Applies WASM_OVERRUN_POLICY to a message the WASM app was terminated on
+ * 
+ * Messages the app sent before it was terminated stay queued. Controllers the app queued anything to while running on 
+ * the message are skipped, its output there may be a modified copy and the original must not go out next to it.
+ * 
+ * @param[in] msg the message given to the app
+*/
+static void wasm_overrun_fallback(const NMEA_msg &msg)
+{
+    wasm_overrun_count++;
+    wasm_overrun_pgn = msg.PGN;
+    DLOGW(TAG_WASM, "WASM app terminated after %d us on PGN %u from controller %d", WASM_BUDGET_US, msg.PGN, msg.controller_number);
+#if WASM_OVERRUN_POLICY == WASM_OVERRUN_FORWARD
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        if (i == msg.controller_number || (wasm_sent_to & (1ull << i)) != 0){
+            continue;
+        }
+        NMEA_msg copy = msg;
+        copy.controller_number = i;
+        if (!xQueueSendToBack(tx_queues[i], &copy, 0)){
+            wasm_overrun_forward_dropped_count++;
+            continue;
+        }
+        queue_peak_update(tx_queues[i]);
+        if (controller_backends[i] == BACKEND_MCP){
+            NotifyMcpBus();
+        }
+    }
+#endif
+}
+#endif
+
 /**
  * @brief WASM pthread to host wasm app
  * 
@@ -888,20 +3528,15 @@ void * iwasm_main(void *arg)
 {
     esp_log_level_set(TAG_WASM, MY_ESP_LOG_LEVEL);
     (void)arg; /* unused */
-    /* setup variables for instantiating and running the wasm module */
-    uint8_t *wasm_file_buf = NULL;
-    unsigned wasm_file_buf_size = 0;
-    wasm_exec_env_t exec_env = NULL;
-    wasm_module_t wasm_module = NULL;
-    wasm_module_inst_t wasm_module_inst = NULL;
-    char error_buf[128];
+    wasm_pthread_handle = xTaskGetCurrentTaskHandle();
+    /* setup variables for running the wasm module */
+    wasm_app *app = &wasm_apps[0];
+    bool created = false;
+#ifndef WASM_BUDGET
     void *ret;
-    wasm_function_inst_t func = NULL;
+#endif
     RuntimeInitArgs init_args;
 
-    uint32_t buffer_for_wasm = 0;
-    uint32_t buffer_for_wasm_mode = 0;
-
     /* configure memory allocation */
     memset(&init_args, 0, sizeof(RuntimeInitArgs));
 
@@ -924,133 +3559,130 @@ void * iwasm_main(void *arg)
             reinterpret_cast<void*>(SendMsg),   
             "(iiii*~)i",
             NULL    
+        },
+        {
+            "SetTxRate",
+            reinterpret_cast<void*>(SetTxRate),
+            "(iiiii)i",
+            NULL
+        },
+        {
+            "GetMsgTimestamp",
+            reinterpret_cast<void*>(GetMsgTimestamp),
+            "()I",
+            NULL
+        },
+        {
+            "GetTimeUs",
+            reinterpret_cast<void*>(GetTimeUs),
+            "()I",
+            NULL
         }
     };
-#if WASM_ENABLE_GLOBAL_HEAP_POOL == 0
+#ifndef WASM_HEAP_POOL
     init_args.mem_alloc_type = Alloc_With_Allocator;
     init_args.mem_alloc_option.allocator.malloc_func = (void *)os_malloc;
     init_args.mem_alloc_option.allocator.realloc_func = (void *)os_realloc;
     init_args.mem_alloc_option.allocator.free_func = (void *)os_free;
 #else
-#error The usage of a global heap pool is not implemented yet for esp-idf.
+    init_args.mem_alloc_type = Alloc_With_Pool;
+    init_args.mem_alloc_option.pool.heap_buf = wasm_heap_pool;
+    init_args.mem_alloc_option.pool.heap_size = WASM_HEAP_POOL_SIZE;
 #endif
 
-    /* configure the native functions being exported to WASM app */
-    init_args.n_native_symbols = sizeof(native_symbols) / sizeof(NativeSymbol);
-    init_args.native_module_name = "env";
-    init_args.native_symbols = native_symbols;
-
-
-    ESP_LOGI(TAG_WASM, "Initialize WASM runtime");
-    /* initialize runtime environment */
-    if (!wasm_runtime_full_init(&init_args)) {
-        ESP_LOGE(TAG_WASM, "Init runtime failed.");
-        return NULL;
-    }
-    ESP_LOGI(TAG_WASM, "Run wamr with interpreter");
-
-    wasm_file_buf = (uint8_t *)nmea_attack_wasm;
-    wasm_file_buf_size = sizeof(nmea_attack_wasm);
-
-    /* load WASM module */
-    if (!(wasm_module = wasm_runtime_load(wasm_file_buf, wasm_file_buf_size,
-                                          error_buf, sizeof(error_buf)))) {
-        ESP_LOGE(TAG_WASM, "Error in wasm_runtime_load: %s", error_buf);
-        goto fail;
-    }
-
-    ESP_LOGI(TAG_WASM, "Instantiate WASM runtime");
-    if (!(wasm_module_inst =
-              wasm_runtime_instantiate(wasm_module, NATIVE_STACK_SIZE, // stack size
-                                       NATIVE_HEAP_SIZE,              // heap size
-                                       error_buf, sizeof(error_buf)))) {
-        ESP_LOGE(TAG_WASM, "Error while instantiating: %s", error_buf);
-        goto fail;
-    }
-
-    
-    exec_env = wasm_runtime_create_exec_env(wasm_module_inst, NATIVE_STACK_SIZE);//stack size
-    if (!exec_env) {
-        ESP_LOGW(TAG_WASM,"Create wasm execution environment failed.\n");
-        goto fail;
-    }
+    /* configure the native functions being exported to WASM app */
+    init_args.n_native_symbols = sizeof(native_symbols) / sizeof(NativeSymbol);
+    init_args.native_module_name = "env";
+    init_args.native_symbols = native_symbols;
 
-    // Link buffer for Messages
-    ESP_LOGI(TAG_WASM, "Malloc buffer in wasm function");
-    buffer_for_wasm = wasm_runtime_module_malloc(wasm_module_inst, 100, (void **)&wasm_buffer);
-    if (buffer_for_wasm == 0) {
-        ESP_LOGI(TAG_WASM, "Malloc failed");
-        goto fail;
-    }
-    uint32 argv[2];
-    argv[0] = buffer_for_wasm;     /* pass the buffer address for WASM space */
-    argv[1] = MSG_BUFFER_SIZE;                 /* the size of buffer */
-    ESP_LOGI(TAG_WASM, "Call wasm function");
-    /* it is runtime embedder's responsibility to release the memory,
-       unless the WASM app will free the passed pointer in its code */
-    
-    if (!(func = wasm_runtime_lookup_function(wasm_module_inst, "link_msg_buffer",
-                                               NULL))) {
-        ESP_LOGW(TAG_WASM,
-            "The wasm function link_msg_buffer wasm function is not found.\n");
-        goto fail;
-    }
 
-    if (wasm_runtime_call_wasm(exec_env, func, 2, argv)) {
-        ESP_LOGI(TAG_WASM,"Native finished calling wasm function: link_msg_buffer, "
-               "returned a formatted string: %s\n",
-               wasm_buffer);
-    }
-    else {
-        ESP_LOGW(TAG_WASM,"call wasm function link_msg_buffer failed. error: %s\n",
-               wasm_runtime_get_exception(wasm_module_inst));
-        goto fail;
+    ESP_LOGI(TAG_WASM, "Initialize WASM runtime");
+    /* initialize runtime environment */
+    if (!wasm_runtime_full_init(&init_args)) {
+        ESP_LOGE(TAG_WASM, "Init runtime failed.");
+        return NULL;
     }
+    ESP_LOGI(TAG_WASM, "Run wamr with interpreter");
 
-    // Link buffer for mode
-    ESP_LOGI(TAG_WASM, "Malloc buffer in wasm function");
-    buffer_for_wasm_mode = wasm_runtime_module_malloc(wasm_module_inst, 100, (void **)&wasm_mode_buffer);
-    if (buffer_for_wasm_mode == 0) {
-        ESP_LOGI(TAG_WASM, "Malloc failed");
-        goto fail;
+#ifdef WASM_HOT_SWAP
+    {
+        uint32_t image_size = 0;
+        uint8_t *image = wasm_partition_read(image_size);
+        if (image != NULL){
+            ESP_LOGI(TAG_WASM, "Load the WASM app from the %s partition", WASM_PARTITION_LABEL);
+            created = wasm_app_create(*app, image, image_size, true);
+            if (!created){
+                wasm_app_destroy(*app);
+                ESP_LOGW(TAG_WASM, "Falling back to the built in WASM app");
+            }
+        }
     }
-    uint32 argv_mode[2];
-    argv_mode[0] = buffer_for_wasm_mode;     /* pass the buffer address for WASM space */
-    argv_mode[1] = MODE_BUFFER_SIZE;                 /* the size of buffer */
-    ESP_LOGI(TAG_WASM, "Call wasm function");
-    /* it is runtime embedder's responsibility to release the memory,
-       unless the WASM app will free the passed pointer in its code */
-    
-    if (!(func = wasm_runtime_lookup_function(wasm_module_inst, "link_mode_buffer",
-                                               NULL))) {
-        ESP_LOGW(TAG_WASM,
-            "The wasm function link_mode_buffer wasm function is not found.\n");
+#endif
+    if (!created && !wasm_app_create(*app, (uint8_t *)nmea_attack_wasm, sizeof(nmea_attack_wasm), false)){
         goto fail;
     }
-
-    if (wasm_runtime_call_wasm(exec_env, func, 2, argv_mode)) {
-        ESP_LOGI(TAG_WASM,"Native finished calling wasm function: link_mode_buffer, "
-               "returned a formatted string: %s\n",
-               wasm_mode_buffer);
-    }
-    else {
-        ESP_LOGW(TAG_WASM,"call wasm function link_mode_buffer failed. error: %s\n",
-               wasm_runtime_get_exception(wasm_module_inst));
-        goto fail;
+    wasm_app_activate(*app, NULL);
+    wasm_app_live = app;
+#ifdef WASM_BUDGET
+    {
+        const esp_timer_create_args_t budget_timer_args = {
+            .callback = &wasm_budget_expired,
+            .arg = NULL,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "wasm_budget",
+            .skip_unhandled_events = true,
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&budget_timer_args, &wasm_budget_timer));
     }
+#endif
+    boot_mark(BOOT_WASM_READY);
 
 
     // Task Loop
+    static char msg_chars[MSG_STRING_SIZE];
+    static bool boot_reported = false;
     while (true){
         ESP_LOGV(TAG_WASM, "run main() of the application");
+        if (!boot_reported && boot_stage_us[BOOT_FIRST_FORWARD] != 0){
+            print_boot_timeline(TAG_WASM);
+            boot_reported = true;
+        }
+        if (heap_init_allocated_blocks < 0 && (xEventGroupGetBits(boot_events) & BOOT_ALL_READY) == BOOT_ALL_READY){
+            heap_init_allocated_blocks = heap_allocated_blocks(); // every stage has finished initializing
+        }
+#ifdef COMMAND_CHANNEL
+        command_apply(); // between messages, so a message never sees half of a commit
+#endif
+#ifdef WASM_HOT_SWAP
+        wasm_app_swap();
+#endif
         auto start = std::chrono::high_resolution_clock::now(); 
         NMEA_msg msg;
-        if (xQueueReceive(rx_queue, &msg, (100 / portTICK_PERIOD_MS) == 1)){
-            std::string str_msg = nmea_to_string(msg);
-            strncpy(wasm_buffer, str_msg.c_str(), str_msg.size()); // fill message buffer
-            strncpy(wasm_mode_buffer, tc_mode.c_str(), tc_mode.size()); // fill mode buffer            
-            ret = app_instance_main(wasm_module_inst);  //Call the main function 
+        if (rx_queue_receive(msg, (100 / portTICK_PERIOD_MS) == 1)){
+            int64_t msg_start = esp_timer_get_time();
+            rx_flush_conflated(); // there is space in the queue again
+            size_t msg_len = nmea_to_chars(msg, msg_chars, sizeof(msg_chars));
+            memcpy(wasm_buffer, msg_chars, msg_len); // fill message buffer
+            wasm_mode_buffer[0] = '0' + tc_mode.load(); // fill mode buffer
+            wasm_msg_timestamp_us = msg.timestamp_us;
+#ifdef WASM_BUDGET
+            wasm_budget_msg = &msg;
+            wasm_sent_to = 0;
+            wasm_run_result result = app_instance_main_budgeted(wasm_app_live->module_inst);
+            if (result == WASM_RUN_TERMINATED){
+                wasm_overrun_fallback(msg);
+            }
+            else if (result == WASM_RUN_LATE){
+                wasm_late_count++; // its output is complete, nothing to fall back to
+            }
+            wasm_budget_msg = NULL;
+#else
+            ret = app_instance_main(wasm_app_live->module_inst);  //Call the main function
             assert(!ret);
+#endif
+            wasm_latency.Add(static_cast<uint32_t>(esp_timer_get_time() - msg_start));
+            wasm_msg_count++;
+            wasm_peak_update(*wasm_app_live);
         } else{
             vTaskDelay(10 / portTICK_PERIOD_MS); // I don't understand why this is nessesary
         }
@@ -1063,35 +3695,17 @@ void * iwasm_main(void *arg)
     }
 
 
-    //wasm_runtime_module_free(wasm_module_inst, buffer_for_wasm);
-    //wasm_runtime_module_free(wasm_module_inst, buffer_for_wasm_mode);
-    
-    /* destroy the module instance */
-    ESP_LOGI(TAG_WASM, "Deinstantiate WASM runtime");
-    wasm_runtime_deinstantiate(wasm_module_inst);
-
 fail:
-    if (exec_env)
-        wasm_runtime_destroy_exec_env(exec_env);
-    if (wasm_module_inst) {
-        if (buffer_for_wasm){
-            wasm_runtime_module_free(wasm_module_inst, buffer_for_wasm);}
-        if (buffer_for_wasm_mode)
-        {
-           wasm_runtime_module_free(wasm_module_inst, buffer_for_wasm_mode); 
-        }
-        wasm_runtime_deinstantiate(wasm_module_inst);
-    }
-    if (wasm_module){
-        /* unload the module */
-        ESP_LOGI(TAG_WASM, "Unload WASM module");
-        wasm_runtime_unload(wasm_module);
+    wasm_state_table.store(nullptr, std::memory_order_release);
+    portENTER_CRITICAL(&state_table_lock);  // wait for a receive task still writing the table
+    portEXIT_CRITICAL(&state_table_lock);
+    // wasm_buffer and wasm_mode_buffer point into the module instance, freed below
+    wasm_buffer = NULL;
+    wasm_mode_buffer = NULL;
+    wasm_app_live = NULL;
+    for (wasm_app &each : wasm_apps){
+        wasm_app_destroy(each);
     }
-    if (wasm_buffer)
-        BH_FREE(wasm_buffer);
-    if (wasm_mode_buffer)
-        BH_FREE(wasm_mode_buffer);
-
 
     /* destroy runtime environment */
     ESP_LOGI(TAG_WASM, "Destroy WASM runtime");
@@ -1104,177 +3718,548 @@ fail:
  * 
  * In ESP-IDF, a pthread is just a wrapper on FreeRTOS
 */
-extern "C" int app_main(void)
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Task Topology
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Static stack and task control block for an entry, KEY is the name used in Kconfig
+#define TOPOLOGY_STATIC_BUFFERS(KEY) \
+    static StackType_t KEY##_stack[CONFIG_GW_##KEY##_STACK]; \
+    static StaticTask_t KEY##_tcb;
+#define TOPOLOGY_TASK(name, function, handle, KEY) \
+    {name, function, handle, CONFIG_GW_##KEY##_STACK, CONFIG_GW_##KEY##_PRIO, CONFIG_GW_##KEY##_CORE, KEY##_stack, &KEY##_tcb, sizeof(KEY##_stack)}
+
+#ifdef PRINT_STATS
+TOPOLOGY_STATIC_BUFFERS(STATS_TASK)
+#endif
+TOPOLOGY_STATIC_BUFFERS(MODE_TASK)
+#ifdef MCP_BUS_OWNER_TASK
+TOPOLOGY_STATIC_BUFFERS(MCP_BUS_TASK)
+#endif
+#ifdef ACTISENSE_REPLAY
+TOPOLOGY_STATIC_BUFFERS(REPLAY_TASK)
+#endif
+#ifdef DEFERRED_LOG
+TOPOLOGY_STATIC_BUFFERS(LOG_TASK)
+#endif
+#ifdef COMMAND_CHANNEL
+TOPOLOGY_STATIC_BUFFERS(COMMAND_TASK)
+#endif
+#ifdef RUN_BENCHMARKS
+TOPOLOGY_STATIC_BUFFERS(BENCH_TASK)
+#endif
+#ifdef TOPOLOGY_SWEEP
+TOPOLOGY_STATIC_BUFFERS(SWEEP_TASK)
+void topology_sweep_task(void *pvParameters);
+#endif
+#ifdef LOAD_TEST
+TOPOLOGY_STATIC_BUFFERS(LOADTEST_TASK)
+#endif
+#ifdef MEMORY_BUDGET
+TOPOLOGY_STATIC_BUFFERS(BUDGET_TASK)
+void memory_budget_task(void *pvParameters);
+#endif
+
+// Controller tasks, generated from controller_devices. The TWAI controller has its own Kconfig keys (C0_*), the MCP 
+// controllers share MCP_* keys. With MCP_BUS_OWNER_TASK the MCP controllers have no tasks of their own.
+#ifdef MCP_BUS_OWNER_TASK
+static constexpr bool mcp_bus_owner_task = true;
+#else
+static constexpr bool mcp_bus_owner_task = false;
+#endif
+
+/// @brief Kconfig settings of a controller task
+struct controller_task_config {
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core;
+};
+
+/// @brief true if controller NUM runs its own send and receive task
+template<int NUM> constexpr bool controller_has_tasks = controller_backend_v<NUM> == BACKEND_TWAI || !mcp_bus_owner_task;
+
+template<int NUM> constexpr controller_task_config controller_send_task_config = controller_backend_v<NUM> == BACKEND_TWAI ?
+    controller_task_config{CONFIG_GW_C0_SEND_TASK_STACK, CONFIG_GW_C0_SEND_TASK_PRIO, CONFIG_GW_C0_SEND_TASK_CORE} :
+    controller_task_config{CONFIG_GW_MCP_SEND_TASK_STACK, CONFIG_GW_MCP_SEND_TASK_PRIO, CONFIG_GW_MCP_SEND_TASK_CORE};
+template<int NUM> constexpr controller_task_config controller_recv_task_config = controller_backend_v<NUM> == BACKEND_TWAI ?
+    controller_task_config{CONFIG_GW_C0_RECV_TASK_STACK, CONFIG_GW_C0_RECV_TASK_PRIO, CONFIG_GW_C0_RECV_TASK_CORE} :
+    controller_task_config{CONFIG_GW_MCP_RECV_TASK_STACK, CONFIG_GW_MCP_RECV_TASK_PRIO, CONFIG_GW_MCP_RECV_TASK_CORE};
+
+/// @brief "c<num><suffix>", the name of a controller task
+static constexpr std::array<char, 16> controller_task_name(int num, const char *suffix)
 {
-    C0_tx_queue = xQueueCreate(TX_QUEUE_SIZE, sizeof(NMEA_msg));
-    C1_tx_queue = xQueueCreate(TX_QUEUE_SIZE, sizeof(NMEA_msg));
-    C2_tx_queue = xQueueCreate(TX_QUEUE_SIZE, sizeof(NMEA_msg));
-    rx_queue = xQueueCreate(RX_QUEUE_SIZE, sizeof(NMEA_msg));
+    std::array<char, 16> name{};
+    size_t i = 0;
+    name[i++] = 'c';
+    if (num >= 10) {
+        name[i++] = static_cast<char>('0' + num / 10);
+    }
+    name[i++] = static_cast<char>('0' + num % 10);
+    while (*suffix != '\0' && i < name.size() - 1) {
+        name[i++] = *suffix++;
+    }
+    return name;
+}
+static_assert(NUM_CONTROLLERS <= 100, "controller_task_name writes two digits");
 
-    x_sem_mcp1 = xSemaphoreCreateMutex();
-    x_sem_mcp2 = xSemaphoreCreateMutex();
+template<int NUM> static constexpr std::array<char, 16> controller_send_task_name = controller_task_name(NUM, "_send_task");
+template<int NUM> static constexpr std::array<char, 16> controller_recv_task_name = controller_task_name(NUM, "_recv_task");
+template<int NUM> static StackType_t controller_send_task_stack[controller_send_task_config<NUM>.stack_size];
+template<int NUM> static StackType_t controller_recv_task_stack[controller_recv_task_config<NUM>.stack_size];
+template<int NUM> static StaticTask_t controller_send_task_tcb;
+template<int NUM> static StaticTask_t controller_recv_task_tcb;
+
+/// @brief The send and receive task entries of the controllers in NUM that run their own tasks, in controller order
+template<int... NUM> static std::array<task_topology, 2 * (0 + ... + controller_has_tasks<NUM>)> 
+    controller_task_rows(std::integer_sequence<int, NUM...>)
+{
+    std::array<task_topology, 2 * (0 + ... + controller_has_tasks<NUM>)> rows{};
+    size_t row = 0;
+    ([&rows, &row]() {
+        if constexpr (controller_has_tasks<NUM>) {
+            constexpr controller_task_config send = controller_send_task_config<NUM>;
+            constexpr controller_task_config recv = controller_recv_task_config<NUM>;
+            rows[row++] = {controller_send_task_name<NUM>.data(), &controller_send_task<NUM>, &controller_send_task_handle[NUM], 
+                send.stack_size, send.priority, send.core, controller_send_task_stack<NUM>, &controller_send_task_tcb<NUM>,
+                sizeof(controller_send_task_stack<NUM>)};
+            rows[row++] = {controller_recv_task_name<NUM>.data(), &controller_receive_task<NUM>, &controller_receive_task_handle[NUM], 
+                recv.stack_size, recv.priority, recv.core, controller_recv_task_stack<NUM>, &controller_recv_task_tcb<NUM>,
+                sizeof(controller_recv_task_stack<NUM>)};
+        }
+    }(), ...);
+    return rows;
+}
 
-    esp_err_t result = ESP_OK;
+/// @brief Joins the parts of the topology into one array
+template<size_t... N> static std::array<task_topology, (0 + ... + N)> topology_join(const std::array<task_topology, N>&... parts)
+{
+    std::array<task_topology, (0 + ... + N)> all{};
+    size_t next = 0;
+    ((std::copy(parts.begin(), parts.end(), all.begin() + next), next += N), ...);
+    return all;
+}
 
+/**
+ * @brief Every task started by app_main, in creation order
+ * 
+ * Defaults are set in menuconfig and can be overridden in NVS, see task_topology.h. Task stacks are static. The WASM 
+ * pthread entries are only used to configure the pthreads.
+*/
+static auto topology = topology_join(std::to_array<task_topology>({
 #ifdef PRINT_STATS
-    /* Status Task*/
-    printf( "create task");
-    xTaskCreatePinnedToCore(
-        &stats_task,            // Pointer to the task entry function.
-        "stats_task",           // A descriptive name for the task for debugging.
-        4096,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        STATS_TASK_PRIO, // priority at which the task should run
-        &stats_task_handle,      // Optional pass back task handle
-        1
-    );
-    if (stats_task_handle == NULL)
-    {
-        printf("Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+    TOPOLOGY_TASK("stats_task", &stats_task, &stats_task_handle, STATS_TASK),
+#endif
+    TOPOLOGY_TASK("get_mode_task", &get_mode_task, &modes_task_handle, MODE_TASK),
+}), controller_task_rows(std::make_integer_sequence<int, NUM_CONTROLLERS>()), std::to_array<task_topology>({
+#ifdef MCP_BUS_OWNER_TASK
+    TOPOLOGY_TASK("mcp_bus_task", &mcp_bus_task, &mcp_bus_task_handle, MCP_BUS_TASK),
+#endif
+#ifdef ACTISENSE_REPLAY
+    TOPOLOGY_TASK("replay_task", &actisense_replay_task, &actisense_task_handle, REPLAY_TASK),
+#endif
+#ifdef DEFERRED_LOG
+    TOPOLOGY_TASK("log_task", &log_task, &log_task_handle, LOG_TASK),
+#endif
+#ifdef COMMAND_CHANNEL
+    TOPOLOGY_TASK("command_task", &command_task, &command_task_handle, COMMAND_TASK),
+#endif
+#ifdef RUN_BENCHMARKS
+    TOPOLOGY_TASK("bench_task", &benchmark_task, &benchmark_task_handle, BENCH_TASK), // created alone, see app_main
+#endif
+#ifdef TOPOLOGY_SWEEP
+    TOPOLOGY_TASK("sweep_task", &topology_sweep_task, &topology_sweep_task_handle, SWEEP_TASK),
+#endif
+#ifdef LOAD_TEST
+    TOPOLOGY_TASK("loadtest_task", &load_test_task, &load_test_task_handle, LOADTEST_TASK),
+#endif
+#ifdef MEMORY_BUDGET
+    TOPOLOGY_TASK("budget_task", &memory_budget_task, &memory_budget_task_handle, BUDGET_TASK),
+#endif
+    // pthread stacks are allocated by esp_pthread, once at boot
+    {"wasm_pthread", NULL, &wasm_pthread_handle, CONFIG_GW_WASM_PTHREAD_STACK, CONFIG_GW_WASM_PTHREAD_PRIO, CONFIG_GW_WASM_PTHREAD_CORE, NULL, NULL, 0},
+#ifdef WASM_HOT_SWAP
+    {"wasm_loader", NULL, &wasm_loader_handle, CONFIG_GW_WASM_LOADER_STACK, CONFIG_GW_WASM_LOADER_PRIO, CONFIG_GW_WASM_LOADER_CORE, NULL, NULL, 0},
+#endif
+}));
+#define TOPOLOGY_COUNT  (topology.size())
+
+#ifdef TOPOLOGY_SWEEP
+// Candidate layouts, applied on top of the configured topology. Changes to tasks that are not built are ignored.
+static const topology_override layout_rx_on_core1[] = {
+    {"c0_recv_task", TOPOLOGY_KEEP, 1},
+    {"c1_recv_task", TOPOLOGY_KEEP, 1},
+    {"c2_recv_task", TOPOLOGY_KEEP, 1},
+    {"mcp_bus_task", TOPOLOGY_KEEP, 1},
+    {"c0_send_task", TOPOLOGY_KEEP, 0},
+    {"c1_send_task", TOPOLOGY_KEEP, 0},
+    {"c2_send_task", TOPOLOGY_KEEP, 0},
+};
+static const topology_override layout_wasm_with_rx[] = {
+    {"wasm_pthread", TOPOLOGY_KEEP, 0},
+};
+static const topology_override layout_wasm_high_prio[] = {
+    {"wasm_pthread", tskIDLE_PRIORITY+2, TOPOLOGY_KEEP},
+};
+static const topology_override layout_send_high_prio[] = {
+    {"c0_send_task", tskIDLE_PRIORITY+2, TOPOLOGY_KEEP},
+    {"c1_send_task", tskIDLE_PRIORITY+2, TOPOLOGY_KEEP},
+    {"c2_send_task", tskIDLE_PRIORITY+2, TOPOLOGY_KEEP},
+};
+static const topology_override layout_flat_prio[] = {
+    {"c0_send_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"c0_recv_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"c1_send_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"c1_recv_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"c2_send_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"c2_recv_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"mcp_bus_task", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+    {"wasm_pthread", tskIDLE_PRIORITY+1, TOPOLOGY_KEEP},
+};
+#define LAYOUT(name, overrides) {name, overrides, sizeof(overrides) / sizeof(overrides[0])}
+static const topology_layout topology_layouts[] = {
+    {"configured", NULL, 0},
+    LAYOUT("rx_on_core1", layout_rx_on_core1),
+    LAYOUT("wasm_with_rx", layout_wasm_with_rx),
+    LAYOUT("wasm_high_prio", layout_wasm_high_prio),
+    LAYOUT("send_high_prio", layout_send_high_prio),
+    LAYOUT("flat_prio", layout_flat_prio),
+};
+#define TOPOLOGY_LAYOUT_COUNT  (sizeof(topology_layouts) / sizeof(topology_layouts[0]))
+
+static uint8_t topology_sweep_index = 0; //!< Layout measured in this boot
+
+/**
+ * @brief FreeRTOS task that measures the layout of this boot and restarts into the next one
+ * 
+ * After TOPOLOGY_SWEEP_WARMUP_MS the counters are sampled over TOPOLOGY_SWEEP_MEASURE_MS. Feed the gateway the same 
+ * traffic for every layout, e.g. a log replayed with ACTISENSE_REPLAY. The result is printed as
+ * 
+ * `TOPOLOGY,<index>,<layout>,<rx msgs/s>,<wasm msgs/s>,<tx msgs/s>,<rx msgs dropped>,<p50 us>,<p99 us>,<fwd p50 us>,<fwd p99 us>`
+ * 
+ * where p50 and p99 are the time the WASM pthread spends on one message, and the fwd percentiles the time from 
+ * receipt until sent over all controllers.
+ * 
+ * @param pvParameters
+*/
+void topology_sweep_task(void *pvParameters)
+{
+    const topology_layout &layout = topology_layouts[topology_sweep_index];
+    vTaskDelay(pdMS_TO_TICKS(TOPOLOGY_SWEEP_WARMUP_MS));
+
+    int read_start = read_msg_count;
+    int wasm_start = wasm_msg_count;
+    int sent_start = send_msg_count;
+    uint32_t dropped_start = rx_drop_newest_count + rx_drop_oldest_count;
+    wasm_latency.Reset();
+    for (int i = 0; i < NUM_CONTROLLERS; i++) {
+        forward_latency[i].Reset();
+    }
+    int64_t start = esp_timer_get_time();
+
+    vTaskDelay(pdMS_TO_TICKS(TOPOLOGY_SWEEP_MEASURE_MS));
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    static tLatencyHistogram forward_all;
+    forward_all.Reset();
+    for (int i = 0; i < NUM_CONTROLLERS; i++) {
+        forward_all.Merge(forward_latency[i]);
     }
+    printf("TOPOLOGY,%u,%s,%lld,%lld,%lld,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", topology_sweep_index, layout.name,
+        ((long long)(read_msg_count - read_start) * 1000000) / elapsed,
+        ((long long)(wasm_msg_count - wasm_start) * 1000000) / elapsed,
+        ((long long)(send_msg_count - sent_start) * 1000000) / elapsed,
+        (uint32_t)(rx_drop_newest_count + rx_drop_oldest_count - dropped_start),
+        wasm_latency.Percentile(500), wasm_latency.Percentile(990),
+        forward_all.Percentile(500), forward_all.Percentile(990));
+
+    if (topology_sweep_set_index(topology_sweep_index + 1) != ESP_OK) {
+        ESP_LOGE(TAG_STATUS, "Unable to store the next layout, sweep stopped");
+        topology_sweep_task_handle = NULL;
+        vTaskDelete(NULL);
+    }
+    esp_restart();
+}
 #endif
-    /* T Connector Modes Task*/
-    printf( "create task");
-    xTaskCreatePinnedToCore(
-        &get_mode_task,            // Pointer to the task entry function.
-        "get_mode_task",           // A descriptive name for the task for debugging.
-        4096,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        STATS_TASK_PRIO, // priority at which the task should run
-        &modes_task_handle,      // Optional pass back task handle
-        1
-    );
-    if (modes_task_handle == NULL)
-    {
-        printf("Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Boot
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief Records that a boot stage has completed and releases the tasks waiting for it
+*/
+static void boot_mark(BOOT_STAGE stage)
+{
+    if (boot_stage_us[stage] == 0) {
+        boot_stage_us[stage] = esp_timer_get_time();
     }
-    /* Controller 0 Sending task */
-    ESP_LOGV(TAG_WASM, "create task");
-    xTaskCreatePinnedToCore(
-        &C0_send_task,            // Pointer to the task entry function.
-        "Send_task",           // A descriptive name for the task for debugging.
-        3072,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        tskIDLE_PRIORITY+1, // priority at which the task should run
-        &C0_send_task_handle,      // Optional pass back task handle
-        1
-    );
-    if (C0_send_task_handle == NULL)
-    {
-        ESP_LOGE(TAG_TWAI, "Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+    xEventGroupSetBits(boot_events, BOOT_BIT(stage));
+}
+
+/**
+ * @brief Blocks until all boot stages in bits have completed
+*/
+static void boot_wait(EventBits_t bits)
+{
+    xEventGroupWaitBits(boot_events, bits, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+/**
+ * @brief Prints the time since startup at which each boot stage completed
+ * 
+ * The time is counted from esp_timer start, the ROM and second stage bootloaders are not included.
+ * 
+ * @param[in] TAG
+*/
+static void print_boot_timeline(const char* TAG)
+{
+    char line[256];
+    char name[16];
+    int len = snprintf(line, sizeof(line), "Boot (ms):");
+    for (int i = 0; i < BOOT_STAGE_COUNT && len > 0 && len < (int)sizeof(line); i++) {
+        if (i >= BOOT_C0_READY && i < BOOT_WASM_READY) {
+            snprintf(name, sizeof(name), "c%d_ready", i - BOOT_C0_READY);
+        } else {
+            snprintf(name, sizeof(name), "%s", boot_stage_names[i < BOOT_C0_READY ? i : i - NUM_CONTROLLERS]);
+        }
+        if (boot_stage_us[i] != 0) {
+            len += snprintf(&line[len], sizeof(line) - len, " %s %lld.%lld", name, boot_stage_us[i] / 1000, (boot_stage_us[i] / 100) % 10);
+        } else {
+            len += snprintf(&line[len], sizeof(line) - len, " %s -", name);
+        }
     }
-    /* Controller 0 Receiving task */
-    ESP_LOGV(TAG_TWAI, "create task");
-    xTaskCreatePinnedToCore(
-        &C0_receive_task,            // Pointer to the task entry function.
-        "Receive_task",           // A descriptive name for the task for debugging.
-        3072,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        tskIDLE_PRIORITY+3, // priority at which the task should run
-        &C0_receive_task_handle,      // Optional pass back task handle
-        0
-    );
-    if (C0_receive_task_handle == NULL)
-    {
-        ESP_LOGE(TAG_TWAI, "Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+    ESP_LOGI(TAG, "%s", line);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Memory
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief Number of blocks currently allocated from the heap
+ * 
+ * Recorded by the WASM pthread once every boot stage is ready, GetStatus warns if it grows after that.
+*/
+static int heap_allocated_blocks()
+{
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+    return static_cast<int>(info.allocated_blocks);
+}
+
+/**
+ * @brief Prints where the queues, task stacks and WASM pool are and what is left of the heap
+*/
+static void print_memory_map()
+{
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_8BIT);
 
+    ESP_LOGI(TAG_STATUS, "Memory map:");
+    ESP_LOGI(TAG_STATUS, "  %-14s %p %6u bytes static", "rx_queue", rx_queue_storage, sizeof(rx_queue_storage));
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        char name[16];
+        snprintf(name, sizeof(name), "C%d_tx_queue", i);
+        ESP_LOGI(TAG_STATUS, "  %-14s %p %6u bytes static", name, tx_queue_storage[i], sizeof(tx_queue_storage[i]));
+    }
+    for (size_t i = 0; i < TOPOLOGY_COUNT; i++){
+        if (topology[i].stack_buffer != NULL){
+            ESP_LOGI(TAG_STATUS, "  %-14s %p %6" PRIu32 " bytes static", topology[i].name, topology[i].stack_buffer, topology[i].stack_buffer_size);
+        }
     }
+#ifdef WASM_HEAP_POOL
+    ESP_LOGI(TAG_STATUS, "  %-14s %p %6u bytes reserved at boot", "wasm_pool", wasm_heap_pool, WASM_HEAP_POOL_SIZE);
+#endif
+    ESP_LOGI(TAG_STATUS, "Heap free: %u bytes, largest free block: %u bytes, allocated: %u bytes in %u blocks",
+        info.total_free_bytes, info.largest_free_block, info.total_allocated_bytes, info.allocated_blocks);
+}
 
-    /* Controller 1 Sending task */
-    ESP_LOGV(TAG_MCP1, "create task");
-    xTaskCreatePinnedToCore(
-        &C1_send_task,            // Pointer to the task entry function.
-        "Send_task",           // A descriptive name for the task for debugging.
-        3072,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        tskIDLE_PRIORITY+1, // priority at which the task should run
-        &C1_send_task_handle,      // Optional pass back task handle
-        1
-    );
-    if (C1_send_task_handle == NULL)
-    {
-        ESP_LOGE(TAG_MCP1, "Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+/**
+ * @brief Records the fill level of a queue after a message was added, for the memory budget report
+*/
+static void queue_peak_update(QueueHandle_t queue)
+{
+#ifdef MEMORY_BUDGET
+    UBaseType_t waiting = uxQueueMessagesWaiting(queue);
+    volatile UBaseType_t *peak = NULL;
+    if (queue == rx_queue){
+        peak = &rx_queue_peak;
     }
-    ///* Controller 1 Receiving task */
-    ESP_LOGV(TAG_MCP1, "create task");
-    xTaskCreatePinnedToCore(
-        &C1_receive_task,            // Pointer to the task entry function.
-        "Receive_task",           // A descriptive name for the task for debugging.
-        3072,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        tskIDLE_PRIORITY+3, // priority at which the task should run
-        &C1_receive_task_handle,      // Optional pass back task handle
-        0
-    );
-    if (C1_receive_task_handle == NULL)
-    {
-        ESP_LOGE(TAG_MCP1, "Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+    for (int i = 0; i < NUM_CONTROLLERS && peak == NULL; i++){
+        if (queue == tx_queues[i]){
+            peak = &tx_queue_peak[i];
+        }
     }
-    /* Controller 2 Sending task */
-    ESP_LOGV(TAG_MCP2, "create task");
-    xTaskCreatePinnedToCore(
-        &C2_send_task,            // Pointer to the task entry function.
-        "Send_task",           // A descriptive name for the task for debugging.
-        3072,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        tskIDLE_PRIORITY+1, // priority at which the task should run
-        &C2_send_task_handle,      // Optional pass back task handle
-        1
-    );
-    if (C2_send_task_handle == NULL)
-    {
-        ESP_LOGE(TAG_MCP2, "Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+    if (peak != NULL && waiting > *peak){
+        *peak = waiting;
+    }
+#endif
+}
+
+#ifdef MEMORY_BUDGET
+/**
+ * @brief Prints the peak use and a recommended size of every task stack, queue, the WASM stack, app heap and pool
+ * 
+ * Lines are printed as MEMBUDGET CSV, see memory_budget.h. The last line is the RAM that the recommendations would 
+ * free and how many more messages rx_queue could hold with it.
+*/
+static void print_memory_budget()
+{
+    int32_t reclaimable = 0;
+    printf("MEMBUDGET,kind,name,configured,peak,recommended\n");
+
+    for (size_t i = 0; i < TOPOLOGY_COUNT; i++){
+        const task_topology &entry = topology[i];
+        if (entry.handle == NULL || *entry.handle == NULL){
+            continue;
+        }
+        uint32_t used = entry.stack_size - uxTaskGetStackHighWaterMark(*entry.handle);
+        uint32_t recommended = budget_recommend(entry.stack_size, used, MEMORY_BUDGET_HEADROOM_PERCENT, 256, MEMORY_BUDGET_STACK_MIN);
+        reclaimable += budget_report("stack", entry.name, entry.stack_size, used, recommended, 1);
+    }
+
+    uint32_t recommended = budget_recommend(RX_QUEUE_SIZE, rx_queue_peak, MEMORY_BUDGET_HEADROOM_PERCENT, 1, MEMORY_BUDGET_QUEUE_MIN);
+    reclaimable += budget_report("queue", "rx_queue", RX_QUEUE_SIZE, rx_queue_peak, recommended, sizeof(NMEA_msg));
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        recommended = budget_recommend(TX_QUEUE_SIZE, tx_queue_peak[i], MEMORY_BUDGET_HEADROOM_PERCENT, 1, MEMORY_BUDGET_QUEUE_MIN);
+        char queue_name[16];
+        snprintf(queue_name, sizeof(queue_name), "C%d_tx_queue", i);
+        reclaimable += budget_report("queue", queue_name, TX_QUEUE_SIZE, tx_queue_peak[i], recommended, sizeof(NMEA_msg));
+    }
+
+#ifdef WASM_HEAP_POOL
+    mem_alloc_info_t pool_info;
+    if (wasm_runtime_get_mem_alloc_info(&pool_info)){
+        recommended = budget_recommend(pool_info.total_size, pool_info.highmark_size, MEMORY_BUDGET_HEADROOM_PERCENT, 1024, 0);
+        reclaimable += budget_report("pool", "wasm_pool", pool_info.total_size, pool_info.highmark_size, recommended, 1);
     }
-    ///* Controller 2 Receiving task */
-    ESP_LOGV(TAG_MCP2, "create task");
-    xTaskCreatePinnedToCore(
-        &C2_receive_task,            // Pointer to the task entry function.
-        "Receive_task",           // A descriptive name for the task for debugging.
-        3072,                 // size of the task stack in bytes.
-        NULL,                 // Optional pointer to pvParameters
-        tskIDLE_PRIORITY+3, // priority at which the task should run
-        &C2_receive_task_handle,      // Optional pass back task handle
-        0
-    );
-    if (C2_receive_task_handle == NULL)
+#endif
+
+    // Every app gets the same WASM stack (NATIVE_STACK_SIZE) and app heap (NATIVE_HEAP_SIZE)
+    recommended = budget_recommend(NATIVE_STACK_SIZE, wasm_stack_peak, MEMORY_BUDGET_HEADROOM_PERCENT, 1024, MEMORY_BUDGET_STACK_MIN);
+    int32_t wasm_reclaimable = budget_report("stack", "wasm_stack", NATIVE_STACK_SIZE, wasm_stack_peak, recommended, 1);
+    recommended = budget_recommend(NATIVE_HEAP_SIZE, wasm_heap_peak, MEMORY_BUDGET_HEADROOM_PERCENT, 1024, 0);
+    wasm_reclaimable += budget_report("heap", "wasm_heap", NATIVE_HEAP_SIZE, wasm_heap_peak, recommended, 1);
+#ifndef WASM_HEAP_POOL
+    reclaimable += wasm_reclaimable; // with the pool both are part of wasm_pool, its line already counts them
+#else
+    (void)wasm_reclaimable;
+#endif
+
+    printf("MEMBUDGET,total,reclaimable,%" PRId32 ",%" PRId32 "\n", reclaimable, reclaimable / (int32_t)sizeof(NMEA_msg));
+}
+
+/**
+ * @brief FreeRTOS task that prints the memory budget every MEMORY_BUDGET_REPORT_MS
+ * 
+ * Run the gateway under the heaviest expected workload, e.g. a log replayed with ACTISENSE_REPLAY. Peaks are kept for 
+ * the whole run, so later reports cover more of the workload.
+ * 
+ * @param pvParameters
+*/
+void memory_budget_task(void *pvParameters)
+{
+    for (;;)
     {
-        ESP_LOGE(TAG_MCP2, "Unable to create task.");
-        result = ESP_ERR_NO_MEM;
-        goto err_out;
+        vTaskDelay(pdMS_TO_TICKS(MEMORY_BUDGET_REPORT_MS));
+        print_memory_budget();
+    }
+    vTaskDelete(NULL); // should never get here...
+}
+#endif
+
+extern "C" int app_main(void)
+{
+    boot_events = xEventGroupCreateStatic(&boot_events_buffer);
+    boot_mark(BOOT_APP_MAIN);
+    for (portMUX_TYPE &lock : bus_load_lock){
+        portMUX_INITIALIZE(&lock);
+    }
+
+#ifdef WASM_HEAP_POOL
+    // Reserved before anything else can fragment the heap
+    wasm_heap_pool = reinterpret_cast<uint8_t*>(heap_caps_malloc(WASM_HEAP_POOL_SIZE, MALLOC_CAP_8BIT));
+    if (wasm_heap_pool == NULL) {
+        ESP_LOGE(TAG_WASM, "Unable to reserve the WASM heap pool");
+        return 0;
+    }
+#endif
+
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        tx_queues[i] = xQueueCreateStatic(TX_QUEUE_SIZE, sizeof(NMEA_msg), tx_queue_storage[i], &tx_queue_buffers[i]);
+    }
+    rx_queue = xQueueCreateStatic(RX_QUEUE_SIZE, sizeof(NMEA_msg), rx_queue_storage, &rx_queue_buffer);
+#if defined(TELEMETRY) && TELEMETRY_SINK == TELEMETRY_SINK_RING
+    telemetry_ring = xRingbufferCreateStatic(sizeof(telemetry_ring_storage), RINGBUF_TYPE_NOSPLIT, telemetry_ring_storage,
+        &telemetry_ring_buffer);
+#elif defined(TELEMETRY) && defined(CONFIG_ESP_CONSOLE_UART)
+    // The console turns every 0x0a into CR LF by default, which would corrupt the frames
+    esp_vfs_dev_uart_port_set_tx_line_endings(CONFIG_ESP_CONSOLE_UART_NUM, ESP_LINE_ENDINGS_LF);
+#endif
+
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        if (controller_backends[i] == BACKEND_MCP){
+            controller_locks[i] = xSemaphoreCreateMutexStatic(&controller_lock_buffers[i]);
+        }
+    }
+#ifdef WASM_HOT_SWAP
+    wasm_swap_done = xSemaphoreCreateBinaryStatic(&wasm_swap_done_buffer);
+#endif
+
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        load_shedder[i].SetConfig(&shedder_config);
     }
+    // Keep the WASM app from filling a send queue, the app can add stricter per PGN rules with SetTxRate
+    for (int i = 0; i < NUM_CONTROLLERS; i++){
+        rate_limit_rule rule = {static_cast<int8_t>(i), RATE_LIMIT_ANY, RATE_LIMIT_ANY, TX_RATE_MSGS_PER_S, TX_RATE_BURST};
+        tx_rate_limiter.SetRule(rule, esp_timer_get_time());
+    }
+
+    esp_err_t result = nvs_flash_init();
+    if (result == ESP_ERR_NVS_NO_FREE_PAGES || result == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        result = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(result);
+
+    topology_load_nvs(topology.data(), TOPOLOGY_COUNT);
+#ifdef TOPOLOGY_SWEEP
+    topology_sweep_index = topology_sweep_get_index();
+    if (topology_sweep_index < TOPOLOGY_LAYOUT_COUNT) {
+        if (topology_sweep_index == 0) {
+            printf("TOPOLOGY,index,layout,rx_msgs_per_s,wasm_msgs_per_s,tx_msgs_per_s,rx_msgs_dropped,p50_us,p99_us,fwd_p50_us,fwd_p99_us\n");
+        }
+        ESP_LOGI(TAG_STATUS, "Topology sweep layout %u: %s", topology_sweep_index, topology_layouts[topology_sweep_index].name);
+        topology_apply_layout(topology.data(), TOPOLOGY_COUNT, topology_layouts[topology_sweep_index]);
+    } else {
+        printf("TOPOLOGY,done\n");
+        topology_find(topology.data(), TOPOLOGY_COUNT, "sweep_task")->function = NULL; // nothing left to measure
+    }
+#endif
+    topology_print(topology.data(), TOPOLOGY_COUNT);
+    const task_topology *wasm_topology = topology_find(topology.data(), TOPOLOGY_COUNT, "wasm_pthread");
 
-    /* Wasm pthread */
+#ifdef RUN_BENCHMARKS
+    /* Benchmark task - runs instead of the gateway tasks */
+    topology_create_tasks(topology_find(topology.data(), TOPOLOGY_COUNT, "bench_task"), 1);
+    return 0;
+#endif
+
+    /* Wasm pthread - started first, loading and instantiating the module takes longest */
     pthread_t t;
     int res;
     esp_pthread_cfg_t esp_pthread_cfg;
 
-
-
     pthread_attr_t tattr;
     pthread_attr_init(&tattr);
     pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE);
-    pthread_attr_setstacksize(&tattr, PTHREAD_STACK_SIZE);
+    pthread_attr_setstacksize(&tattr, wasm_topology->stack_size);
 
     // Use the ESP-IDF API to change the default thread attributes
     esp_pthread_cfg = esp_pthread_get_default_config();
     ESP_LOGI(TAG_WASM, "Pthread priority: %d", esp_pthread_cfg.prio);
     ESP_LOGI(TAG_WASM, "Pthread core: %d", esp_pthread_cfg.pin_to_core);
-    esp_pthread_cfg.prio = tskIDLE_PRIORITY+1; //change priority 
-    esp_pthread_cfg.pin_to_core = 1; // pin to core 1
+    esp_pthread_cfg.stack_size = wasm_topology->stack_size;
+    esp_pthread_cfg.prio = wasm_topology->priority; //change priority
+    esp_pthread_cfg.pin_to_core = wasm_topology->core;
+    esp_pthread_cfg.thread_name = wasm_topology->name;
     ESP_ERROR_CHECK( esp_pthread_set_cfg(&esp_pthread_cfg) );
 
     res = pthread_create(&t, &tattr, iwasm_main, (void *)NULL);
@@ -1282,28 +4267,43 @@ extern "C" int app_main(void)
 
     esp_pthread_get_cfg(&esp_pthread_cfg);
     ESP_LOGI(TAG_WASM, "Pthread priority: %d", esp_pthread_cfg.prio);
+#ifdef WASM_HOT_SWAP
+    /* Wasm loader pthread - waits for the runtime, then for new modules */
+    {
+        const task_topology *loader_topology = topology_find(topology.data(), TOPOLOGY_COUNT, "wasm_loader");
+        pthread_t loader_thread;
+        pthread_attr_setstacksize(&tattr, loader_topology->stack_size);
+        esp_pthread_cfg.stack_size = loader_topology->stack_size;
+        esp_pthread_cfg.prio = loader_topology->priority;
+        esp_pthread_cfg.pin_to_core = loader_topology->core;
+        esp_pthread_cfg.thread_name = loader_topology->name;
+        ESP_ERROR_CHECK( esp_pthread_set_cfg(&esp_pthread_cfg) );
+        res = pthread_create(&loader_thread, &tattr, wasm_loader_main, (void *)NULL);
+        assert(res == 0);
+    }
+#endif
+    /* Controller tasks - each opens its controller and marks it ready, send tasks wait for that */
+    result = topology_create_tasks(topology.data(), TOPOLOGY_COUNT);
+    if (result != ESP_OK)
+    {
+        goto err_out;
+    }
+
+    print_memory_map();
+
     res = pthread_join(t, NULL);
     assert(res == 0);
 
 err_out:
     if (result != ESP_OK)
     {
-        if (C0_send_task_handle != NULL || C0_receive_task_handle != NULL || C1_send_task_handle != NULL || C1_receive_task_handle != NULL || C2_send_task_handle != NULL || C2_receive_task_handle != NULL|| stats_task_handle != NULL)
+        for (size_t i = 0; i < TOPOLOGY_COUNT; i++)
         {
-            vTaskDelete(C0_send_task_handle);
-            vTaskDelete(C0_receive_task_handle);
-            vTaskDelete(C1_send_task_handle);
-            vTaskDelete(C1_receive_task_handle);
-            vTaskDelete(C2_send_task_handle);
-            vTaskDelete(C2_receive_task_handle);
-            vTaskDelete(stats_task_handle);
-            C0_send_task_handle = NULL;
-            C0_receive_task_handle = NULL;
-            C1_send_task_handle = NULL;
-            C1_receive_task_handle = NULL;
-            C2_send_task_handle = NULL;
-            C2_receive_task_handle = NULL;
-            stats_task_handle = NULL;
+            if (topology[i].handle != NULL && *topology[i].handle != NULL)
+            {
+                vTaskDelete(*topology[i].handle);
+                *topology[i].handle = NULL;
+            }
         }
     }
 
@@ -0,0 +1,258 @@
+/**
+ * @file mcp2515_batch.cpp
+ *
+ * @brief MCP2515 frame access with batched, queued SPI transactions
+*/
+#include "mcp2515_batch.h"
+#include "mcp2515_sim.h"
+#include <string.h>
+
+// MCP2515 SPI instructions
+#define MCP_READ_STATUS         0xA0
+#define MCP_READ_RX_BUFFER_0    0x90    // Starts at RXB0SIDH
+#define MCP_READ_RX_BUFFER_1    0x94    // Starts at RXB1SIDH
+#define MCP_LOAD_TX_BUFFER_0    0x40    // Starts at TXB0SIDH
+#define MCP_RTS_TX_BUFFER_0     0x81
+
+// READ STATUS bits
+#define MCP_STATUS_RX0IF        0x01
+#define MCP_STATUS_RX1IF        0x02
+#define MCP_STATUS_TX0REQ       0x04
+
+#define MCP_SIDL_EXIDE          0x08
+
+tNMEA2000_mcp_batched::tNMEA2000_mcp_batched(spi_device_handle_t *_spi, unsigned char _cs_pin, unsigned char _clockset, unsigned char _int_pin, uint16_t _rx_frame_buf_size)
+    : tNMEA2000_mcp(_spi, _cs_pin, _clockset, 0xff, _rx_frame_buf_size)
+{
+    SpiHandle = _spi;
+    IntPin = (_int_pin == 0xff) ? GPIO_NUM_NC : static_cast<gpio_num_t>(_int_pin);
+    RxFrameCount = 0;
+    RxFrameRead = 0;
+    Status = 0;
+    StatusValid = false;
+    Sim = NULL;
+    SpiTransactionCount = 0;
+    RxFrameCountTotal = 0;
+    TxFrameCountTotal = 0;
+}
+
+bool tNMEA2000_mcp_batched::CANOpen()
+{
+    if (!tNMEA2000_mcp::CANOpen()) {
+        return false;
+    }
+    if (IntPin != GPIO_NUM_NC) {
+        gpio_config_t io_conf = {};
+        io_conf.intr_type = GPIO_INTR_DISABLE;
+        io_conf.mode = GPIO_MODE_INPUT;
+        io_conf.pin_bit_mask = (1ULL << IntPin);
+        io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+        io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+        gpio_config(&io_conf);
+    }
+    return true;
+}
+
+void tNMEA2000_mcp_batched::EncodeId(unsigned long id, uint8_t *buf)
+{
+    buf[0] = (uint8_t)(id >> 21);
+    buf[1] = (uint8_t)((((id >> 18) & 0x07) << 5) | MCP_SIDL_EXIDE | ((id >> 16) & 0x03));
+    buf[2] = (uint8_t)(id >> 8);
+    buf[3] = (uint8_t)id;
+}
+
+unsigned long tNMEA2000_mcp_batched::DecodeId(const uint8_t *buf)
+{
+    unsigned long id = ((unsigned long)buf[0] << 3) | (buf[1] >> 5);
+    if (buf[1] & MCP_SIDL_EXIDE) {
+        id = (id << 2) | (buf[1] & 0x03);
+        id = (id << 8) | buf[2];
+        id = (id << 8) | buf[3];
+    }
+    return id;
+}
+
+void tNMEA2000_mcp_batched::AttachSim(tMcp2515Sim *sim)
+{
+    Sim = sim;
+}
+
+esp_err_t tNMEA2000_mcp_batched::SpiPoll(spi_transaction_t &t)
+{
+    if (Sim == NULL) {
+        return spi_device_polling_transmit(*SpiHandle, &t);
+    }
+    const uint8_t *tx = (t.flags & SPI_TRANS_USE_TXDATA) ? t.tx_data : static_cast<const uint8_t*>(t.tx_buffer);
+    uint8_t *rx = (t.flags & SPI_TRANS_USE_RXDATA) ? t.rx_data : static_cast<uint8_t*>(t.rx_buffer);
+    Sim->Transfer(tx, rx, t.length / 8);
+    return ESP_OK;
+}
+
+esp_err_t tNMEA2000_mcp_batched::SpiQueue(spi_transaction_t &t)
+{
+    if (Sim == NULL) {
+        return spi_device_queue_trans(*SpiHandle, &t, portMAX_DELAY);
+    }
+    return SpiPoll(t); // the model completes a transaction at once
+}
+
+esp_err_t tNMEA2000_mcp_batched::SpiResult()
+{
+    if (Sim == NULL) {
+        spi_transaction_t *done;
+        return spi_device_get_trans_result(*SpiHandle, &done, portMAX_DELAY);
+    }
+    return ESP_OK;
+}
+
+bool tNMEA2000_mcp_batched::IntActive()
+{
+    if (Sim != NULL) {
+        return Sim->IntAsserted();
+    }
+    return IntPin == GPIO_NUM_NC || gpio_get_level(IntPin) == 0;
+}
+
+uint8_t tNMEA2000_mcp_batched::ReadStatus()
+{
+    spi_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+    t.length = 16;
+    t.tx_data[0] = MCP_READ_STATUS;
+    SpiPoll(t);
+    SpiTransactionCount++;
+    return t.rx_data[1];
+}
+
+bool tNMEA2000_mcp_batched::RxPending()
+{
+    if (RxFrameRead < RxFrameCount) {
+        return true;
+    }
+    Status = ReadStatus();
+    StatusValid = true;
+    return (Status & (MCP_STATUS_RX0IF | MCP_STATUS_RX1IF)) != 0;
+}
+
+int tNMEA2000_mcp_batched::ReadRxBuffers(uint8_t status)
+{
+    static const uint8_t read_instruction[MCP_RX_BUFFERS] = {MCP_READ_RX_BUFFER_0, MCP_READ_RX_BUFFER_1};
+    static const uint8_t rx_flag[MCP_RX_BUFFERS] = {MCP_STATUS_RX0IF, MCP_STATUS_RX1IF};
+    spi_transaction_t t[MCP_RX_BUFFERS];
+    int queued = 0;
+
+    // Queue a read of every full buffer, oldest first
+    for (int i = 0; i < MCP_RX_BUFFERS; i++) {
+        if (!(status & rx_flag[i])) {
+            continue;
+        }
+        memset(&t[queued], 0, sizeof(spi_transaction_t));
+        memset(RxTxBuf[queued], 0, sizeof(RxTxBuf[queued]));
+        RxTxBuf[queued][0] = read_instruction[i];
+        t[queued].length = 8 * (MCP_FRAME_BYTES + 1);
+        t[queued].tx_buffer = RxTxBuf[queued];
+        t[queued].rx_buffer = RxRxBuf[queued];
+        if (SpiQueue(t[queued]) != ESP_OK) {
+            break;
+        }
+        queued++;
+    }
+
+    for (int i = 0; i < queued; i++) {
+        SpiResult();
+    }
+    SpiTransactionCount += queued;
+
+    for (int i = 0; i < queued; i++) {
+        const uint8_t *frame = &RxRxBuf[i][1];
+        tFrame &rx = RxFrames[i];
+        rx.id = DecodeId(frame);
+        rx.len = frame[4] & 0x0F;
+        if (rx.len > 8) {
+            rx.len = 8;
+        }
+        memcpy(rx.buf, &frame[5], rx.len);
+    }
+    return queued;
+}
+
+bool tNMEA2000_mcp_batched::CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf)
+{
+    if (RxFrameRead >= RxFrameCount) {
+        RxFrameRead = 0;
+        RxFrameCount = 0;
+        // INT is active low, skip the bus entirely when nothing is pending
+        uint8_t status;
+        if (StatusValid) {
+            status = Status;
+            StatusValid = false;
+        } else if (!IntActive()) {
+            return false;
+        } else {
+            status = ReadStatus();
+        }
+        if (!(status & (MCP_STATUS_RX0IF | MCP_STATUS_RX1IF))) {
+            return false;
+        }
+        RxFrameCount = ReadRxBuffers(status);
+        RxFrameCountTotal += RxFrameCount;
+        if (RxFrameCount == 0) {
+            return false;
+        }
+    }
+
+    const tFrame &rx = RxFrames[RxFrameRead++];
+    id = rx.id;
+    len = rx.len;
+    memcpy(buf, rx.buf, rx.len);
+    return true;
+}
+
+bool tNMEA2000_mcp_batched::CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent)
+{
+    (void)wait_sent;
+    if (len > 8) {
+        return false;
+    }
+    if (ReadStatus() & MCP_STATUS_TX0REQ) {
+        return false; // previous frame still pending, the library keeps this one in its send buffer
+    }
+
+    memset(TxLoadBuf, 0, sizeof(TxLoadBuf));
+    TxLoadBuf[0] = MCP_LOAD_TX_BUFFER_0;
+    EncodeId(id, &TxLoadBuf[1]);
+    TxLoadBuf[5] = len & 0x0F;
+    memcpy(&TxLoadBuf[6], buf, len);
+
+    spi_transaction_t t[2];
+    memset(t, 0, sizeof(t));
+    t[0].length = 8 * (MCP_FRAME_BYTES + 1);
+    t[0].tx_buffer = TxLoadBuf;
+    t[1].flags = SPI_TRANS_USE_TXDATA;
+    t[1].length = 8;
+    t[1].tx_data[0] = MCP_RTS_TX_BUFFER_0;
+
+    if (SpiQueue(t[0]) != ESP_OK) {
+        return false;
+    }
+    if (SpiQueue(t[1]) != ESP_OK) {
+        SpiResult();
+        SpiTransactionCount++;
+        return false;
+    }
+    SpiResult();
+    SpiResult();
+    SpiTransactionCount += 2;
+    TxFrameCountTotal++;
+    return true;
+}
+
+unsigned long tNMEA2000_mcp_batched::TransactionsPerFrameX100() const
+{
+    unsigned long frames = RxFrameCountTotal + TxFrameCountTotal;
+    if (frames == 0) {
+        return 0;
+    }
+    return (SpiTransactionCount * 100) / frames;
+}
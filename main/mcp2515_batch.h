@@ -0,0 +1,134 @@
+/**
+ * @file mcp2515_batch.h
+ *
+ * @brief MCP2515 frame access with batched, queued SPI transactions
+ *
+ * tNMEA2000_mcp_batched replaces the frame level functions of tNMEA2000_mcp. The SPI bus setup, controller
+ * configuration and Open() are still done by the NMEA2000_esp32-c6_MCP library.
+ *
+ * Receiving a frame:
+ *
+ * * If the INT pin is high nothing is pending, no SPI transaction is done
+ * * READ STATUS (polled, 2 bytes) tells which RX buffers are full
+ * * READ RX BUFFER for every full buffer is queued back to back with spi_device_queue_trans. The instruction clears
+ *   the RX flag when CS goes high, so no separate BIT MODIFY is needed
+ *
+ * Sending a frame:
+ *
+ * * READ STATUS checks that TX buffer 0 is free
+ * * LOAD TX BUFFER and RTS are queued back to back
+ *
+ * Only TX buffer 0 is used. The MCP2515 sends pending buffers by priority and buffer number, not in the order they
+ * were loaded, which would reorder the frames of a fast packet message.
+ *
+ * The SPI device added by CANinit() must have a queue_size of at least 2.
+ *
+ * The INT pin is handled here, so the base class is constructed without one. Several controllers can share one INT
+ * pin (open drain, wire-ORed). A low pin then only says that some controller on it has a frame, RxPending() reads
+ * the status of one controller and keeps it for the next CANGetFrame, so finding the pending controllers costs one
+ * READ STATUS per controller on the line and no more.
+ *
+ * After AttachSim() the transactions go to a tMcp2515Sim instead of the bus, see mcp2515_sim.h.
+*/
+#ifndef MCP2515_BATCH_H
+#define MCP2515_BATCH_H
+
+#include <stdint.h>
+#include "driver/spi_master.h"
+#include "driver/gpio.h"
+#include <NMEA2000_mcp.h>
+
+class tMcp2515Sim;
+
+#define MCP_RX_BUFFERS          2
+#define MCP_FRAME_BYTES         13  //!< SIDH, SIDL, EID8, EID0, DLC, 8 data bytes
+#define MCP_TRANS_BUF_BYTES     16  //!< Instruction + frame, rounded up to a multiple of 4 for DMA
+
+class tNMEA2000_mcp_batched : public tNMEA2000_mcp
+{
+protected:
+    /// @brief A received frame waiting to be returned by CANGetFrame
+    struct tFrame {
+        unsigned long id;
+        unsigned char len;
+        unsigned char buf[8];
+    };
+
+    spi_device_handle_t *SpiHandle;
+    gpio_num_t IntPin;
+    tFrame RxFrames[MCP_RX_BUFFERS];
+    int RxFrameCount;
+    int RxFrameRead;
+    uint8_t Status;         //!< READ STATUS result kept by RxPending for the next CANGetFrame
+    bool StatusValid;       //!< Status is unused, CANGetFrame takes it instead of reading the status again
+    tMcp2515Sim *Sim;       //!< Model that takes the transactions, NULL for the bus
+
+    // Transaction buffers, DMA capable and word aligned
+    alignas(4) uint8_t RxTxBuf[MCP_RX_BUFFERS][MCP_TRANS_BUF_BYTES];
+    alignas(4) uint8_t RxRxBuf[MCP_RX_BUFFERS][MCP_TRANS_BUF_BYTES];
+    alignas(4) uint8_t TxLoadBuf[MCP_TRANS_BUF_BYTES];
+
+    /**
+     * @brief Reads the MCP2515 status byte with a polled transaction
+    */
+    uint8_t ReadStatus();
+
+    /// @brief true if the INT pin is low or there is none
+    bool IntActive();
+
+    // spi_device_polling_transmit, spi_device_queue_trans and spi_device_get_trans_result, or the model
+    esp_err_t SpiPoll(spi_transaction_t &t);
+    esp_err_t SpiQueue(spi_transaction_t &t);
+    esp_err_t SpiResult();
+
+    /**
+     * @brief Reads all full RX buffers in one batch of queued transactions
+     * @return number of frames read
+    */
+    int ReadRxBuffers(uint8_t status);
+
+    static void EncodeId(unsigned long id, uint8_t *buf);
+    static unsigned long DecodeId(const uint8_t *buf);
+
+    bool CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent=true) override;
+    bool CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf) override;
+    bool CANOpen() override;
+
+public:
+    // Statistics
+    unsigned long SpiTransactionCount;  //!< SPI transactions done by this class
+    unsigned long RxFrameCountTotal;    //!< Frames received
+    unsigned long TxFrameCountTotal;    //!< Frames sent
+
+    /**
+     * @param[in] _spi pointer to the spi handle filled in by CANinit()
+     * @param[in] _cs_pin chip select pin
+     * @param[in] _clockset MCP crystal frequency
+     * @param[in] _int_pin interrupt pin, active low
+     * @param[in] _rx_frame_buf_size
+    */
+    tNMEA2000_mcp_batched(spi_device_handle_t *_spi, unsigned char _cs_pin, unsigned char _clockset, unsigned char _int_pin, uint16_t _rx_frame_buf_size);
+
+    /// @brief SPI transactions per frame times 100
+    unsigned long TransactionsPerFrameX100() const;
+
+    /**
+     * @brief Reads the status to find out if this controller has a frame, for INT pins shared by several controllers
+     * 
+     * The status is used by the next CANGetFrame instead of reading it again.
+     * 
+     * @return true if a RX buffer is full
+    */
+    bool RxPending();
+
+    /**
+     * @brief Sends every following SPI transaction to a model instead of the bus, for benchmarks
+     * 
+     * The INT pin is read from the model too. Call before the first frame, do not call Open() afterwards.
+     * 
+     * @param[in] sim
+    */
+    void AttachSim(tMcp2515Sim *sim);
+};
+
+#endif //MCP2515_BATCH_H
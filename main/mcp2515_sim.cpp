@@ -0,0 +1,129 @@
+/**
+ * @file mcp2515_sim.cpp
+ *
+ * @brief Model of a MCP2515 on the SPI bus, to benchmark the MCP frame path without hardware
+*/
+#include "mcp2515_sim.h"
+#include <string.h>
+
+// MCP2515 SPI instructions, see mcp2515_batch.cpp
+#define MCP_READ_STATUS         0xA0
+#define MCP_READ_RX_BUFFER_0    0x90
+#define MCP_READ_RX_BUFFER_1    0x94
+#define MCP_LOAD_TX_BUFFER_0    0x40
+#define MCP_RTS_TX_BUFFER_0     0x81
+
+#define MCP_SIDL_EXIDE          0x08
+
+tMcp2515Sim::tMcp2515Sim()
+{
+    memset(RxBuf, 0, sizeof(RxBuf));
+    RxFull[0] = false;
+    RxFull[1] = false;
+    memset(TxBuf, 0, sizeof(TxBuf));
+    FifoHead = 0;
+    FifoCount = 0;
+    ResetCounters();
+}
+
+bool tMcp2515Sim::Receive(unsigned long id, uint8_t len, const uint8_t *buf)
+{
+    if (FifoCount == MCP_SIM_RX_FIFO) {
+        FramesLost++;
+        return false;
+    }
+    tFrame &frame = Fifo[(FifoHead + FifoCount) % MCP_SIM_RX_FIFO];
+    frame.id = id;
+    frame.len = (len > 8) ? 8 : len;
+    memcpy(frame.buf, buf, frame.len);
+    FifoCount++;
+    Refill();
+    return true;
+}
+
+void tMcp2515Sim::Refill()
+{
+    for (int i = 0; i < 2 && FifoCount > 0; i++) {
+        if (RxFull[i]) {
+            continue;
+        }
+        const tFrame &frame = Fifo[FifoHead];
+        uint8_t *reg = RxBuf[i];
+        memset(reg, 0, sizeof(RxBuf[i]));
+        reg[0] = (uint8_t)(frame.id >> 21);
+        reg[1] = (uint8_t)((((frame.id >> 18) & 0x07) << 5) | MCP_SIDL_EXIDE | ((frame.id >> 16) & 0x03));
+        reg[2] = (uint8_t)(frame.id >> 8);
+        reg[3] = (uint8_t)frame.id;
+        reg[4] = frame.len;
+        memcpy(&reg[5], frame.buf, frame.len);
+        RxFull[i] = true;
+        FifoHead = (FifoHead + 1) % MCP_SIM_RX_FIFO;
+        FifoCount--;
+    }
+}
+
+void tMcp2515Sim::Transfer(const uint8_t *tx, uint8_t *rx, size_t bytes)
+{
+    Transactions++;
+    BytesClocked += bytes;
+    if (bytes == 0) {
+        return;
+    }
+    if (rx != NULL) {
+        memset(rx, 0, bytes);
+    }
+
+    switch (tx[0]) {
+    case MCP_READ_STATUS:
+        if (rx != NULL && bytes > 1) {
+            rx[1] = (RxFull[0] ? 0x01 : 0) | (RxFull[1] ? 0x02 : 0);
+        }
+        break;
+    case MCP_READ_RX_BUFFER_0:
+    case MCP_READ_RX_BUFFER_1: {
+        int i = (tx[0] == MCP_READ_RX_BUFFER_0) ? 0 : 1;
+        if (rx != NULL && bytes > 1) {
+            memcpy(&rx[1], RxBuf[i], (bytes - 1 < sizeof(RxBuf[i])) ? bytes - 1 : sizeof(RxBuf[i]));
+        }
+        // The flag is cleared when CS goes high
+        if (RxFull[i]) {
+            RxFull[i] = false;
+            FramesRead++;
+            Refill();
+        }
+        break;
+    }
+    case MCP_LOAD_TX_BUFFER_0:
+        memcpy(TxBuf, &tx[1], (bytes - 1 < sizeof(TxBuf)) ? bytes - 1 : sizeof(TxBuf));
+        break;
+    case MCP_RTS_TX_BUFFER_0:
+        FramesSent++;
+        break;
+    default:
+        break;
+    }
+}
+
+bool tMcp2515Sim::IntAsserted() const
+{
+    return RxFull[0] || RxFull[1];
+}
+
+int tMcp2515Sim::Pending() const
+{
+    return (RxFull[0] ? 1 : 0) + (RxFull[1] ? 1 : 0) + FifoCount;
+}
+
+uint64_t tMcp2515Sim::BusTimeNs(uint32_t spi_hz) const
+{
+    return ((uint64_t)BytesClocked * 8 * 1000000000ULL) / spi_hz + (uint64_t)Transactions * MCP_SIM_TRANS_OVERHEAD_NS;
+}
+
+void tMcp2515Sim::ResetCounters()
+{
+    Transactions = 0;
+    BytesClocked = 0;
+    FramesRead = 0;
+    FramesSent = 0;
+    FramesLost = 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file mcp2515_sim.h
+ *
+ * @brief Model of a MCP2515 on the SPI bus, to benchmark the MCP frame path without hardware
+ *
+ * tNMEA2000_mcp_batched sends its SPI transactions here instead of to the bus after AttachSim(). The model implements
+ * the instructions the batched driver uses:
+ *
+ * * READ STATUS returns the RX buffer flags, TX buffer 0 is always free
+ * * READ RX BUFFER returns a buffer and frees it when the transaction ends, the next frame waiting on the CAN side
+ *   moves in
+ * * LOAD TX BUFFER and RTS count a sent frame, sending completes at once
+ *
+ * Frames given to Receive() wait in a FIFO like frames on the CAN side, the model itself takes no time. Transactions
+ * and clocked bytes are counted so BusTimeNs() can tell how long a workload would hold a real SPI bus.
+ *
+ * The header has no ESP-IDF dependencies.
+*/
+#ifndef MCP2515_SIM_H
+#define MCP2515_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MCP_SIM_RX_FIFO             32          //!< Frames waiting on the CAN side
+#define MCP_SIM_SPI_HZ              10000000    //!< SPI clock of the MCP controllers
+#define MCP_SIM_TRANS_OVERHEAD_NS   2000        //!< CS setup and hold plus driver time per transaction
+
+class tMcp2515Sim
+{
+public:
+    tMcp2515Sim();
+
+    /**
+     * @brief A frame arrives on the CAN side
+     * @return false if the FIFO is full, the frame is lost like in a MCP2515 RX overflow
+    */
+    bool Receive(unsigned long id, uint8_t len, const uint8_t *buf);
+
+    /**
+     * @brief One SPI transaction, CS low for all bytes
+     * @param[in] tx bytes clocked out, the instruction first
+     * @param[out] rx bytes clocked in, may be NULL
+     * @param[in] bytes
+    */
+    void Transfer(const uint8_t *tx, uint8_t *rx, size_t bytes);
+
+    /// @brief true while a RX buffer is full, the INT pin would be low
+    bool IntAsserted() const;
+
+    /// @brief Frames received but not read yet, in the RX buffers and the FIFO
+    int Pending() const;
+
+    /// @brief Time the counted transactions hold the bus at a SPI clock
+    uint64_t BusTimeNs(uint32_t spi_hz = MCP_SIM_SPI_HZ) const;
+
+    /// @brief Clears the statistics, frames stay where they are
+    void ResetCounters();
+
+    // Statistics
+    unsigned long Transactions;     //!< SPI transactions
+    unsigned long BytesClocked;     //!< Bytes in all transactions, the instruction included
+    unsigned long FramesRead;       //!< Frames read out of a RX buffer
+    unsigned long FramesSent;       //!< Frames sent by RTS
+    unsigned long FramesLost;       //!< Frames refused by Receive
+
+private:
+    struct tFrame {
+        unsigned long id;
+        uint8_t len;
+        uint8_t buf[8];
+    };
+
+    uint8_t RxBuf[2][13];           //!< SIDH, SIDL, EID8, EID0, DLC, data
+    bool RxFull[2];
+    uint8_t TxBuf[13];
+    tFrame Fifo[MCP_SIM_RX_FIFO];
+    int FifoHead;
+    int FifoCount;
+
+    /// @brief Moves waiting frames into free RX buffers, buffer 0 first
+    void Refill();
+};
+
+#endif //MCP2515_SIM_H
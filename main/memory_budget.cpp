@@ -0,0 +1,33 @@
+/**
+ * @file memory_budget.cpp
+ *
+ * @brief Helpers for the memory budget report
+*/
+#include "memory_budget.h"
+#include <stdio.h>
+#include <inttypes.h>
+
+uint32_t budget_recommend(uint32_t configured, uint32_t peak, uint32_t headroom_percent, uint32_t granularity, uint32_t minimum)
+{
+    uint64_t size = (static_cast<uint64_t>(peak) * (100 + headroom_percent) + 99) / 100;
+    if (granularity > 1) {
+        size = ((size + granularity - 1) / granularity) * granularity;
+    }
+    if (size < minimum) {
+        size = minimum;
+    }
+    if (peak >= configured && size < configured) {
+        size = configured; // saturated, the real peak is unknown
+    }
+    return size > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(size);
+}
+
+int32_t budget_report(const char *kind, const char *name, uint32_t configured, uint32_t peak, uint32_t recommended, uint32_t unit_bytes)
+{
+    printf("MEMBUDGET,%s,%s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 "%s\n", kind, name, configured, peak, recommended,
+        peak >= configured ? ",saturated" : "");
+    if (recommended >= configured) {
+        return 0;
+    }
+    return static_cast<int32_t>((configured - recommended) * unit_bytes);
+}
@@ -0,0 +1,37 @@
+/**
+ * @file memory_budget.h
+ *
+ * @brief Helpers for the memory budget report
+ *
+ * Turns measured peaks into recommended sizes and prints them in a machine readable format:
+ *
+ * `MEMBUDGET,<kind>,<name>,<configured>,<peak>,<recommended>`
+ *
+ * Stacks, heaps and pools are in bytes, queues in messages. A peak equal to the configured size means the object was full
+ * at some point, so the real need is unknown: `,saturated` is appended and the recommendation is not smaller than the
+ * configured size.
+*/
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <stdint.h>
+
+/**
+ * @brief Recommended size for a measured peak
+ *
+ * @param[in] configured current size
+ * @param[in] peak highest use seen
+ * @param[in] headroom_percent margin added to the peak
+ * @param[in] granularity the result is rounded up to a multiple of this
+ * @param[in] minimum lower limit of the result
+*/
+uint32_t budget_recommend(uint32_t configured, uint32_t peak, uint32_t headroom_percent, uint32_t granularity, uint32_t minimum);
+
+/**
+ * @brief Prints one report line
+ *
+ * @return bytes that could be reclaimed, configured - recommended times unit_bytes, or 0
+*/
+int32_t budget_report(const char *kind, const char *name, uint32_t configured, uint32_t peak, uint32_t recommended, uint32_t unit_bytes);
+
+#endif //MEMORY_BUDGET_H
@@ -0,0 +1,117 @@
+/**
+ * @file rate_limit.cpp
+ *
+ * @brief Token bucket rate limits for messages sent by the WASM app
+*/
+#include "rate_limit.h"
+
+#define RATE_LIMIT_TOKEN    1000    // one message in tokens_milli
+
+tRateLimiter::tRateLimiter()
+{
+    for (int i = 0; i < RATE_LIMIT_RULES; i++) {
+        Buckets[i].used = false;
+    }
+    LimitedCount = 0;
+}
+
+bool tRateLimiter::SameKey(const rate_limit_rule &a, const rate_limit_rule &b)
+{
+    return a.controller_number == b.controller_number && a.PGN == b.PGN && a.source == b.source;
+}
+
+int tRateLimiter::Specificity(const rate_limit_rule &rule)
+{
+    return (rule.controller_number != RATE_LIMIT_ANY) + (rule.PGN != RATE_LIMIT_ANY) + (rule.source != RATE_LIMIT_ANY);
+}
+
+void tRateLimiter::Refill(rate_limit_bucket &bucket, int64_t now_us)
+{
+    int64_t elapsed_us = now_us - bucket.refilled_us;
+    if (elapsed_us <= 0) {
+        return;
+    }
+    uint64_t capacity = static_cast<uint64_t>(bucket.rule.burst) * RATE_LIMIT_TOKEN;
+    uint64_t added = (static_cast<uint64_t>(elapsed_us) * bucket.rule.rate_per_s) / 1000;
+    if (added == 0) {
+        return; // keep refilled_us so short intervals add up
+    }
+    uint64_t tokens = bucket.tokens_milli + added;
+    bucket.tokens_milli = static_cast<uint32_t>(tokens < capacity ? tokens : capacity);
+    bucket.refilled_us = now_us;
+}
+
+bool tRateLimiter::SetRule(const rate_limit_rule &rule, int64_t now_us)
+{
+    int free_slot = -1;
+    for (int i = 0; i < RATE_LIMIT_RULES; i++) {
+        rate_limit_bucket &bucket = Buckets[i];
+        if (!bucket.used) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+            continue;
+        }
+        if (SameKey(bucket.rule, rule)) {
+            if (rule.burst == 0) {
+                bucket.used = false;
+                return true;
+            }
+            free_slot = i;
+            break;
+        }
+    }
+    if (rule.burst == 0) {
+        return true; // nothing to remove
+    }
+    if (free_slot < 0) {
+        return false;
+    }
+    rate_limit_bucket &bucket = Buckets[free_slot];
+    bucket.used = true;
+    bucket.rule = rule;
+    if (bucket.rule.burst > UINT32_MAX / RATE_LIMIT_TOKEN) {
+        bucket.rule.burst = UINT32_MAX / RATE_LIMIT_TOKEN; // tokens_milli must not overflow
+    }
+    bucket.tokens_milli = bucket.rule.burst * RATE_LIMIT_TOKEN;
+    bucket.refilled_us = now_us;
+    bucket.passed = 0;
+    bucket.limited = 0;
+    return true;
+}
+
+bool tRateLimiter::Admit(int controller_number, uint32_t PGN, int source, int64_t now_us)
+{
+    int match = -1;
+    int match_specificity = -1;
+    for (int i = 0; i < RATE_LIMIT_RULES; i++) {
+        const rate_limit_bucket &bucket = Buckets[i];
+        if (!bucket.used) {
+            continue;
+        }
+        const rate_limit_rule &rule = bucket.rule;
+        if ((rule.controller_number != RATE_LIMIT_ANY && rule.controller_number != controller_number) ||
+            (rule.PGN != RATE_LIMIT_ANY && static_cast<uint32_t>(rule.PGN) != PGN) ||
+            (rule.source != RATE_LIMIT_ANY && rule.source != source)) {
+            continue;
+        }
+        int specificity = Specificity(rule);
+        if (specificity > match_specificity) {
+            match = i;
+            match_specificity = specificity;
+        }
+    }
+    if (match < 0) {
+        return true;
+    }
+    rate_limit_bucket &bucket = Buckets[match];
+    Refill(bucket, now_us);
+    if (bucket.tokens_milli < RATE_LIMIT_TOKEN) {
+        bucket.limited++;
+        LimitedCount++;
+        return false;
+    }
+    bucket.tokens_milli -= RATE_LIMIT_TOKEN;
+    bucket.passed++;
+    return true;
+}
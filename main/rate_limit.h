@@ -0,0 +1,85 @@
+/**
+ * @file rate_limit.h
+ *
+ * @brief Token bucket rate limits for messages sent by the WASM app
+ *
+ * A rule limits the messages of a controller, a PGN and optionally a source to rate_per_s messages per second, with
+ * bursts of up to burst messages. Each field of a rule can be RATE_LIMIT_ANY. A message is checked against the most
+ * specific matching rule only (the one with the fewest RATE_LIMIT_ANY fields, the first added on a tie), so a per PGN
+ * rule can be stricter or more generous than a catch-all rule for its controller. Messages matching no rule pass.
+ *
+ * Tokens are kept in thousandths of a message so low rates refill smoothly.
+ *
+ * The time is passed in by the caller and no locking is done, the class has no ESP-IDF dependencies.
+*/
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RATE_LIMIT_RULES    16  //!< Rules that can be set
+#define RATE_LIMIT_ANY      -1  //!< Rule field that matches every controller, PGN or source
+
+/// @brief Which messages a rule applies to and how fast they may be sent
+struct rate_limit_rule {
+    int controller_number;  //!< Controller or RATE_LIMIT_ANY
+    int32_t PGN;            //!< PGN or RATE_LIMIT_ANY
+    int source;             //!< Source address or RATE_LIMIT_ANY
+    uint32_t rate_per_s;    //!< Sustained messages per second
+    uint32_t burst;         //!< Messages that can be sent back to back, 0 removes the rule
+};
+
+/// @brief A rule and its bucket
+struct rate_limit_bucket {
+    bool used;
+    rate_limit_rule rule;
+    uint32_t tokens_milli;  //!< Available messages times 1000
+    int64_t refilled_us;    //!< Time of the last refill
+    unsigned long passed;   //!< Messages admitted by this rule
+    unsigned long limited;  //!< Messages rejected by this rule
+};
+
+class tRateLimiter
+{
+protected:
+    rate_limit_bucket Buckets[RATE_LIMIT_RULES];
+
+    static bool SameKey(const rate_limit_rule &a, const rate_limit_rule &b);
+    static int Specificity(const rate_limit_rule &rule);
+    void Refill(rate_limit_bucket &bucket, int64_t now_us);
+
+public:
+    unsigned long LimitedCount;     //!< Messages rejected by any rule
+
+    tRateLimiter();
+
+    /**
+     * @brief Adds a rule, or replaces the rule with the same controller, PGN and source
+     *
+     * A new or replaced rule starts with a full bucket. A burst of 0 removes the rule.
+     *
+     * @param[in] rule
+     * @param[in] now_us current time
+     * @return false if the rule table is full
+    */
+    bool SetRule(const rate_limit_rule &rule, int64_t now_us);
+
+    /**
+     * @brief Takes a token for a message from the bucket of its most specific rule
+     * @param[in] controller_number
+     * @param[in] PGN
+     * @param[in] source
+     * @param[in] now_us current time
+     * @return false if the message is over its rate limit and must not be sent
+    */
+    bool Admit(int controller_number, uint32_t PGN, int source, int64_t now_us);
+
+    /// @brief Number of rule slots, for iterating with Bucket()
+    static size_t Slots() { return RATE_LIMIT_RULES; }
+
+    /// @brief Rule slot i, check used before reading the rule
+    const rate_limit_bucket& Bucket(size_t i) const { return Buckets[i]; }
+};
+
+#endif //RATE_LIMIT_H
@@ -0,0 +1,58 @@
+/**
+ * @file state_table.cpp
+ *
+ * @brief Latest payload per PGN and source, shared with the WASM app
+*/
+#include "state_table.h"
+#include <string.h>
+#include <atomic>
+
+// The app sees the same layout, wasm32 aligns int64_t to 8 bytes like the ESP32
+static_assert(sizeof(state_entry) == 72, "state_entry layout changed, update STATE_TABLE_VERSION");
+static_assert(sizeof(state_table) == 16 + 72 * STATE_TABLE_SLOTS, "state_table layout changed, update STATE_TABLE_VERSION");
+
+void state_table_init(state_table *table)
+{
+    memset(table, 0, sizeof(state_table));
+    table->version = STATE_TABLE_VERSION;
+    table->slots = STATE_TABLE_SLOTS;
+    table->entry_size = sizeof(state_entry);
+}
+
+bool state_table_update(state_table *table, uint32_t PGN, uint8_t source, uint8_t controller_number, int64_t timestamp_us,
+    const uint8_t *data, int data_length_bytes)
+{
+    uint32_t key = STATE_TABLE_KEY(PGN, source);
+    uint32_t index = state_table_index(key);
+    state_entry *entry = NULL;
+    for (uint32_t i = 0; i < STATE_TABLE_SLOTS; i++) {
+        state_entry &candidate = table->entries[index];
+        if (candidate.key == key || candidate.key == 0) {
+            entry = &candidate;
+            break;
+        }
+        index = (index + 1) & (STATE_TABLE_SLOTS - 1);
+    }
+    if (entry == NULL) {
+        table->full_count++;
+        return false;
+    }
+
+    uint32_t length = data_length_bytes < 0 ? 0 : data_length_bytes;
+    if (length > STATE_TABLE_DATA_BYTES) {
+        length = STATE_TABLE_DATA_BYTES;
+    }
+    volatile state_entry *shared = entry;
+    shared->seq = shared->seq + 1; // odd, readers retry
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    shared->timestamp_us = timestamp_us;
+    shared->controller_number = controller_number;
+    shared->data_length = static_cast<uint8_t>(length);
+    for (uint32_t i = 0; i < length; i++) {
+        shared->data[i] = data[i];
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    shared->key = key; // a new entry becomes visible to state_table_find only once it is complete
+    shared->seq = shared->seq + 1; // even again
+    return true;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file state_table.h
+ *
+ * @brief Latest payload per PGN and source, shared with the WASM app
+ *
+ * The gateway keeps a state_table in the linear memory of the WASM app and hands its address to the app through the
+ * optional app function `link_state_table(offset, size)`. Every received message of a PGN in the gateway's state list
+ * updates the entry of its PGN and source, so the app can read the current heading, COG/SOG etc. at any time without
+ * caching them itself.
+ *
+ * The layout uses fixed size types only and this header can be included by the app (C or C++, wasm32). Entries are
+ * found by open addressing on STATE_TABLE_KEY with linear probing, starting at state_table_index(). Entries are never
+ * removed, check timestamp_us for stale values.
+ *
+ * Each entry is protected by a sequence lock: the gateway makes seq odd while it writes the entry. Readers copy the
+ * entry with state_table_read(), which retries until it saw the same even seq before and after the copy.
+*/
+#ifndef STATE_TABLE_H
+#define STATE_TABLE_H
+
+#include <stdint.h>
+
+#define STATE_TABLE_VERSION     1
+#define STATE_TABLE_SLOTS       64  //!< Must be a power of two
+#define STATE_TABLE_DATA_BYTES  48  //!< Payload bytes kept per entry, longer messages are truncated
+#define STATE_TABLE_KEY(PGN, source) (0x80000000u | ((uint32_t)(PGN) << 8) | (uint8_t)(source)) //!< 0 marks a free entry
+
+/// @brief Latest message of one PGN and source, 72 bytes
+typedef struct {
+    uint32_t seq;                           //!< Odd while the entry is being written
+    uint32_t key;                           //!< STATE_TABLE_KEY of the entry, 0 if free
+    int64_t timestamp_us;                   //!< Receive time of the message, gateway esp_timer time
+    uint8_t controller_number;              //!< Controller the message was received on
+    uint8_t data_length;                    //!< Valid bytes in data
+    uint8_t reserved[6];
+    uint8_t data[STATE_TABLE_DATA_BYTES];
+} state_entry;
+
+/// @brief The table as laid out in the app's linear memory
+typedef struct {
+    uint32_t version;                       //!< STATE_TABLE_VERSION
+    uint32_t slots;                         //!< STATE_TABLE_SLOTS
+    uint32_t entry_size;                    //!< sizeof(state_entry)
+    uint32_t full_count;                    //!< Updates lost because every entry was taken
+    state_entry entries[STATE_TABLE_SLOTS];
+} state_table;
+
+/// @brief First entry to probe for a key
+static inline uint32_t state_table_index(uint32_t key)
+{
+    return ((key * 0x9e3779b1u) >> 16) & (STATE_TABLE_SLOTS - 1);
+}
+
+/**
+ * @brief Finds the entry of a PGN and source
+ * @return the entry, or NULL if nothing has been received for it
+*/
+static inline const state_entry* state_table_find(const state_table *table, uint32_t PGN, uint8_t source)
+{
+    uint32_t key = STATE_TABLE_KEY(PGN, source);
+    uint32_t index = state_table_index(key);
+    for (uint32_t i = 0; i < STATE_TABLE_SLOTS; i++) {
+        uint32_t entry_key = *(const volatile uint32_t*)&table->entries[index].key;
+        if (entry_key == key) {
+            return &table->entries[index];
+        }
+        if (entry_key == 0) {
+            return 0;
+        }
+        index = (index + 1) & (STATE_TABLE_SLOTS - 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies an entry consistently
+ * @param[in] entry from state_table_find()
+ * @param[out] out copy of the entry
+*/
+static inline void state_table_read(const state_entry *entry, state_entry *out)
+{
+    const volatile state_entry *shared = (const volatile state_entry*)entry;
+    uint32_t seq;
+    do {
+        seq = shared->seq;
+        out->key = shared->key;
+        out->timestamp_us = shared->timestamp_us;
+        out->controller_number = shared->controller_number;
+        out->data_length = shared->data_length;
+        for (int i = 0; i < STATE_TABLE_DATA_BYTES; i++) {
+            out->data[i] = shared->data[i];
+        }
+    } while ((seq & 1) != 0 || seq != shared->seq);
+    out->seq = seq;
+}
+
+#ifdef __cplusplus
+/// @brief Clears a table and fills in its header, gateway side
+void state_table_init(state_table *table);
+
+/**
+ * @brief Stores a received message in its entry, gateway side
+ *
+ * Writers must be serialized by the caller, readers are not blocked.
+ *
+ * @return false if the table is full and the message was not stored
+*/
+bool state_table_update(state_table *table, uint32_t PGN, uint8_t source, uint8_t controller_number, int64_t timestamp_us,
+    const uint8_t *data, int data_length_bytes);
+#endif
+
+#endif //STATE_TABLE_H
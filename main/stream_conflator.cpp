@@ -0,0 +1,97 @@
+/**
+ * @file stream_conflator.cpp
+ *
+ * @brief Keeps only the latest pending message of each periodic stream
+*/
+#include "stream_conflator.h"
+
+tStreamConflator::tStreamConflator()
+{
+    for (int i = 0; i < CONFLATE_STREAMS; i++) {
+        Entries[i].used = false;
+    }
+    Used = 0;
+    ReplacedCount = 0;
+    FullCount = 0;
+}
+
+uint32_t tStreamConflator::Key(const NMEA_msg &msg)
+{
+    return (static_cast<uint32_t>(msg.controller_number & (CONFLATE_MAX_CONTROLLERS - 1)) << 26) | (static_cast<uint32_t>(msg.PGN) << 8) | msg.source;
+}
+
+uint32_t tStreamConflator::Home(uint32_t key)
+{
+    uint32_t mixed = key * 0x9e3779b1u;
+    return (mixed >> 16) & (CONFLATE_STREAMS - 1);
+}
+
+int tStreamConflator::Find(uint32_t key) const
+{
+    uint32_t index = Home(key);
+    for (int i = 0; i < CONFLATE_STREAMS; i++) {
+        const conflate_entry &entry = Entries[index];
+        if (!entry.used) {
+            return -1;
+        }
+        if (entry.key == key) {
+            return index;
+        }
+        index = (index + 1) & (CONFLATE_STREAMS - 1);
+    }
+    return -1;
+}
+
+void tStreamConflator::Remove(int index)
+{
+    // Backward shift deletion keeps every probe chain unbroken without tombstones
+    uint32_t hole = index;
+    Entries[hole].used = false;
+    uint32_t next = (hole + 1) & (CONFLATE_STREAMS - 1);
+    while (Entries[next].used) {
+        uint32_t home = Home(Entries[next].key);
+        // Move the entry into the hole if the hole lies between its home slot and its current slot
+        if (((next - home) & (CONFLATE_STREAMS - 1)) >= ((next - hole) & (CONFLATE_STREAMS - 1))) {
+            Entries[hole] = Entries[next];
+            Entries[next].used = false;
+            hole = next;
+        }
+        next = (next + 1) & (CONFLATE_STREAMS - 1);
+    }
+    Used--;
+}
+
+bool tStreamConflator::Offer(const NMEA_msg &msg)
+{
+    uint32_t key = Key(msg);
+    int found = Find(key);
+    if (found >= 0) {
+        Entries[found].msg = msg;
+        ReplacedCount++;
+        return true;
+    }
+    if (Used >= CONFLATE_STREAMS) {
+        FullCount++;
+        return false;
+    }
+    uint32_t index = Home(key);
+    while (Entries[index].used) {
+        index = (index + 1) & (CONFLATE_STREAMS - 1);
+    }
+    Entries[index].used = true;
+    Entries[index].key = key;
+    Entries[index].msg = msg;
+    Used++;
+    return false;
+}
+
+bool tStreamConflator::Take(NMEA_msg &msg)
+{
+    int found = Find(Key(msg));
+    if (found < 0) {
+        return false;
+    }
+    msg = Entries[found].msg;
+    Remove(found);
+    return true;
+}
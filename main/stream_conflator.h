@@ -0,0 +1,71 @@
+/**
+ * @file stream_conflator.h
+ *
+ * @brief Keeps only the latest pending message of each periodic stream
+ *
+ * A stream is the messages of one controller, PGN and source. The first message of a stream that enters the queue is
+ * stored here as pending and queued as usual. While it waits in the queue, newer messages of the stream only replace
+ * the stored copy and are not queued. When the consumer takes the queued message out, Take() swaps in the stored
+ * copy, so the stream keeps its place in the queue but the latest value is processed.
+ *
+ * Only PGNs carrying periodic state should be offered. Events, requests and PGNs with an instance field would lose
+ * messages that are not newer values of the same thing.
+ *
+ * Streams are kept in an open addressing table of CONFLATE_STREAMS entries. When it is full, Offer() does not store
+ * the message and it is queued without conflation.
+ *
+ * No locking is done, the class has no ESP-IDF dependencies.
+*/
+#ifndef STREAM_CONFLATOR_H
+#define STREAM_CONFLATOR_H
+
+#include <stdint.h>
+#include "NMEA_msg.h"
+
+#define CONFLATE_STREAMS    32  //!< Streams that can be pending at once, must be a power of two
+#define CONFLATE_MAX_CONTROLLERS    64  //!< Controller numbers that fit the stream key
+
+/// @brief Latest message of a pending stream
+struct conflate_entry {
+    bool used;
+    uint32_t key;
+    NMEA_msg msg;
+};
+
+class tStreamConflator
+{
+protected:
+    conflate_entry Entries[CONFLATE_STREAMS];
+    int Used;
+
+    /// @brief Controller in bits 26-31, PGN in bits 8-25, source in bits 0-7
+    static uint32_t Key(const NMEA_msg &msg);
+    static uint32_t Home(uint32_t key);
+    int Find(uint32_t key) const;
+    void Remove(int index);
+
+public:
+    unsigned long ReplacedCount;    //!< Messages that replaced a pending one instead of being queued
+    unsigned long FullCount;        //!< Messages queued without conflation because the table was full
+
+    tStreamConflator();
+
+    /**
+     * @brief Offers a message that is about to be queued
+     * @param[in] msg
+     * @return true if it replaced the pending message of its stream and must not be queued
+    */
+    bool Offer(const NMEA_msg &msg);
+
+    /**
+     * @brief Swaps a message taken out of the queue for the latest of its stream and ends the pending state
+     * @param[in,out] msg
+     * @return true if msg was pending
+    */
+    bool Take(NMEA_msg &msg);
+
+    /// @brief Number of pending streams
+    int Count() const { return Used; }
+};
+
+#endif //STREAM_CONFLATOR_H
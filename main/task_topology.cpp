@@ -0,0 +1,151 @@
+/**
+ * @file task_topology.cpp
+ *
+ * @brief Priority, core and stack size of every gateway task in one table
+*/
+#include "task_topology.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#define TOPOLOGY_NVS_KEY_SIZE   16  // NVS keys are at most 15 characters
+
+static const char* TAG_TOPOLOGY = "TOPOLOGY";
+
+void topology_load_nvs(task_topology *table, size_t count)
+{
+    nvs_handle_t handle;
+    if (nvs_open(TOPOLOGY_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    char key[TOPOLOGY_NVS_KEY_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        task_topology &entry = table[i];
+        uint8_t priority;
+        int8_t core;
+        uint32_t stack_size;
+        snprintf(key, sizeof(key), "%s.p", entry.name);
+        if (nvs_get_u8(handle, key, &priority) == ESP_OK) {
+            entry.priority = priority;
+        }
+        snprintf(key, sizeof(key), "%s.c", entry.name);
+        if (nvs_get_i8(handle, key, &core) == ESP_OK) {
+            entry.core = core;
+        }
+        snprintf(key, sizeof(key), "%s.s", entry.name);
+        if (nvs_get_u32(handle, key, &stack_size) == ESP_OK) {
+            if (entry.stack_buffer != NULL && stack_size > entry.stack_buffer_size) {
+                ESP_LOGW(TAG_TOPOLOGY, "%s: stack size %" PRIu32 " is larger than the static stack, ignored", entry.name, stack_size);
+            } else {
+                entry.stack_size = stack_size;
+            }
+        }
+    }
+    nvs_close(handle);
+}
+
+task_topology* topology_find(task_topology *table, size_t count, const char *name)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(table[i].name, name) == 0) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+void topology_apply_layout(task_topology *table, size_t count, const topology_layout &layout)
+{
+    for (size_t i = 0; i < layout.override_count; i++) {
+        const topology_override &change = layout.overrides[i];
+        task_topology *entry = topology_find(table, count, change.name);
+        if (entry == NULL) {
+            continue; // task not built in this configuration
+        }
+        if (change.priority != TOPOLOGY_KEEP) {
+            entry->priority = change.priority;
+        }
+        if (change.core != TOPOLOGY_KEEP) {
+            entry->core = change.core;
+        }
+    }
+}
+
+esp_err_t topology_create_tasks(task_topology *table, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        task_topology &entry = table[i];
+        if (entry.function == NULL) {
+            continue;
+        }
+        ESP_LOGV(TAG_TOPOLOGY, "create task %s", entry.name);
+        if (entry.stack_buffer != NULL) {
+            *entry.handle = xTaskCreateStaticPinnedToCore(
+                entry.function,         // Pointer to the task entry function.
+                entry.name,             // A descriptive name for the task for debugging.
+                entry.stack_size,       // size of the task stack in bytes.
+                NULL,                   // Optional pointer to pvParameters
+                entry.priority,         // priority at which the task should run
+                entry.stack_buffer,     // Static stack
+                entry.task_buffer,      // Static task control block
+                entry.core
+            );
+        } else {
+            xTaskCreatePinnedToCore(
+                entry.function,         // Pointer to the task entry function.
+                entry.name,             // A descriptive name for the task for debugging.
+                entry.stack_size,       // size of the task stack in bytes.
+                NULL,                   // Optional pointer to pvParameters
+                entry.priority,         // priority at which the task should run
+                entry.handle,           // Optional pass back task handle
+                entry.core
+            );
+        }
+        if (*entry.handle == NULL)
+        {
+            ESP_LOGE(TAG_TOPOLOGY, "Unable to create task %s.", entry.name);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+void topology_print(const task_topology *table, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        ESP_LOGI(TAG_TOPOLOGY, "%-14s priority %2u core %d stack %" PRIu32 " %s", table[i].name,
+            (unsigned)table[i].priority, (int)table[i].core, table[i].stack_size,
+            table[i].stack_buffer != NULL ? "static" : "heap");
+    }
+}
+
+uint8_t topology_sweep_get_index()
+{
+    nvs_handle_t handle;
+    uint8_t index = 0;
+    if (nvs_open(TOPOLOGY_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return index;
+    }
+    if (nvs_get_u8(handle, TOPOLOGY_SWEEP_KEY, &index) != ESP_OK) {
+        index = 0;
+    }
+    nvs_close(handle);
+    return index;
+}
+
+esp_err_t topology_sweep_set_index(uint8_t index)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(TOPOLOGY_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_u8(handle, TOPOLOGY_SWEEP_KEY, index);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
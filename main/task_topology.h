@@ -0,0 +1,96 @@
+/**
+ * @file task_topology.h
+ *
+ * @brief Priority, core and stack size of every gateway task in one table
+ *
+ * The defaults come from menuconfig (NMEA Gateway Task Topology, see Kconfig.projbuild). They can be overridden
+ * without rebuilding by writing these keys to the NVS namespace TOPOLOGY_NVS_NAMESPACE:
+ *
+ * * `<name>.p` (u8) priority
+ * * `<name>.c` (i8) core
+ * * `<name>.s` (u32) stack size in bytes
+ *
+ * Task names are unique and at most 13 characters so the keys fit in an NVS key.
+ *
+ * Entries with a stack buffer are created with xTaskCreateStaticPinnedToCore, so no task memory comes from the heap.
+ * Their stack size can be lowered in NVS but not raised above the buffer.
+ *
+ * For the topology sweep, a layout is a list of priority and core changes applied on top of the table.
+*/
+#ifndef TASK_TOPOLOGY_H
+#define TASK_TOPOLOGY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+
+#define TOPOLOGY_NVS_NAMESPACE  "topology"
+#define TOPOLOGY_SWEEP_KEY      "sweep"     //!< u8, index of the next layout to measure
+#define TOPOLOGY_KEEP           -1          //!< Leave the priority or core of a task unchanged in a layout
+
+/// @brief Where and how one task runs
+struct task_topology {
+    const char *name;           //!< Unique task name, also the NVS key prefix
+    TaskFunction_t function;    //!< Task entry, NULL for entries that are not FreeRTOS tasks (the WASM pthread)
+    TaskHandle_t *handle;       //!< Where the created task handle is stored
+    uint32_t stack_size;        //!< Stack size in bytes
+    UBaseType_t priority;
+    BaseType_t core;
+    StackType_t *stack_buffer;  //!< Static stack, NULL to allocate the stack from the heap
+    StaticTask_t *task_buffer;  //!< Static task control block, required with stack_buffer
+    uint32_t stack_buffer_size; //!< Size of stack_buffer in bytes
+};
+
+/// @brief Change to one task in a layout
+struct topology_override {
+    const char *name;
+    int priority;               //!< New priority or TOPOLOGY_KEEP
+    int core;                   //!< New core or TOPOLOGY_KEEP
+};
+
+/// @brief A candidate layout measured by the topology sweep
+struct topology_layout {
+    const char *name;
+    const topology_override *overrides;
+    size_t override_count;
+};
+
+/**
+ * @brief Applies the NVS overrides to the table
+ *
+ * Requires nvs_flash_init(). Missing keys and a missing namespace leave the Kconfig values in place.
+*/
+void topology_load_nvs(task_topology *table, size_t count);
+
+/**
+ * @brief Applies a layout to the table
+*/
+void topology_apply_layout(task_topology *table, size_t count, const topology_layout &layout);
+
+/**
+ * @brief Finds an entry by name
+ * @return the entry or NULL
+*/
+task_topology* topology_find(task_topology *table, size_t count, const char *name);
+
+/**
+ * @brief Creates all entries with a task function, in table order
+ * @return ESP_ERR_NO_MEM if a task could not be created
+*/
+esp_err_t topology_create_tasks(task_topology *table, size_t count);
+
+/// @brief Prints the table
+void topology_print(const task_topology *table, size_t count);
+
+/**
+ * @brief Reads the index of the next layout to measure from NVS
+ * @return the index, 0 if it has not been set
+*/
+uint8_t topology_sweep_get_index();
+
+/// @brief Stores the index of the next layout to measure in NVS
+esp_err_t topology_sweep_set_index(uint8_t index);
+
+#endif //TASK_TOPOLOGY_H
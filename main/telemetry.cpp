@@ -0,0 +1,24 @@
+/**
+ * @file telemetry.cpp
+ *
+ * @brief Fixed layout binary status frame, replaces the text status dump when TELEMETRY is defined
+*/
+#include "telemetry.h"
+
+// tools/telemetry_decode.py unpacks the same layout, update both and TELEMETRY_VERSION together
+static_assert(sizeof(telemetry_controller) == 64, "telemetry_controller layout changed, update TELEMETRY_VERSION");
+static_assert(sizeof(telemetry_task) == 24, "telemetry_task layout changed, update TELEMETRY_VERSION");
+static_assert(offsetof(telemetry_frame<1>, controllers) == 112, "telemetry_frame layout changed, update TELEMETRY_VERSION");
+static_assert(sizeof(telemetry_frame<1>) == 600 + 64, "telemetry_frame layout changed, update TELEMETRY_VERSION");
+static_assert(sizeof(telemetry_frame<3>) == 600 + 3 * 64, "telemetry_frame layout changed, update TELEMETRY_VERSION");
+
+uint16_t telemetry_crc16(const uint8_t *data, size_t length, uint16_t crc)
+{
+    for (size_t i = 0; i < length; i++) {
+        crc ^= static_cast<uint16_t>(data[i]) << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+        }
+    }
+    return crc;
+}
@@ -0,0 +1,130 @@
+/**
+ * @file telemetry.h
+ *
+ * @brief Fixed layout binary status frame, replaces the text status dump when TELEMETRY is defined
+ *
+ * A frame carries the counters, queue depths, TWAI status and task CPU shares that GetStatus and print_real_time_stats
+ * print as text, in a fixed little endian layout that costs no formatting on the gateway. tools/telemetry_decode.py
+ * finds frames in a byte stream by TELEMETRY_MAGIC, checks the CRC and prints them.
+ *
+ * Fields are only ever added at the end of a struct, with TELEMETRY_VERSION incremented. size lets a decoder skip
+ * frames of a newer version it does not know.
+ *
+ * A frame holds every controller of the gateway, the count is a template parameter and is sent in controller_count.
+ * Everything after controllers moves with the count, a decoder takes the layout from the header.
+ *
+ * The header has no ESP-IDF dependencies.
+*/
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TELEMETRY_MAGIC         0x544b324eu //!< "N2KT" in memory
+#define TELEMETRY_VERSION       2
+#define TELEMETRY_MAX_TASKS     20          //!< Tasks beyond this are left out of a frame
+#define TELEMETRY_TASK_NAME     16          //!< Task name bytes, not terminated if the name is this long
+
+/// @brief Per controller counters, 64 bytes
+struct telemetry_controller {
+    uint32_t sent;                  //!< Messages sent
+    uint32_t send_failed;           //!< Failed send attempts
+    uint32_t retried_ok;            //!< Messages sent by a retry
+    uint32_t retry_expired;         //!< Messages that ran out of retries
+    uint32_t retry_dropped;         //!< Messages that did not fit the retry queue
+    uint32_t stale;                 //!< Messages dropped for being older than TX_STALE_US
+    uint32_t echo_suppressed;       //!< Own messages received again and dropped
+    uint32_t shed;                  //!< Messages not given to the WASM app under overload
+    uint32_t sampled_out;           //!< Messages left out by sampling under overload
+    uint32_t tx_queue_depth;        //!< Messages waiting in the send queue
+    uint32_t bits_per_s;            //!< Received bus load
+    uint32_t frames_per_s;
+    uint32_t utilization_percent;
+    uint32_t forwarded;             //!< Messages in the forward latency histogram
+    uint32_t forward_p50_us;        //!< Time from receipt until sent
+    uint32_t forward_p99_us;
+};
+
+/// @brief CPU share of one task over the last interval, 24 bytes
+struct telemetry_task {
+    char name[TELEMETRY_TASK_NAME];
+    uint16_t cpu_permille;          //!< Of all cores, like the percentage of print_real_time_stats
+    uint16_t reserved;
+    uint32_t stack_free_bytes;      //!< Stack high water mark
+};
+
+/// @brief One frame, 600 bytes plus 64 per controller
+template<int CONTROLLERS>
+struct telemetry_frame {
+    // Header
+    uint32_t magic;                 //!< TELEMETRY_MAGIC
+    uint16_t version;               //!< TELEMETRY_VERSION
+    uint16_t size;                  //!< sizeof(telemetry_frame)
+    uint32_t seq;                   //!< Incremented per frame, gaps are lost frames
+    uint16_t controller_count;      //!< CONTROLLERS, entries in controllers
+    uint16_t reserved;
+    int64_t uptime_us;              //!< esp_timer time the frame was filled
+
+    // Gateway
+    uint32_t rx_msgs;               //!< Messages read on all controllers
+    uint32_t tx_msgs;               //!< Messages sent on all controllers
+    uint32_t wasm_msgs;             //!< Messages processed by the WASM app
+    uint32_t rx_queue_depth;
+    uint32_t rx_drop_newest;
+    uint32_t rx_drop_oldest;
+    uint32_t rx_conflated;
+    uint32_t rate_limited;          //!< WASM app messages refused by the rate limits
+    uint32_t echo_recorded;
+    uint32_t echo_evicted;
+    uint32_t wasm_p50_us;           //!< Time from taking a message out of rx_queue until the WASM app returns
+    uint32_t wasm_p99_us;
+    uint32_t wasm_max_us;
+    uint32_t heap_free_bytes;
+    uint32_t heap_blocks;           //!< Allocated heap blocks
+
+    // TWAI controller
+    uint32_t twai_state;
+    uint32_t twai_msgs_to_tx;
+    uint32_t twai_msgs_to_rx;
+    uint32_t twai_rx_overrun;       //!< Lost to RX FIFO overrun
+    uint32_t twai_rx_missed;        //!< Lost to a full driver rx queue
+    uint32_t twai_tx_failed;
+    uint32_t twai_bus_errors;
+
+    telemetry_controller controllers[CONTROLLERS];
+
+    uint32_t task_count;            //!< Valid entries in tasks
+    telemetry_task tasks[TELEMETRY_MAX_TASKS];
+
+    uint16_t crc;                   //!< CRC-16/XMODEM of every byte before it
+    uint16_t reserved2;
+};
+
+/**
+ * @brief CRC-16/XMODEM, polynomial 0x1021 and initial value 0 like Python's binascii.crc_hqx(data, 0)
+ * @param[in] data
+ * @param[in] length
+ * @param[in] crc result for the preceding bytes, to run the CRC over several buffers
+*/
+uint16_t telemetry_crc16(const uint8_t *data, size_t length, uint16_t crc = 0);
+
+/**
+ * @brief Fills in the header and CRC of a frame that is ready to be sent
+ * @param[in,out] frame with every other field filled in
+ * @param[in] seq sequence number of the frame
+*/
+template<int CONTROLLERS>
+void telemetry_seal(telemetry_frame<CONTROLLERS> &frame, uint32_t seq)
+{
+    frame.magic = TELEMETRY_MAGIC;
+    frame.version = TELEMETRY_VERSION;
+    frame.size = sizeof(frame);
+    frame.seq = seq;
+    frame.controller_count = CONTROLLERS;
+    frame.reserved = 0;
+    frame.reserved2 = 0;
+    frame.crc = telemetry_crc16(reinterpret_cast<const uint8_t*>(&frame), offsetof(telemetry_frame<CONTROLLERS>, crc));
+}
+
+#endif //TELEMETRY_H
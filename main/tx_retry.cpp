@@ -0,0 +1,103 @@
+/**
+ * @file tx_retry.cpp
+ *
+ * @brief Holds messages that a controller failed to send so they can be retried before their deadline
+*/
+#include "tx_retry.h"
+
+tTxRetryQueue::tTxRetryQueue()
+{
+    for (int i = 0; i < TX_RETRY_SLOTS; i++) {
+        Entries[i].used = false;
+    }
+    Used = 0;
+    RetriedOkCount = 0;
+    ExpiredCount = 0;
+    DroppedCount = 0;
+}
+
+bool tTxRetryQueue::Add(const NMEA_msg &msg, int64_t now_us)
+{
+    for (int i = 0; i < TX_RETRY_SLOTS; i++) {
+        tx_retry_entry &entry = Entries[i];
+        if (!entry.used) {
+            entry.used = true;
+            entry.attempts = 0;
+            entry.deadline_us = now_us + TX_RETRY_DEADLINE_US;
+            entry.next_attempt_us = now_us + TX_RETRY_BACKOFF_US;
+            entry.msg = msg;
+            Used++;
+            return true;
+        }
+    }
+    DroppedCount++;
+    return false;
+}
+
+int tTxRetryQueue::NextDue(int64_t now_us)
+{
+    int due = -1;
+    if (Used == 0) {
+        return due;
+    }
+    for (int i = 0; i < TX_RETRY_SLOTS; i++) {
+        tx_retry_entry &entry = Entries[i];
+        if (!entry.used) {
+            continue;
+        }
+        if (now_us >= entry.deadline_us) {
+            entry.used = false;
+            Used--;
+            ExpiredCount++;
+            continue;
+        }
+        if (now_us >= entry.next_attempt_us && (due < 0 || entry.next_attempt_us < Entries[due].next_attempt_us)) {
+            due = i;
+        }
+    }
+    return due;
+}
+
+void tTxRetryQueue::Succeeded(int index)
+{
+    Entries[index].used = false;
+    Used--;
+    RetriedOkCount++;
+}
+
+void tTxRetryQueue::Remove(int index)
+{
+    Entries[index].used = false;
+    Used--;
+}
+
+void tTxRetryQueue::Failed(int index, int64_t now_us)
+{
+    tx_retry_entry &entry = Entries[index];
+    if (entry.attempts < 31) {
+        entry.attempts++;
+    }
+    int64_t backoff = TX_RETRY_BACKOFF_US;
+    for (int i = 0; i < entry.attempts && backoff < TX_RETRY_MAX_BACKOFF_US; i++) {
+        backoff *= 2;
+    }
+    if (backoff > TX_RETRY_MAX_BACKOFF_US) {
+        backoff = TX_RETRY_MAX_BACKOFF_US;
+    }
+    entry.next_attempt_us = now_us + backoff;
+}
+
+int64_t tTxRetryQueue::NextDueTime() const
+{
+    int64_t next = -1;
+    if (Used == 0) {
+        return next;
+    }
+    for (int i = 0; i < TX_RETRY_SLOTS; i++) {
+        const tx_retry_entry &entry = Entries[i];
+        if (entry.used && (next < 0 || entry.next_attempt_us < next)) {
+            next = entry.next_attempt_us;
+        }
+    }
+    return next;
+}
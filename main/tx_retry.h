@@ -0,0 +1,85 @@
+/**
+ * @file tx_retry.h
+ *
+ * @brief Holds messages that a controller failed to send so they can be retried before their deadline
+ *
+ * Each send task owns one tTxRetryQueue, so no locking is done. A failed message gets a deadline and is retried with
+ * exponential backoff. It is counted as:
+ *
+ * * retried OK - sent on a later attempt
+ * * expired - the deadline passed before it could be sent
+ * * dropped - the retry queue was full when it failed
+ *
+ * The time is passed in by the caller, the class has no ESP-IDF dependencies.
+*/
+#ifndef TX_RETRY_H
+#define TX_RETRY_H
+
+#include <stdint.h>
+#include "NMEA_msg.h"
+
+#define TX_RETRY_SLOTS          16      //!< Failed messages that can wait for a retry per controller
+#define TX_RETRY_DEADLINE_US    100000  //!< A failed message is given up after this long
+#define TX_RETRY_BACKOFF_US     2000    //!< Delay before the first retry, doubled after every failed retry
+#define TX_RETRY_MAX_BACKOFF_US 16000   //!< Upper limit for the retry delay
+
+/// @brief A message waiting to be retried
+struct tx_retry_entry {
+    bool used;
+    uint8_t attempts;
+    int64_t deadline_us;
+    int64_t next_attempt_us;
+    NMEA_msg msg;
+};
+
+class tTxRetryQueue
+{
+protected:
+    tx_retry_entry Entries[TX_RETRY_SLOTS];
+    int Used;
+
+public:
+    unsigned long RetriedOkCount;   //!< Messages sent on a retry
+    unsigned long ExpiredCount;     //!< Messages whose deadline passed
+    unsigned long DroppedCount;     //!< Messages that failed while the retry queue was full
+
+    tTxRetryQueue();
+
+    /**
+     * @brief Adds a message that failed to send
+     * @param[in] msg
+     * @param[in] now_us current time
+     * @return false if the queue was full and the message was dropped
+    */
+    bool Add(const NMEA_msg &msg, int64_t now_us);
+
+    /**
+     * @brief Finds the message that has been due for the longest time
+     *
+     * Entries whose deadline has passed are removed and counted as expired.
+     *
+     * @param[in] now_us current time
+     * @return index of the entry to retry, or -1 if nothing is due
+    */
+    int NextDue(int64_t now_us);
+
+    /// @brief Message stored at index returned by NextDue
+    const NMEA_msg& Msg(int index) const { return Entries[index].msg; }
+
+    /// @brief Records that the retry of entry index succeeded and frees it
+    void Succeeded(int index);
+
+    /// @brief Frees entry index without counting it, for messages the caller gives up on for its own reasons
+    void Remove(int index);
+
+    /// @brief Records that the retry of entry index failed and schedules the next attempt
+    void Failed(int index, int64_t now_us);
+
+    /// @brief Earliest time a retry is due, or -1 if the queue is empty
+    int64_t NextDueTime() const;
+
+    /// @brief Number of messages waiting
+    int Count() const { return Used; }
+};
+
+#endif //TX_RETRY_H
@@ -0,0 +1,36 @@
+/**
+ * @file wasm_image.cpp
+ *
+ * @brief WASM app image as stored in the wasm_app flash partition
+*/
+#include "wasm_image.h"
+#include "telemetry.h"
+#include <string.h>
+
+// tools/wasm_image.py packs the same layout
+static_assert(sizeof(wasm_image_header) == 16, "wasm_image_header layout changed, update WASM_IMAGE_VERSION");
+
+static const uint8_t wasm_binary_magic[8] = {0x00, 'a', 's', 'm', 0x01, 0x00, 0x00, 0x00}; //!< "\0asm" and version 1
+
+void wasm_image_header_init(wasm_image_header &header, const uint8_t *module, uint32_t size)
+{
+    header.magic = WASM_IMAGE_MAGIC;
+    header.version = WASM_IMAGE_VERSION;
+    header.header_size = sizeof(wasm_image_header);
+    header.size = size;
+    header.crc = telemetry_crc16(module, size);
+    header.reserved = 0;
+}
+
+bool wasm_image_header_valid(const wasm_image_header &header, size_t capacity)
+{
+    return header.magic == WASM_IMAGE_MAGIC && header.version == WASM_IMAGE_VERSION &&
+        header.header_size == sizeof(wasm_image_header) && header.size >= sizeof(wasm_binary_magic) &&
+        capacity >= sizeof(wasm_image_header) && header.size <= capacity - sizeof(wasm_image_header);
+}
+
+bool wasm_image_check(const uint8_t *module, uint32_t size, uint16_t crc)
+{
+    return size >= sizeof(wasm_binary_magic) && memcmp(module, wasm_binary_magic, sizeof(wasm_binary_magic)) == 0 &&
+        telemetry_crc16(module, size) == crc;
+}
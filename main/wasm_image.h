@@ -0,0 +1,55 @@
+/**
+ * @file wasm_image.h
+ *
+ * @brief WASM app image as stored in the wasm_app flash partition
+ *
+ * The partition starts with a wasm_image_header followed by the module bytes (a .wasm file). The header is written
+ * last, so an interrupted write leaves an erased header and the gateway falls back to the app built into the
+ * firmware. tools/wasm_image.py builds an image from a .wasm file for parttool.py.
+ *
+ * The header has no ESP-IDF dependencies.
+*/
+#ifndef WASM_IMAGE_H
+#define WASM_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WASM_IMAGE_MAGIC        0x574b324eu //!< "N2KW" in memory
+#define WASM_IMAGE_VERSION      1
+
+/// @brief Start of the partition, 16 bytes, little endian
+struct wasm_image_header {
+    uint32_t magic;                 //!< WASM_IMAGE_MAGIC
+    uint16_t version;               //!< WASM_IMAGE_VERSION
+    uint16_t header_size;           //!< sizeof(wasm_image_header), the module starts here
+    uint32_t size;                  //!< Module bytes
+    uint16_t crc;                   //!< CRC-16/XMODEM of the module, see telemetry_crc16
+    uint16_t reserved;
+};
+
+/**
+ * @brief Fills in a header for a module
+ * @param[out] header
+ * @param[in] module
+ * @param[in] size
+*/
+void wasm_image_header_init(wasm_image_header &header, const uint8_t *module, uint32_t size);
+
+/**
+ * @brief Checks a header read from a partition
+ * @param[in] header
+ * @param[in] capacity partition size in bytes
+ * @return true if the header is valid and the module fits the partition
+*/
+bool wasm_image_header_valid(const wasm_image_header &header, size_t capacity);
+
+/**
+ * @brief Checks that a module is a WASM binary and matches its CRC
+ * @param[in] module
+ * @param[in] size
+ * @param[in] crc from the header or CMD_MODULE_BEGIN
+*/
+bool wasm_image_check(const uint8_t *module, uint32_t size, uint16_t crc);
+
+#endif //WASM_IMAGE_H
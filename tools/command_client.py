@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Sends framed commands to a gateway built with COMMAND_CHANNEL (see main/command_channel.h).
+
+    python3 tools/command_client.py /dev/ttyAMA0 ping
+    python3 tools/command_client.py /dev/ttyAMA0 status
+    python3 tools/command_client.py /dev/ttyAMA0 config --mode 2 --rate 0,129025,-1,10,5 --critical 127250,129026
+    python3 tools/command_client.py /dev/ttyAMA0 inject 0 3 129025 42 0011223344556677 --count 1000 --per-frame 16
+    python3 tools/command_client.py /dev/ttyAMA0 module app.wasm --persist
+    python3 tools/command_client.py /dev/ttyAMA0 module --partition
+
+The device can be any serial port or pty, e.g. the pty printed by host/command_host, the host build of the command
+channel (see README). Serial ports need pyserial.
+"""
+import argparse
+import binascii
+import os
+import select
+import struct
+import sys
+import time
+
+SYNC = b"\xa5\x5a"
+MAX_PAYLOAD = 512
+RESPONSE = 0x80
+PING, STATUS = 0x01, 0x02
+CONFIG_BEGIN, CONFIG_MODE, CONFIG_RATE, CONFIG_CRITICAL, CONFIG_COMMIT = 0x10, 0x11, 0x12, 0x13, 0x1F
+INJECT = 0x20
+MODULE_BEGIN, MODULE_DATA, MODULE_LOAD, MODULE_COMMIT = 0x30, 0x31, 0x32, 0x3F
+MODULE_PERSIST = 0x01
+STATUS_CODES = {0: "OK", 1: "bad length", 2: "unknown command", 3: "out of range", 4: "no transaction",
+                5: "table full", 6: "busy loading the last module", 7: "module check failed"}
+STATUS_FIELDS = ("config_generation", "frames", "crc_errors", "length_errors", "injected", "inject_dropped", "mode",
+                 "module_swaps", "module_swap_us")
+
+
+def encode(frame_type, seq, payload=b""):
+    header = struct.pack("<BBH", frame_type, seq, len(payload))
+    return SYNC + header + payload + struct.pack("<H", binascii.crc_hqx(header + payload, 0))
+
+
+class Channel:
+    def __init__(self, device, baud, timeout):
+        if device.startswith("/dev/tty") and not device.startswith("/dev/ttys"):
+            import serial
+            self.port = serial.Serial(device, baud, timeout=timeout)
+            self.read = self.port.read
+            self.write = self.port.write
+        else:
+            fd = os.open(device, os.O_RDWR | os.O_NOCTTY)
+            self.read = lambda n: os.read(fd, n) if select.select([fd], [], [], 0.05)[0] else b""
+            self.write = lambda data: os.write(fd, data)
+        self.timeout = timeout
+        self.seq = 0
+        self.buffer = b""
+
+    def send(self, frame_type, payload=b""):
+        self.seq = (self.seq + 1) & 0xFF
+        self.write(encode(frame_type, self.seq, payload))
+        return self.seq
+
+    def receive(self):
+        """Returns (type, seq, payload) of the next valid frame, or None on timeout."""
+        deadline = time.monotonic() + self.timeout
+        while time.monotonic() < deadline:
+            start = self.buffer.find(SYNC)
+            if start >= 0 and len(self.buffer) - start >= 6:
+                frame_type, seq, length = struct.unpack_from("<BBH", self.buffer, start + 2)
+                end = start + 6 + length + 2
+                if length > MAX_PAYLOAD:
+                    self.buffer = self.buffer[start + 1:]
+                    continue
+                if len(self.buffer) >= end:
+                    body = self.buffer[start + 2:end - 2]
+                    (crc,) = struct.unpack_from("<H", self.buffer, end - 2)
+                    if binascii.crc_hqx(body, 0) != crc:
+                        self.buffer = self.buffer[start + 1:]
+                        continue
+                    self.buffer = self.buffer[end:]
+                    return frame_type, seq, body[4:]
+            self.buffer += self.read(256)
+        return None
+
+    def request(self, frame_type, payload=b"", retries=3):
+        """Sends a request and returns the payload of its response, the status code first."""
+        for _ in range(retries):
+            seq = self.send(frame_type, payload)
+            while True:
+                response = self.receive()
+                if response is None:
+                    break
+                if response[0] == frame_type | RESPONSE and response[1] == seq:
+                    return response[2]
+        raise TimeoutError("no response to command 0x%02x" % frame_type)
+
+
+def check(channel, frame_type, payload=b""):
+    response = channel.request(frame_type, payload)
+    if response[0] != 0:
+        sys.exit("command 0x%02x failed: %s" % (frame_type, STATUS_CODES.get(response[0], response[0])))
+    return response[1:]
+
+
+def inject_record(controller, priority, pgn, source, data):
+    return struct.pack("<BBIBB", controller, priority, pgn, source, len(data)) + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device")
+    parser.add_argument("--baud", type=int, default=921600)
+    parser.add_argument("--timeout", type=float, default=0.5)
+    commands = parser.add_subparsers(dest="command", required=True)
+    commands.add_parser("ping")
+    commands.add_parser("status")
+    config = commands.add_parser("config", help="apply a configuration in one transaction")
+    config.add_argument("--mode", type=int, choices=range(4))
+    config.add_argument("--rate", action="append", default=[], metavar="CTRL,PGN,SOURCE,RATE,BURST",
+                        help="rate limit rule like SetTxRate, -1 matches any, burst 0 removes the rule")
+    config.add_argument("--critical", metavar="PGN,...", help="PGNs never shed, empty string for none")
+    inject = commands.add_parser("inject", help="send messages on a bus")
+    inject.add_argument("controller", type=int, help="controller number, the gateway rejects unknown ones")
+    inject.add_argument("priority", type=int, choices=range(8))
+    inject.add_argument("pgn", type=int)
+    inject.add_argument("source", type=int)
+    inject.add_argument("data", help="hex payload")
+    inject.add_argument("--count", type=int, default=1)
+    inject.add_argument("--per-frame", type=int, default=1, help="messages per CMD_INJECT frame")
+    module = commands.add_parser("module", help="swap in a new WASM app")
+    module.add_argument("wasm", nargs="?", help=".wasm file to stream")
+    module.add_argument("--persist", action="store_true", help="also store it in the wasm_app partition")
+    module.add_argument("--partition", action="store_true", help="swap in the app stored in the wasm_app partition")
+    args = parser.parse_args()
+
+    channel = Channel(args.device, args.baud, args.timeout)
+    if args.command == "ping":
+        start = time.monotonic()
+        check(channel, PING)
+        print("pong in %.1f ms" % ((time.monotonic() - start) * 1000))
+    elif args.command == "status":
+        values = struct.unpack("<6IB2I", check(channel, STATUS)[:33])
+        for name, value in zip(STATUS_FIELDS, values):
+            print("%s: %d" % (name, value))
+    elif args.command == "config":
+        check(channel, CONFIG_BEGIN)
+        if args.mode is not None:
+            check(channel, CONFIG_MODE, bytes([args.mode]))
+        for rule in args.rate:
+            controller, pgn, source, rate, burst = (int(v) for v in rule.split(","))
+            check(channel, CONFIG_RATE, struct.pack("<bihII", controller, pgn, source, rate, burst))
+        if args.critical is not None:
+            pgns = [int(v) for v in args.critical.split(",") if v]
+            check(channel, CONFIG_CRITICAL, struct.pack("<%dI" % len(pgns), *pgns))
+        check(channel, CONFIG_COMMIT)
+        print("committed")
+    elif args.command == "inject":
+        record = inject_record(args.controller, args.priority, args.pgn, args.source, bytes.fromhex(args.data))
+        per_frame = max(1, min(args.per_frame, MAX_PAYLOAD // len(record)))
+        sent = 0
+        while sent < args.count:
+            n = min(per_frame, args.count - sent)
+            channel.send(INJECT, record * n)
+            sent += n
+        print("%d messages sent in %d frames, see status for drops" % (sent, (sent + per_frame - 1) // per_frame))
+    elif args.command == "module":
+        swaps = struct.unpack_from("<I", check(channel, STATUS), 25)[0]
+        if args.partition:
+            check(channel, MODULE_LOAD)
+        elif args.wasm:
+            with open(args.wasm, "rb") as f:
+                data = f.read()
+            flags = MODULE_PERSIST if args.persist else 0
+            check(channel, MODULE_BEGIN, struct.pack("<IHB", len(data), binascii.crc_hqx(data, 0), flags))
+            chunk = MAX_PAYLOAD - 4
+            for offset in range(0, len(data), chunk):
+                check(channel, MODULE_DATA, struct.pack("<I", offset) + data[offset:offset + chunk])
+            check(channel, MODULE_COMMIT)
+        else:
+            parser.error("module needs a .wasm file or --partition")
+        deadline = time.monotonic() + 10
+        while time.monotonic() < deadline:
+            status = struct.unpack_from("<2I", check(channel, STATUS), 25)
+            if status[0] != swaps:
+                print("swapped in, swap-over took %d us" % status[1])
+                break
+            time.sleep(0.1)
+        else:
+            sys.exit("not swapped in, see the gateway log")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""Decodes the binary telemetry frames of main/telemetry.h.
+
+Frames are found by their magic in any byte stream, e.g. the console output of a gateway built with TELEMETRY, which
+also carries the log lines. Frames with a bad CRC or an unknown version are skipped. The number of controllers is read
+from each frame.
+
+    python3 tools/telemetry_decode.py /dev/ttyUSB0          # serial port, needs pyserial
+    python3 tools/telemetry_decode.py capture.bin           # recorded console output
+    python3 tools/telemetry_decode.py - --csv < capture.bin # one CSV line per frame
+"""
+import argparse
+import binascii
+import struct
+import sys
+
+MAGIC = b"N2KT"
+VERSION = 2
+
+HEADER = struct.Struct("<4sHHIHHq")
+GATEWAY_FIELDS = ("rx_msgs", "tx_msgs", "wasm_msgs", "rx_queue_depth", "rx_drop_newest", "rx_drop_oldest",
+                  "rx_conflated", "rate_limited", "echo_recorded", "echo_evicted", "wasm_p50_us", "wasm_p99_us",
+                  "wasm_max_us", "heap_free_bytes", "heap_blocks", "twai_state", "twai_msgs_to_tx", "twai_msgs_to_rx",
+                  "twai_rx_overrun", "twai_rx_missed", "twai_tx_failed", "twai_bus_errors")
+CONTROLLER_FIELDS = ("sent", "send_failed", "retried_ok", "retry_expired", "retry_dropped", "stale", "echo_suppressed",
+                     "shed", "sampled_out", "tx_queue_depth", "bits_per_s", "frames_per_s", "utilization_percent",
+                     "forwarded", "forward_p50_us", "forward_p99_us")
+MAX_TASKS = 20
+GATEWAY = struct.Struct("<%dI" % len(GATEWAY_FIELDS))
+CONTROLLER = struct.Struct("<%dI" % len(CONTROLLER_FIELDS))
+TASK = struct.Struct("<16sHHI")
+TAIL = struct.Struct("<HH")
+
+
+
+def frame_size(controllers):
+    """Size of a frame with this many controllers."""
+    return HEADER.size + GATEWAY.size + controllers * CONTROLLER.size + 4 + MAX_TASKS * TASK.size + TAIL.size
+
+
+assert frame_size(3) == 792
+
+
+def decode(frame):
+    """Returns the fields of one frame as a dict, controllers and tasks as lists of dicts."""
+    magic, version, size, seq, controller_count, _, uptime_us = HEADER.unpack_from(frame, 0)
+    result = {"seq": seq, "uptime_us": uptime_us}
+    offset = HEADER.size
+    result.update(zip(GATEWAY_FIELDS, GATEWAY.unpack_from(frame, offset)))
+    offset += GATEWAY.size
+    result["controllers"] = []
+    for _ in range(controller_count):
+        result["controllers"].append(dict(zip(CONTROLLER_FIELDS, CONTROLLER.unpack_from(frame, offset))))
+        offset += CONTROLLER.size
+    (task_count,) = struct.unpack_from("<I", frame, offset)
+    offset += 4
+    result["tasks"] = []
+    for i in range(min(task_count, MAX_TASKS)):
+        name, cpu_permille, _, stack_free = TASK.unpack_from(frame, offset + i * TASK.size)
+        result["tasks"].append({"name": name.split(b"\0")[0].decode(errors="replace"),
+                                "cpu_permille": cpu_permille, "stack_free_bytes": stack_free})
+    return result
+
+
+def frames(read):
+    """Yields every valid frame found in the bytes returned by read(), which returns b"" at the end."""
+    buffer = b""
+    while True:
+        chunk = read()
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(MAGIC)
+            if start < 0:
+                buffer = buffer[-(len(MAGIC) - 1):]
+                break
+            if len(buffer) - start < HEADER.size:
+                buffer = buffer[start:]
+                break
+            _, version, size, _, controller_count, _, _ = HEADER.unpack_from(buffer, start)
+            if version != VERSION or size != frame_size(controller_count):
+                buffer = buffer[start + 1:]  # newer firmware or a false match in the log text
+                continue
+            if len(buffer) - start < size:
+                buffer = buffer[start:]
+                break
+            frame = buffer[start:start + size]
+            (crc,) = struct.unpack_from("<H", frame, size - TAIL.size)
+            if binascii.crc_hqx(frame[:size - TAIL.size], 0) != crc:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + size:]
+            yield decode(frame)
+
+
+def print_frame(frame, previous):
+    lost = frame["seq"] - previous["seq"] - 1 if previous else 0
+    print("seq %d at %.3f s%s" % (frame["seq"], frame["uptime_us"] / 1e6, ", %d frames lost" % lost if lost > 0 else ""))
+    print("  rx %d tx %d wasm %d (p50 %d us p99 %d us) rx queue %d, dropped newest %d oldest %d, conflated %d" % (
+        frame["rx_msgs"], frame["tx_msgs"], frame["wasm_msgs"], frame["wasm_p50_us"], frame["wasm_p99_us"],
+        frame["rx_queue_depth"], frame["rx_drop_newest"], frame["rx_drop_oldest"], frame["rx_conflated"]))
+    print("  twai state %d to tx %d to rx %d, overrun %d missed %d tx failed %d bus errors %d" % (
+        frame["twai_state"], frame["twai_msgs_to_tx"], frame["twai_msgs_to_rx"], frame["twai_rx_overrun"],
+        frame["twai_rx_missed"], frame["twai_tx_failed"], frame["twai_bus_errors"]))
+    for i, c in enumerate(frame["controllers"]):
+        print("  C%d sent %d failed %d retried %d expired %d stale %d echo %d shed %d, queue %d, %d frames/s %d%%, "
+              "fwd p50 %d us p99 %d us" % (i, c["sent"], c["send_failed"], c["retried_ok"], c["retry_expired"],
+                                           c["stale"], c["echo_suppressed"], c["shed"], c["tx_queue_depth"],
+                                           c["frames_per_s"], c["utilization_percent"], c["forward_p50_us"],
+                                           c["forward_p99_us"]))
+    print("  heap free %d blocks %d, rate limited %d" % (frame["heap_free_bytes"], frame["heap_blocks"],
+                                                          frame["rate_limited"]))
+    print("  " + ", ".join("%s %.1f%%" % (t["name"], t["cpu_permille"] / 10) for t in frame["tasks"]))
+
+
+def print_csv(frame, header):
+    columns = [k for k in frame if k not in ("controllers", "tasks")]
+    values = [frame[k] for k in columns]
+    for i, c in enumerate(frame["controllers"]):
+        columns += ["c%d_%s" % (i, k) for k in CONTROLLER_FIELDS]
+        values += [c[k] for k in CONTROLLER_FIELDS]
+    if header:
+        print(",".join(columns))
+    print(",".join(str(v) for v in values))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="serial port, file, or - for stdin")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--csv", action="store_true", help="print gateway and controller fields as CSV")
+    args = parser.parse_args()
+
+    if args.source == "-":
+        read = lambda: sys.stdin.buffer.read1(4096)
+    elif args.source.startswith("/dev/") or args.source.upper().startswith("COM"):
+        import serial
+        port = serial.Serial(args.source, args.baud)
+        read = lambda: port.read(max(1, port.in_waiting))  # blocks until data arrives, never returns b""
+    else:
+        source = open(args.source, "rb")
+        read = lambda: source.read(4096)
+
+    previous = None
+    for frame in frames(read):
+        if args.csv:
+            print_csv(frame, previous is None)
+        else:
+            print_frame(frame, previous)
+        previous = frame
+
+
+if __name__ == "__main__":
+    main()
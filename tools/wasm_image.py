@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+"""Wraps a .wasm module in the header of main/wasm_image.h for the wasm_app partition.
+
+    python3 tools/wasm_image.py app.wasm app.img
+    parttool.py --port /dev/ttyUSB0 write_partition --partition-name wasm_app --input app.img
+
+A gateway built with WASM_HOT_SWAP runs the module in the partition at boot. To swap it in without a reboot, stream it
+with `tools/command_client.py <device> module app.wasm` instead.
+"""
+import argparse
+import binascii
+import struct
+import sys
+
+MAGIC = 0x574B324E
+VERSION = 1
+HEADER = struct.Struct("<IHHIHH")
+WASM_MAGIC = b"\x00asm\x01\x00\x00\x00"
+
+
+def image(module):
+    return HEADER.pack(MAGIC, VERSION, HEADER.size, len(module), binascii.crc_hqx(module, 0), 0) + module
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("module", help=".wasm file")
+    parser.add_argument("output", help="partition image")
+    args = parser.parse_args()
+    with open(args.module, "rb") as f:
+        module = f.read()
+    if not module.startswith(WASM_MAGIC):
+        sys.exit("%s is not a WASM binary" % args.module)
+    with open(args.output, "wb") as f:
+        f.write(image(module))
+    print("%d byte module, %d byte image" % (len(module), HEADER.size + len(module)))
+
+
+if __name__ == "__main__":
+    main()